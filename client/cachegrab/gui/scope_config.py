@@ -274,22 +274,28 @@ class ProbeConfig(wx.Panel):
         font = self.status.GetFont()
         font.SetWeight(wx.BOLD)
         self.status.SetFont(font)
+
+        # Start from the shape the target core reports
+        if probe.is_enabled():
+            shape = (probe.associativity, probe.num_sets, probe.line_size)
+        else:
+            shape = probe.default_shape()
         
         lbl_assoc = wx.StaticText(self, wx.ID_ANY, "Associativity")
         self.int_assoc = IntCtrl(self, wx.ID_ANY)
-        self.int_assoc.SetValue(self.probe.associativity)
+        self.int_assoc.SetValue(shape[0])
         assoc.Add(lbl_assoc, 1, wx.ALIGN_CENTER | wx.RIGHT, 5)
         assoc.Add(self.int_assoc, 0, wx.ALIGN_RIGHT)
 
         lbl_nset = wx.StaticText(self, wx.ID_ANY, "Number of Sets")
         self.int_nset = IntCtrl(self, wx.ID_ANY)
-        self.int_nset.SetValue(self.probe.num_sets)
+        self.int_nset.SetValue(shape[1])
         nset.Add(lbl_nset, 1, wx.ALIGN_CENTER | wx.RIGHT, 5)
         nset.Add(self.int_nset, 0, wx.ALIGN_RIGHT)
 
         lbl_line = wx.StaticText(self, wx.ID_ANY, "Size of Line")
         self.int_line = IntCtrl(self, wx.ID_ANY)
-        self.int_line.SetValue(self.probe.line_size)
+        self.int_line.SetValue(shape[2])
         line.Add(lbl_line, 1, wx.ALIGN_CENTER | wx.RIGHT, 5)
         line.Add(self.int_line, 0, wx.ALIGN_RIGHT)
 
@@ -34,6 +34,11 @@ from .base_source import CaptureSource
 class Probe:
     """Represent a single probe"""
 
+    # Output modes, reported for each set of a sample
+    OUTPUT_COUNT = "count"
+    OUTPUT_WAYS = "ways"
+    OUTPUT_BITMASK = "bitmask"
+
     # Pubsub events
     ENABLED_CHANGED = "PROBE_ENABLED_CHANGED"
     CONFIG_CHANGED = "PROBE_CONFIG_CHANGED"
@@ -48,6 +53,12 @@ class Probe:
         self.line_size = 1
         self.low_set = -1
         self.high_set = -1
+        self.output = self.OUTPUT_COUNT
+        self.event = 0
+        self.refills = 0
+        self.sets = []
+        self.group_size = 0
+        self.calibrated = False
         
         self._enabled = False
 
@@ -58,19 +69,37 @@ class Probe:
         if resp_ok(resp):
             self.synchronize_desc(resp["probe"])
 
-    def enable(self, assoc, nset, lsize):
-        """Enable the probe"""
-        self.associativity = assoc
-        self.num_sets = nset
-        self.line_size = lsize
+    def default_shape(self):
+        """Return the associativity, number of sets and line size to enable
+        the probe with: the shape the target core reports for the cache,
+        or the current shape if it reports none."""
+        shape = self.scope.cache_shape(self.name)
+        if shape is None:
+            return (self.associativity, self.num_sets, self.line_size)
+        return shape
+
+    def enable(self, assoc=None, nset=None, lsize=None, event=None):
+        """Enable the probe
+
+        A shape left out is taken from default_shape. Event selects the PMU
+        event counted by the probe. The default of 0 counts the refills or
+        mispredictions matching the probe."""
+        default = self.default_shape()
+        self.associativity = assoc if assoc is not None else default[0]
+        self.num_sets = nset if nset is not None else default[1]
+        self.line_size = lsize if lsize is not None else default[2]
+        if event is not None:
+            self.event = event
 
         url = "/%s/connect" % self.name
         self.scope.request(url,
                            num_sets = self.num_sets,
                            associativity = self.associativity,
-                           line_size = self.line_size)
+                           line_size = self.line_size,
+                           event = self.event)
         if self.low_set >= 0 and self.high_set >= 0:
-            self.configure(self.low_set, self.high_set)
+            self.configure(self.low_set, self.high_set, self.output,
+                           self.refills, self.sets, self.group_size)
         self.synchronize()
         return self._enabled
 
@@ -91,6 +120,8 @@ class Probe:
             self.associativity = shape["associativity"]
             self.num_sets = shape["num_sets"]
             self.line_size = shape["line_size"]
+            self.event = desc.get("event", 0)
+            self.calibrated = desc.get("calibrated", False)
             if self.low_set < 0:
                 self.low_set = self.num_sets - 1
             if self.high_set < 0:
@@ -100,14 +131,34 @@ class Probe:
             config = desc["config"]
             self.low_set = config["set_start"]
             self.high_set = config["set_end"]
+            self.output = config.get("output", self.OUTPUT_COUNT)
+            self.refills = config.get("refills", 0)
+            self.sets = parse_sets(config.get("sets", ""))
+            self.group_size = config.get("group_size", 0)
             pub.sendMessage(self.CONFIG_CHANGED)
 
-    def configure(self, low, high):
+    def configure(self, low, high, output=None, refills=None, sets=None,
+                  group_size=None):
         """Configure the probe.
 
         Captures cache sets [low, high). If low > high, then the
-        collection wraps around.
+        collection wraps around. Output selects what is reported per set,
+        and defaults to the current mode. Refills is the number of refill
+        passes after each sample, 0 for the driver default, or "auto" to
+        calibrate it on the target core. Sets lists the only sets of the
+        range to probe, and samples then hold just those sets. An empty
+        list probes the whole range. A non-zero group_size probes the sets
+        coarse to fine in groups of that many sets, and only measures the
+        sets of the groups which missed.
         Return if the configuration succeeded."""
+        if output is None:
+            output = self.output
+        if refills is None:
+            refills = self.refills
+        if sets is None:
+            sets = self.sets
+        if group_size is None:
+            group_size = self.group_size
         if not (0 <= low < self.num_sets):
             return False
         if not (0 < high <= self.num_sets):
@@ -115,10 +166,17 @@ class Probe:
         if high == low:
             return False
 
+        params = {}
+        if len(sets) > 0:
+            params["sets"] = format_sets(sets)
         url = "/%s/configuration" % self.name
         resp = self.scope.request(url,
                                   set_start = low,
-                                  set_end = high)
+                                  set_end = high,
+                                  output = output,
+                                  refills = refills,
+                                  group_size = group_size,
+                                  **params)
         self.synchronize()
         return resp_ok(resp)
 
@@ -136,6 +194,11 @@ class Probe:
             "line_size": self.line_size,
             "config_set_low": self.low_set,
             "config_set_high": self.high_set,
+            "config_output": self.output,
+            "event": self.event,
+            "config_refills": self.refills,
+            "config_sets": self.sets,
+            "config_group_size": self.group_size,
         }
         return desc
 
@@ -148,8 +211,30 @@ class Probe:
         self.line_size = desc["line_size"]
         self.low_set = desc["config_set_low"]
         self.high_set = desc["config_set_high"]
+        self.output = desc.get("config_output", self.OUTPUT_COUNT)
+        self.event = desc.get("event", 0)
+        self.refills = desc.get("config_refills", 0)
+        self.sets = desc.get("config_sets", [])
+        self.group_size = desc.get("config_group_size", 0)
         return self
 
+    def probed_set_count(self):
+        """Return the number of sets held by each sample."""
+        if self.low_set < self.high_set:
+            sets = range(self.low_set, self.high_set)
+        else:
+            sets = range(self.low_set, self.num_sets) + range(self.high_set)
+        if len(self.sets) > 0:
+            sets = [s for s in sets if s in self.sets]
+        return len(sets)
+
+    def group_count(self):
+        """Return the number of groups the probed sets are split into, 0
+        if the probe isn't probed by groups."""
+        if self.group_size <= 0:
+            return 0
+        return -(-self.probed_set_count() // self.group_size)
+
 class ScopeSource(CaptureSource):
     """Retrieve the samples from a dataset."""
 
@@ -182,6 +267,7 @@ class ScopeSource(CaptureSource):
         self._tcpu = 0
         self._scpu = 0
         self.num_cores = 0
+        self.caches = []
 
         self.stalling_cutoff = 10000000
         self.timeout = 10000
@@ -191,6 +277,41 @@ class ScopeSource(CaptureSource):
         self.ta_name = ""
         self.ta_cbuf = ""
         self.debug = False
+        self.stream = False
+        self.timer = False
+        self.deferred = False
+        self.packed = False
+        self.sparse = False
+        self.pretrigger = 0
+        self.batch = 0
+        self.accumulate = 0
+
+    def _retrieve_histogram(self, shape):
+        """Get the histogram accumulated over the last captures, one row per
+        sample slot. The first column counts the samples added to the row."""
+        rows, width = shape["rows"], shape["width"]
+        try:
+            f = urllib.urlopen(self._host + "/capture/histogram")
+            if f.getcode() != 200:
+                return np.empty([0,0], dtype=np.uint32)
+            arr = np.frombuffer(f.read(), dtype="<u4")
+            return arr.reshape(rows, width)
+        except IOError as e:
+            self.disconnect()
+        return np.empty([0,0], dtype=np.uint32)
+
+    def _retrieve_timing(self):
+        """Get the header of each sample as rows of timestamp, sequence
+        number and missed sampling slots."""
+        arr = self._retrieve_measurement("timing")
+        if arr.size == 0:
+            return np.empty([0,3], dtype=np.uint64)
+        hdr = np.dtype([("timestamp", "<u8"), ("seq", "<u4"),
+                        ("missed", "<u4")])
+        rows = np.ascontiguousarray(arr[:, :hdr.itemsize]).view(hdr)[:, 0]
+        return np.column_stack([rows["timestamp"],
+                                rows["seq"].astype(np.uint64),
+                                rows["missed"].astype(np.uint64)])
 
     def _retrieve_measurement(self, type_):
         """Get the measurements for the specified type of probe."""
@@ -210,10 +331,15 @@ class ScopeSource(CaptureSource):
     def set_capture_params(self,
                            max_samples=None, time_delta=None,
                            ta_command=None, ta_name=None,
-                           ta_cbuf=None, debug=None
+                           ta_cbuf=None, debug=None, stream=None,
+                           timer=None, deferred=None, packed=None,
+                           pretrigger=None, stalling_cutoff=None,
+                           batch=None, accumulate=None, sparse=None
     ):
         """Set the parameters for capture."""
-        self.stalling_cutoff = 10000000
+        if stalling_cutoff is None:
+            stalling_cutoff = 10000000
+        self.stalling_cutoff = stalling_cutoff
         self.timeout = 100000
         
         if max_samples is not None:
@@ -228,6 +354,22 @@ class ScopeSource(CaptureSource):
             self.ta_cbuf = ta_cbuf
         if debug is not None:
             self.debug = debug
+        if stream is not None:
+            self.stream = stream
+        if timer is not None:
+            self.timer = timer
+        if deferred is not None:
+            self.deferred = deferred
+        if packed is not None:
+            self.packed = packed
+        if sparse is not None:
+            self.sparse = sparse
+        if pretrigger is not None:
+            self.pretrigger = pretrigger
+        if batch is not None:
+            self.batch = batch
+        if accumulate is not None:
+            self.accumulate = accumulate
 
     def capture_once(self):
         """Return a sample from the scope"""
@@ -239,7 +381,15 @@ class ScopeSource(CaptureSource):
                             command=self.ta_command,
                             ta_name=self.ta_name,
                             trigger_cbuf=self.ta_cbuf,
-                            debug="y" if self.debug else "n"
+                            debug="y" if self.debug else "n",
+                            stream="y" if self.stream else "n",
+                            timer="y" if self.timer else "n",
+                            deferred="y" if self.deferred else "n",
+                            packed="y" if self.packed else "n",
+                            sparse="y" if self.sparse else "n",
+                            pretrigger=self.pretrigger,
+                            batch=self.batch,
+                            accumulate=self.accumulate
         )
         s = Sample()
         if resp is None or not resp_ok(resp):
@@ -252,6 +402,12 @@ class ScopeSource(CaptureSource):
         s.add_extra("ta_name", self.ta_name)
         s.add_extra("trigger_cbuf", self.ta_cbuf)
         s.add_extra("return_code", resp["return_code"])
+        s.add_extra("trigger_index", resp.get("trigger_index", 0))
+        s.add_extra("timer_freq", resp.get("timer_freq", 0))
+        if "histogram" in resp:
+            hist = resp["histogram"]
+            s.add_extra("captures", hist["captures"])
+            s.add_trace("histogram", Trace(self._retrieve_histogram(hist)))
 
         stdout = base64.b64encode(binascii.unhexlify(resp["stdout"]))
         s.add_extra("stdout", stdout)
@@ -262,10 +418,21 @@ class ScopeSource(CaptureSource):
         types = [t for t in self.probes.keys() if self.probes[t].is_enabled()]
         for type_ in types:
             if nsamp > 0:
-                tr = Trace(self._retrieve_measurement(type_))
+                arr = self._retrieve_measurement(type_)
             else:
-                tr = Trace(np.empty([0,0]))
-            s.add_trace(type_, tr)
+                arr = np.empty([0,0])
+            ngroups = self.probes[type_].group_count()
+            if ngroups > 0 and arr.size > 0:
+                # Samples start with the bitmap of the refined groups
+                nbytes = -(-ngroups // 8)
+                bits = np.unpackbits(arr[:, :nbytes], axis=1)
+                bits = bits.reshape(-1, nbytes, 8)[:, :, ::-1]
+                bits = bits.reshape(-1, nbytes * 8)[:, :ngroups]
+                s.add_trace(type_ + "_groups", Trace(bits))
+                arr = arr[:, nbytes:]
+            s.add_trace(type_, Trace(arr))
+        if nsamp > 0:
+            s.add_trace("timing", Trace(self._retrieve_timing()))
         return s
 
     def add_probe(self, name):
@@ -297,6 +464,20 @@ class ScopeSource(CaptureSource):
         else:
             return 0
 
+    def cache_shape(self, name, cpu=None):
+        """Return the associativity, number of sets and line size the
+        server reads from the ID registers of a core for the named cache,
+        or None if it doesn't know it. The default core is the target."""
+        if cpu is None:
+            cpu = self.get_target_core()
+        if cpu >= len(self.caches):
+            return None
+        shape = self.caches[cpu].get(name, {})
+        if len(shape) == 0:
+            return None
+        return (shape["associativity"], shape["num_sets"],
+                shape["line_size"])
+
     def set_target_core(self, cpu):
         """Set the target core"""
         self._tcpu = cpu
@@ -348,6 +529,7 @@ class ScopeSource(CaptureSource):
 
         if resp_ok(resp):
             self.num_cores = resp["num_cores"]
+            self.caches = resp.get("caches", [])
             self.server = server
             self._connected = True
             self.synchronize()
@@ -362,6 +544,7 @@ class ScopeSource(CaptureSource):
         self._enabled = False
         self._connected = False
         self.num_cores = 0
+        self.caches = []
         self.set_ready(False)
         
         pub.sendMessage(self.CONNECTED_CHANGED)
@@ -391,6 +574,21 @@ class ScopeSource(CaptureSource):
                         desc["probes"][probename])
         self.set_ready(self._enabled)
 
+    def calibrate(self, samples=None, percentile=None):
+        """Find the baseline of the probes with the target idle.
+
+        The server then subtracts the baseline of each set from the counts
+        of every capture, making client-side normalization optional. A
+        sample count of 0 clears the baselines."""
+        params = {"time_delta": self.time_delta}
+        if samples is not None:
+            params["samples"] = samples
+        if percentile is not None:
+            params["percentile"] = percentile
+        resp = self.request("/calibrate", post=True, **params)
+        self.synchronize()
+        return resp_ok(resp)
+
     def is_connected(self):
         """Return whether the scope is connected or not."""
         return self._connected
@@ -439,6 +637,14 @@ class ScopeSource(CaptureSource):
         cap_params["ta_name"] = self.ta_name
         cap_params["ta_cbuf"] = self.ta_cbuf
         cap_params["debug_tee_calls"] = "y" if self.debug else "n"
+        cap_params["stream"] = "y" if self.stream else "n"
+        cap_params["timer"] = "y" if self.timer else "n"
+        cap_params["deferred"] = "y" if self.deferred else "n"
+        cap_params["packed"] = "y" if self.packed else "n"
+        cap_params["sparse"] = "y" if self.sparse else "n"
+        cap_params["pretrigger"] = self.pretrigger
+        cap_params["batch"] = self.batch
+        cap_params["accumulate"] = self.accumulate
         desc["capture_params"] = cap_params
 
         return desc
@@ -463,9 +669,33 @@ class ScopeSource(CaptureSource):
         self.ta_name = cap_params["ta_name"]
         self.ta_cbuf = cap_params["ta_cbuf"]
         self.debug = cap_params["debug_tee_calls"] == "y"
+        self.stream = cap_params.get("stream", "n") == "y"
+        self.timer = cap_params.get("timer", "n") == "y"
+        self.deferred = cap_params.get("deferred", "n") == "y"
+        self.packed = cap_params.get("packed", "n") == "y"
+        self.sparse = cap_params.get("sparse", "n") == "y"
+        self.pretrigger = cap_params.get("pretrigger", 0)
+        self.batch = cap_params.get("batch", 0)
+        self.accumulate = cap_params.get("accumulate", 0)
 
         return self
 
 def resp_ok(resp):
     """Returns if the response from the server was "status: Success" """
     return resp is not None and resp["status"] == "Success"
+
+def parse_sets(desc):
+    """Parse a list of sets such as "3,17,40-43" into a sorted list."""
+    sets = []
+    for part in desc.split(","):
+        if len(part) == 0:
+            continue
+        bounds = part.split("-")
+        lo = int(bounds[0])
+        hi = int(bounds[-1])
+        sets.extend(range(lo, hi + 1))
+    return sorted(set(sets))
+
+def format_sets(sets):
+    """Format a list of sets in the form accepted by the scope."""
+    return ",".join(str(s) for s in sorted(set(sets)))
@@ -27,18 +27,63 @@
 
 // ARMv8 PMU events
 /* See arch/arm64/kernel/perf_event.c */
+#define ARMV8_IDX_CYCLE_COUNTER 0
 #define ARMV8_IDX_TO_COUNTER(idx) ((idx) - 1)
 #define EVENT_L1_ICACHE_REFILL 0x01
 #define EVENT_L1_DCACHE_REFILL 0x03
 #define EVENT_BRANCH_MISPRED   0x10
+#define EVENT_L2_DCACHE_REFILL 0x17
+#define EVENT_MAX              0xffff	/* PMEVTYPER<n>_EL0.evtCount */
+
+/* Cache ID registers */
+#define CLIDR_CTYPE(clidr, level) (((clidr) >> (3 * ((level) - 1))) & 7)
+#define CTYPE_INSTR    1
+#define CTYPE_DATA     2
+#define CTYPE_SEPARATE 3
+#define CTYPE_UNIFIED  4
+#define CSSELR_SELECT(level, instr) ((((level) - 1) << 1) | ((instr) ? 1 : 0))
+#define CCSIDR_LINE_SIZE(r) (1u << (((r) & 7) + 4))
+#define CCSIDR_ASSOC(r) ((unsigned int)(((r) >> 3) & 0x3ff) + 1)
+#define CCSIDR_NUM_SETS(r) ((unsigned int)(((r) >> 13) & 0x7fff) + 1)
+/* With FEAT_CCIDX, CCSIDR_EL1 has a wider associativity field */
+#define CCSIDR_CCIDX_ASSOC(r) ((unsigned int)(((r) >> 3) & 0x1fffff) + 1)
+#define CCSIDR2_NUM_SETS(r) ((unsigned int)((r) & 0xffffff) + 1)
+#define ID_AA64MMFR2_CCIDX(r) (((r) >> 20) & 0xf)
 
 // ARMv8 Instructions
 #define INS_SIZE 4
-#define READ_EVCNTR 0xd53b9d41	/* mrs x1, pmxevcntr_el0 */
+#define READ_CCNTR  0xd53b9d00	/* mrs xN, pmccntr_el0 */
+#define READ_EVCNTR 0xd53be800	/* mrs xN, pmevcntr<n>_el0 */
 #define STORE_VALUE 0xf8008401	/* str x1, [x0],#8 */
 #define NOP         0xd503201f	/* nop */
 #define RET         0xd65f03c0	/* ret */
 #define CMP_TRUE    0x6b01003f	/* cmp w1, w1 */
 #define BEQ_4       0x54000020	/* b.eq #4 */
+#define BRANCH      0x14000000	/* b #imm26 * 4 */
+#define DSB_SY      0xd5033f9f	/* dsb sy */
+#define ISB         0xd5033fdf	/* isb */
+#define LOAD_LINE   0xf9400062	/* ldr x2, [x3, #imm12 * 8] */
+#define LOAD_BASE   0xd2800003	/* movz x3, #imm16, lsl #(hw * 16) */
+#define LOAD_BASE_K 0xf2800003	/* movk x3, #imm16, lsl #(hw * 16) */
+
+#define CMP_X2_X1   0xeb01005f	/* cmp x2, x1 */
+#define MOV_X1_X2   0xaa0203e1	/* mov x1, x2 */
+#define CSET_HI     0x1a9f97e3	/* cset w3, hi */
+#define CINC_HI     0x1a839463	/* cinc w3, w3, hi */
+#define LOAD_COUNT  0x39400003	/* ldrb w3, [x0, #imm12] */
+#define STORE_COUNT 0x39000003	/* strb w3, [x0, #imm12] */
+
+#define READ_EVCNTR_N(n) \
+	(READ_EVCNTR | (((n) >> 3) << 8) | (((n) & 7) << 5))
+
+#define BRANCH_INS(n) (BRANCH | ((n) & 0x3ffffff))
+
+#define COUNT_INS 6
+#define COUNT_MAX_SETS 0x1000
+#define COUNT_OFFS(ins, set) ((ins) | ((set) << 10))
+#define LOAD_LINE_MAX_OFFS (0xfff * 8)
+#define LOAD_LINE_OFFS(offs) (LOAD_LINE | (((offs) >> 3) << 10))
+#define LOAD_BASE_HW(ins, imm, hw) \
+	((ins) | ((hw) << 21) | ((((imm) >> ((hw) * 16)) & 0xffff) << 5))
 
 #endif
@@ -0,0 +1,131 @@
+/**
+ * This file is part of the Cachegrab kernel module.
+ *
+ * Copyright (C) 2017 NCC Group
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Cachegrab.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ Version 1.0
+ Keegan Ryan, NCC Group
+*/
+
+#include "cache_geometry.h"
+
+#include <linux/cpumask.h>
+#include <linux/smp.h>
+#include <linux/string.h>
+
+#include "arm64_defs.h"
+
+/**
+ * Read the shape of the cache at LEVEL into S. The instruction cache is
+ * selected if INSTR is set, the data or unified cache otherwise.
+ */
+static void cache_geometry_level(unsigned int level, bool instr, bool ccidx,
+				 struct cache_shape *s)
+{
+	u64 sel = CSSELR_SELECT(level, instr);
+	u64 ccsidr, ccsidr2;
+
+	asm volatile ("msr csselr_el1, %0"::"r" (sel));
+	isb();
+	asm volatile ("mrs %0, ccsidr_el1":"=r" (ccsidr));
+
+	s->line_size = CCSIDR_LINE_SIZE(ccsidr);
+	if (ccidx) {
+		// CCSIDR2_EL1 holds the number of sets in this format
+		asm volatile ("mrs %0, s3_1_c0_c0_2":"=r" (ccsidr2));
+		s->associativity = CCSIDR_CCIDX_ASSOC(ccsidr);
+		s->num_sets = CCSIDR2_NUM_SETS(ccsidr2);
+	} else {
+		s->associativity = CCSIDR_ASSOC(ccsidr);
+		s->num_sets = CCSIDR_NUM_SETS(ccsidr);
+	}
+}
+
+/**
+ * Function run on the core whose caches are read.
+ */
+static void cache_geometry_read_local(void *info)
+{
+	struct cache_geometry *g = (struct cache_geometry *)info;
+	u64 clidr, mmfr2, csselr;
+	bool ccidx;
+
+	asm volatile ("mrs %0, clidr_el1":"=r" (clidr));
+	// ID_AA64MMFR2_EL1, which reads as zero on cores without it
+	asm volatile ("mrs %0, s3_0_c0_c7_2":"=r" (mmfr2));
+	ccidx = ID_AA64MMFR2_CCIDX(mmfr2) != 0;
+	asm volatile ("mrs %0, csselr_el1":"=r" (csselr));
+
+	switch (CLIDR_CTYPE(clidr, 1)) {
+	case CTYPE_SEPARATE:
+		cache_geometry_level(1, true, ccidx, &g->l1i);
+		cache_geometry_level(1, false, ccidx, &g->l1d);
+		break;
+	case CTYPE_INSTR:
+		cache_geometry_level(1, true, ccidx, &g->l1i);
+		break;
+	case CTYPE_DATA:
+		cache_geometry_level(1, false, ccidx, &g->l1d);
+		break;
+	case CTYPE_UNIFIED:
+		cache_geometry_level(1, false, ccidx, &g->l1d);
+		g->l1i = g->l1d;
+		break;
+	default:
+		break;
+	}
+
+	switch (CLIDR_CTYPE(clidr, 2)) {
+	case CTYPE_DATA:
+	case CTYPE_SEPARATE:
+	case CTYPE_UNIFIED:
+		cache_geometry_level(2, false, ccidx, &g->l2);
+		break;
+	default:
+		break;
+	}
+
+	asm volatile ("msr csselr_el1, %0"::"r" (csselr));
+	isb();
+}
+
+enum CGState cache_geometry_read(int cpu, struct cache_geometry *g)
+{
+	memset(g, 0, sizeof(struct cache_geometry));
+	if (cpu < 0 || cpu >= nr_cpu_ids || !cpu_online(cpu))
+		return CG_BAD_ARG;
+
+	if (smp_call_function_single(cpu, cache_geometry_read_local, g, true))
+		return CG_BAD_ARG;
+	return CG_OK;
+}
+
+void cache_geometry_check(const char *name, struct cache_shape *expected,
+			  struct cache_shape *s)
+{
+	if (expected->num_sets == 0)
+		return;
+	if (s->num_sets != expected->num_sets ||
+	    s->associativity != expected->associativity ||
+	    s->line_size != expected->line_size) {
+		WARNING("%s shape %ux%ux%u differs from the %ux%ux%u the core "
+			"reports.", name, s->num_sets, s->associativity,
+			s->line_size, expected->num_sets,
+			expected->associativity, expected->line_size);
+	}
+}
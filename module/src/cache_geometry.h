@@ -0,0 +1,61 @@
+/**
+ * This file is part of the Cachegrab kernel module.
+ *
+ * Copyright (C) 2017 NCC Group
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Cachegrab.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ Version 1.0
+ Keegan Ryan, NCC Group
+*/
+
+#ifndef CACHE_GEOMETRY_H__
+#define CACHE_GEOMETRY_H__
+
+#include "cachegrab.h"
+#include "probe_types.h"
+
+/**
+ * Shapes of the caches of a core. A cache the core doesn't report is left
+ * zeroed.
+ */
+struct cache_geometry {
+	struct cache_shape l1d;
+	struct cache_shape l1i;
+	struct cache_shape l2;
+};
+
+/**
+ * Read the cache geometry of a core from its CLIDR_EL1 and CCSIDR_EL1.
+ *
+ * The registers are read on the core itself, since the cores of a
+ * big.LITTLE system have caches of different shapes. Some implementations
+ * don't describe their caches exactly, so this is a default for the probe
+ * shapes rather than a check on them.
+ *
+ * @return CG_OK if successful, CG_BAD_ARG if CPU is not online.
+ */
+enum CGState cache_geometry_read(int cpu, struct cache_geometry *g);
+
+/**
+ * Warn if a probe shape doesn't match the cache it is meant to probe.
+ *
+ * @param expected Shape read by cache_geometry_read.
+ */
+void cache_geometry_check(const char *name, struct cache_shape *expected,
+			  struct cache_shape *s);
+
+#endif
@@ -28,7 +28,10 @@
 #include <linux/device.h>
 #include <linux/fs.h>
 #include <linux/kernel.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
 
 #include "cachegrab_ioctl.h"
 #include "probes.h"
@@ -41,8 +44,94 @@ static unsigned int cachegrab_major = 0;
 static struct cdev cachegrab_cdev;
 static struct class *cachegrab_class = NULL;
 
+/**
+ * Open the device on the first scope. CG_SCOPE_SELECT switches the file to
+ * another one.
+ */
+int cachegrab_open(struct inode *inode, struct file *file)
+{
+	struct cachegrab_file *f;
+
+	f = kmalloc(sizeof(struct cachegrab_file), GFP_KERNEL);
+	if (f == NULL)
+		return -ENOMEM;
+	f->scope = scope_get(0);
+	atomic_set(&f->mappings, 0);
+	atomic_set(&f->readers, 0);
+	file->private_data = f;
+	return 0;
+}
+
+int cachegrab_release(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+	return 0;
+}
+
+/*
+ * Count the mappings of the ring made through a file, including the copies
+ * made by fork and splits.
+ */
+static void cachegrab_vm_open(struct vm_area_struct *vma)
+{
+	struct cachegrab_file *f = vma->vm_private_data;
+
+	atomic_inc(&f->mappings);
+}
+
+static void cachegrab_vm_close(struct vm_area_struct *vma)
+{
+	struct cachegrab_file *f = vma->vm_private_data;
+
+	atomic_dec(&f->mappings);
+}
+
+static const struct vm_operations_struct cachegrab_vm_ops = {
+	.open = cachegrab_vm_open,
+	.close = cachegrab_vm_close,
+};
+
+int cachegrab_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct cachegrab_file *f = file->private_data;
+	int ret;
+
+	ret = scope_mmap(f->scope, vma);
+	if (ret < 0)
+		return ret;
+	vma->vm_ops = &cachegrab_vm_ops;
+	vma->vm_private_data = f;
+	cachegrab_vm_open(vma);
+	return 0;
+}
+
+ssize_t cachegrab_read(struct file *file, char __user * buf, size_t len,
+		       loff_t * off)
+{
+	struct cachegrab_file *f = file->private_data;
+	ssize_t ret;
+
+	atomic_inc(&f->readers);
+	ret = scope_read(f->scope, buf, len,
+			 (file->f_flags & O_NONBLOCK) != 0);
+	atomic_dec(&f->readers);
+	return ret;
+}
+
+unsigned int cachegrab_poll(struct file *file, poll_table * wait)
+{
+	struct cachegrab_file *f = file->private_data;
+
+	return scope_poll(f->scope, file, wait);
+}
+
 struct file_operations fops = {
+	.open = cachegrab_open,
+	.release = cachegrab_release,
 	.unlocked_ioctl = cachegrab_ioctl,
+	.mmap = cachegrab_mmap,
+	.read = cachegrab_read,
+	.poll = cachegrab_poll,
 };
 
 int init_components(void)
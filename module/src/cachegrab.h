@@ -29,6 +29,9 @@
 
 #define DEVICE_NAME "cachegrab"
 
+// Number of scopes which can monitor different cores at the same time
+#define CG_MAX_SCOPES 4
+
 #define KLOG(type, fmt, ...) \
 	printk(type DEVICE_NAME ": %s: " fmt "\n", __FUNCTION__, ##__VA_ARGS__);
 #define DEBUG(fmt, ...) KLOG(KERN_DEBUG, fmt, ##__VA_ARGS__)
@@ -25,7 +25,9 @@
 #include "cachegrab_ioctl.h"
 
 #include <asm/uaccess.h>
+#include <linux/slab.h>
 
+#include "cache_geometry.h"
 #include "cachegrab.h"
 #include "scope.h"
 #include "probe_types.h"
@@ -39,12 +41,38 @@ enum probe_type get_probe_type(enum arg_probe_type p)
 		return PROBE_TYPE_L1I;
 	case ARG_PROBE_TYPE_BTB:
 		return PROBE_TYPE_BTB;
+	case ARG_PROBE_TYPE_L2:
+		return PROBE_TYPE_L2;
 	default:
 		return PROBE_TYPE_UNKNOWN;
 	}
 }
 
-long probe_attach_ioctl(void __user * p)
+enum probe_output get_probe_output(enum arg_probe_output o)
+{
+	switch (o) {
+	case ARG_PROBE_OUTPUT_WAYS:
+		return PROBE_OUTPUT_WAYS;
+	case ARG_PROBE_OUTPUT_BITMASK:
+		return PROBE_OUTPUT_BITMASK;
+	default:
+		return PROBE_OUTPUT_COUNT;
+	}
+}
+
+enum arg_probe_output get_arg_probe_output(enum probe_output o)
+{
+	switch (o) {
+	case PROBE_OUTPUT_WAYS:
+		return ARG_PROBE_OUTPUT_WAYS;
+	case PROBE_OUTPUT_BITMASK:
+		return ARG_PROBE_OUTPUT_BITMASK;
+	default:
+		return ARG_PROBE_OUTPUT_COUNT;
+	}
+}
+
+long probe_attach_ioctl(struct scope *s, void __user * p)
 {
 	struct arg_probe_attach arg;
 	enum probe_type type;
@@ -58,10 +86,10 @@ long probe_attach_ioctl(void __user * p)
 	shape.associativity = arg.associativity;
 	shape.line_size = arg.line_size;
 
-	return (long)scope_attach_probe(type, &shape);
+	return (long)scope_attach_probe(s, type, &shape, arg.event);
 }
 
-long probe_detach_ioctl(void __user * p)
+long probe_detach_ioctl(struct scope *s, void __user * p)
 {
 	enum probe_type type;
 	struct arg_probe_configure arg;
@@ -69,11 +97,40 @@ long probe_detach_ioctl(void __user * p)
 		return CG_PERM;
 
 	type = get_probe_type(arg.type);
-	scope_detach_probe(type);
-	return CG_OK;
+	return scope_detach_probe(s, type);
+}
+
+/**
+ * Copy the mask of the sets probed by PR to the user buffer of ARG.
+ */
+static enum CGState get_arg_set_mask(struct arg_probe_get_config *arg,
+				     struct probe *pr)
+{
+	unsigned char *mask;
+	size_t len;
+	unsigned int i, set;
+	enum CGState ret = CG_OK;
+
+	if (arg->set_mask == NULL || arg->set_mask_len == 0)
+		return CG_OK;
+	len = min_t(size_t, arg->set_mask_len, ARG_PROBE_MAX_SETS / 8);
+	mask = kzalloc(len, GFP_KERNEL);
+	if (mask == NULL)
+		return CG_NO_MEM;
+
+	for (i = 0; pr->cfg.masked && i < pr->set_cnt; i++) {
+		set = (pr->cfg.set_start + pr->set_pos[i]) %
+		    pr->cache_shape.num_sets;
+		if (set / 8 < len)
+			mask[set / 8] |= 1 << (set % 8);
+	}
+	if (copy_to_user((void __user *)arg->set_mask, mask, len) != 0)
+		ret = CG_PERM;
+	kfree(mask);
+	return ret;
 }
 
-long probe_get_config_ioctl(void __user * p)
+long probe_get_config_ioctl(struct scope *s, void __user * p)
 {
 	struct arg_probe_get_config arg;
 	struct probe *pr;
@@ -82,7 +139,7 @@ long probe_get_config_ioctl(void __user * p)
 	if (copy_from_user(&arg, p, sizeof(arg)) != 0)
 		return CG_PERM;
 
-	pr = scope_get_probe(get_probe_type(arg.type));
+	pr = scope_get_probe(s, get_probe_type(arg.type));
 	if (pr != NULL) {
 		struct cache_shape *cs = probe_generic_get_cache_shape(pr);
 		struct probe_config *cfg = probe_generic_get_config(pr);
@@ -93,7 +150,15 @@ long probe_get_config_ioctl(void __user * p)
 		arg.line_size = cs->line_size;
 		arg.set_start = cfg->set_start;
 		arg.set_end = cfg->set_end;
-		ret = CG_OK;
+		arg.output = get_arg_probe_output(cfg->output);
+		arg.event = pr->event;
+		arg.refills = cfg->refills;
+		arg.masked = cfg->masked;
+		arg.group_size = cfg->group_size;
+		arg.calibrated = (pr->baseline != NULL);
+		ret = get_arg_set_mask(&arg, pr);
+		if (ret != CG_OK)
+			return ret;
 	} else {
 		arg.attached = false;
 		arg.num_sets = 0;
@@ -101,6 +166,12 @@ long probe_get_config_ioctl(void __user * p)
 		arg.line_size = 0;
 		arg.set_start = 0;
 		arg.set_end = 0;
+		arg.output = ARG_PROBE_OUTPUT_COUNT;
+		arg.event = 0;
+		arg.refills = 0;
+		arg.masked = false;
+		arg.group_size = 0;
+		arg.calibrated = false;
 		ret = CG_PROBE_NOT_CONNECTED;
 	}
 
@@ -110,35 +181,74 @@ long probe_get_config_ioctl(void __user * p)
 	return ret;
 }
 
-long probe_configure_ioctl(void __user * p)
+long probe_configure_ioctl(struct scope *s, void __user * p)
 {
 	int err;
 	enum probe_type type;
 	struct probe_config cfg;
+	u8 *mask = NULL;
 
 	struct arg_probe_configure arg;
 	if (copy_from_user(&arg, p, sizeof(arg)) != 0)
 		return CG_PERM;
+	if (arg.masked) {
+		if (arg.set_mask_len == 0 ||
+		    arg.set_mask_len > ARG_PROBE_MAX_SETS / 8)
+			return CG_BAD_ARG;
+		mask = kmalloc(arg.set_mask_len, GFP_KERNEL);
+		if (mask == NULL)
+			return CG_NO_MEM;
+		if (copy_from_user(mask, (const void __user *)arg.set_mask,
+				   arg.set_mask_len) != 0) {
+			kfree(mask);
+			return CG_PERM;
+		}
+	}
 
 	type = get_probe_type(arg.type);
 	cfg.set_start = arg.set_start;
 	cfg.set_end = arg.set_end;
-	err = scope_configure_probe(type, &cfg);
+	cfg.output = get_probe_output(arg.output);
+	cfg.refills = arg.refills;
+	cfg.masked = arg.masked;
+	cfg.set_mask = mask;
+	cfg.set_mask_len = mask ? arg.set_mask_len : 0;
+	cfg.group_size = arg.group_size;
+	err = scope_configure_probe(s, type, &cfg);
+	kfree(mask);
 
 	return (err != 0) ? CG_PERM : CG_OK;
 }
 
-long scope_config_ioctl(void __user * p)
+long probe_calibrate_ioctl(struct scope *s, void __user * p)
+{
+	struct arg_probe_calibrate arg;
+	enum CGState ret;
+
+	if (copy_from_user(&arg, p, sizeof(arg)) != 0)
+		return CG_PERM;
+
+	ret = scope_calibrate_probe(s, get_probe_type(arg.type), &arg.refills);
+	if (ret != CG_OK)
+		return ret;
+
+	if (copy_to_user(p, &arg, sizeof(arg)) != 0)
+		return CG_PERM;
+	return CG_OK;
+}
+
+long scope_config_ioctl(struct scope *s, void __user * p)
 {
 	struct arg_scope_config arg_config;
 	struct scope_configuration config;
 
-	scope_get_config(&config);
+	scope_get_config(s, &config);
 	arg_config.created = config.created;
 	arg_config.target_cpu = config.target_cpu;
 	arg_config.l1d_attached = config.l1d_attached;
 	arg_config.l1i_attached = config.l1i_attached;
 	arg_config.btb_attached = config.btb_attached;
+	arg_config.l2_attached = config.l2_attached;
 
 	if (copy_to_user(p, &arg_config, sizeof(arg_config)) != 0)
 		return CG_PERM;
@@ -146,32 +256,41 @@ long scope_config_ioctl(void __user * p)
 	return CG_OK;
 }
 
-long scope_create_ioctl(void __user * p)
+long scope_create_ioctl(struct scope *s, void __user * p)
 {
 	struct arg_scope_create arg;
 	if (copy_from_user(&arg, p, sizeof(arg)) != 0)
 		return CG_PERM;
-	return scope_create(arg.target_cpu);
+	return scope_create(s, arg.target_cpu);
 }
 
-long scope_destroy_ioctl(void)
+long scope_destroy_ioctl(struct scope *s)
 {
-	scope_destroy();
+	scope_destroy(s);
 	return CG_OK;
 }
 
-long scope_activate_ioctl(void)
+long scope_activate_ioctl(struct scope *s)
 {
-	return (long)scope_activate();
+	return (long)scope_activate(s);
 }
 
-long scope_deactivate_ioctl(void)
+long scope_deactivate_ioctl(struct scope *s)
 {
-	scope_deactivate();
+	scope_deactivate(s);
 	return CG_OK;
 }
 
-long scope_prepare_ioctl(unsigned long p)
+long scope_configure_ioctl(struct scope *s, void __user * p)
+{
+	struct arg_scope_configure arg;
+	if (copy_from_user(&arg, p, sizeof(arg)) != 0)
+		return CG_PERM;
+
+	return scope_configure(s, arg.deferred, arg.packed, arg.sparse);
+}
+
+long scope_prepare_ioctl(struct scope *s, unsigned long p)
 {
 	unsigned int max_samples = (unsigned int)p;
 	unsigned int created_samples;
@@ -181,26 +300,43 @@ long scope_prepare_ioctl(unsigned long p)
 	if (max_samples > INT_MAX)
 		max_samples = (unsigned int)INT_MAX;
 
-	created_samples = scope_prepare(max_samples);
+	created_samples = scope_prepare(s, max_samples);
 	return (long)created_samples;
 }
 
-long scope_collect_ioctl(void __user * p)
+long scope_collect_ioctl(struct scope *s, void __user * p)
 {
 	struct arg_scope_collect arg;
+	bool timer;
+	unsigned int cnt;
 	if (copy_from_user(&arg, p, sizeof(arg)) != 0)
 		return CG_PERM;
 
-	return (long)scope_collect(arg.delay, arg.timeout);
+	timer = (arg.flags & ARG_COLLECT_TIMER) != 0;
+	// Pre-trigger samples start at a different row of every capture, so
+	// they can't be added up into one histogram.
+	if ((arg.flags & ARG_COLLECT_ACCUMULATE) && arg.pretrigger > 0)
+		return CG_BAD_ARG;
+	if (arg.flags & ARG_COLLECT_STREAM) {
+		if (arg.pretrigger > 0 || (arg.flags & ARG_COLLECT_ACCUMULATE))
+			return CG_BAD_ARG;
+		return scope_stream(s, arg.delay, arg.timeout, timer,
+				    arg.batch);
+	}
+	cnt = scope_collect(s, arg.delay, arg.timeout, timer,
+			    arg.pretrigger, arg.batch);
+	if (arg.flags & ARG_COLLECT_ACCUMULATE)
+		cnt = scope_accumulate(s);
+	return (long)cnt;
 }
 
-long scope_flush_ioctl(void)
+long scope_flush_ioctl(struct scope *s)
 {
-	scope_flush();
+	scope_flush(s);
 	return CG_OK;
 }
 
-long scope_retrieve_ioctl(void __user * p)
+long scope_retrieve_ioctl(struct scope *s, void __user * p)
 {
 	struct arg_scope_retrieve arg;
 	if (copy_from_user(&arg, p, sizeof(arg)) != 0)
@@ -209,7 +345,7 @@ long scope_retrieve_ioctl(void __user * p)
 	if (!access_ok(VERIFY_WRITE, arg.buf, arg.len))
 		return CG_PERM;
 
-	scope_retrieve(arg.buf, &arg.len);
+	scope_retrieve(s, arg.buf, &arg.len);
 
 	if (copy_to_user(p, &arg, sizeof(arg)) != 0)
 		return CG_PERM;
@@ -217,19 +353,45 @@ long scope_retrieve_ioctl(void __user * p)
 	return CG_OK;
 }
 
-long scope_sample_desc_ioctl(void __user * p)
+long scope_sample_desc_ioctl(struct scope *s, void __user * p)
 {
 	struct arg_scope_sample_desc arg_desc;
 	struct scope_sample_description internal_desc;
 
-	scope_sample_desc(&internal_desc);
+	scope_sample_desc(s, &internal_desc);
 	arg_desc.total_size = internal_desc.total_size;
+	arg_desc.header_size = internal_desc.header_size;
+	arg_desc.timer_freq = internal_desc.timer_freq;
+	arg_desc.sparse = internal_desc.sparse;
+	arg_desc.record_size = internal_desc.record_size;
 	arg_desc.l1d.offs = internal_desc.l1d.offs;
 	arg_desc.l1d.size = internal_desc.l1d.size;
+	arg_desc.l1d.output = get_arg_probe_output(internal_desc.l1d.output);
+	arg_desc.l1d.set_size = internal_desc.l1d.set_size;
+	arg_desc.l1d.nsets = internal_desc.l1d.nsets;
+	arg_desc.l1d.bits = internal_desc.l1d.bits;
+	arg_desc.l1d.group_bytes = internal_desc.l1d.group_bytes;
 	arg_desc.l1i.offs = internal_desc.l1i.offs;
 	arg_desc.l1i.size = internal_desc.l1i.size;
+	arg_desc.l1i.output = get_arg_probe_output(internal_desc.l1i.output);
+	arg_desc.l1i.set_size = internal_desc.l1i.set_size;
+	arg_desc.l1i.nsets = internal_desc.l1i.nsets;
+	arg_desc.l1i.bits = internal_desc.l1i.bits;
+	arg_desc.l1i.group_bytes = internal_desc.l1i.group_bytes;
 	arg_desc.btb.offs = internal_desc.btb.offs;
 	arg_desc.btb.size = internal_desc.btb.size;
+	arg_desc.btb.output = get_arg_probe_output(internal_desc.btb.output);
+	arg_desc.btb.set_size = internal_desc.btb.set_size;
+	arg_desc.btb.nsets = internal_desc.btb.nsets;
+	arg_desc.btb.bits = internal_desc.btb.bits;
+	arg_desc.btb.group_bytes = internal_desc.btb.group_bytes;
+	arg_desc.l2.offs = internal_desc.l2.offs;
+	arg_desc.l2.size = internal_desc.l2.size;
+	arg_desc.l2.output = get_arg_probe_output(internal_desc.l2.output);
+	arg_desc.l2.set_size = internal_desc.l2.set_size;
+	arg_desc.l2.nsets = internal_desc.l2.nsets;
+	arg_desc.l2.bits = internal_desc.l2.bits;
+	arg_desc.l2.group_bytes = internal_desc.l2.group_bytes;
 
 	if (copy_to_user(p, &arg_desc, sizeof(arg_desc)) != 0)
 		return CG_PERM;
@@ -237,46 +399,206 @@ long scope_sample_desc_ioctl(void __user * p)
 	return CG_OK;
 }
 
-long scope_sample_count_ioctl(void)
+long scope_sample_count_ioctl(struct scope *s)
 {
-	return (long)scope_sample_count();
+	return (long)scope_sample_count(s);
 }
 
-long cachegrab_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+long scope_ring_desc_ioctl(struct scope *s, void __user * p)
+{
+	struct arg_scope_ring_desc arg_desc;
+	struct scope_ring_description internal_desc;
+
+	scope_ring_desc(s, &internal_desc);
+	arg_desc.size = internal_desc.size;
+	arg_desc.stride = internal_desc.stride;
+	arg_desc.capacity = internal_desc.capacity;
+	arg_desc.head = internal_desc.head;
+	arg_desc.count = internal_desc.count;
+	arg_desc.generation = internal_desc.generation;
+	arg_desc.trigger = internal_desc.trigger;
+
+	if (copy_to_user(p, &arg_desc, sizeof(arg_desc)) != 0)
+		return CG_PERM;
+
+	return CG_OK;
+}
+
+long scope_release_ioctl(struct scope *s, unsigned long p)
+{
+	unsigned int count = (unsigned int)p;
+
+	if (count > INT_MAX)
+		count = (unsigned int)INT_MAX;
+
+	return (long)scope_release(s, count);
+}
+
+long scope_histogram_ioctl(struct scope *s, void __user * p)
+{
+	struct arg_scope_histogram arg;
+	struct scope_histogram_description desc;
+
+	if (copy_from_user(&arg, p, sizeof(arg)) != 0)
+		return CG_PERM;
+
+	if (!access_ok(VERIFY_WRITE, arg.buf, arg.len))
+		return CG_PERM;
+
+	scope_histogram_retrieve(s, arg.buf, &arg.len, &desc);
+	arg.rows = desc.rows;
+	arg.width = desc.width;
+	arg.captures = desc.captures;
+
+	if (copy_to_user(p, &arg, sizeof(arg)) != 0)
+		return CG_PERM;
+
+	return CG_OK;
+}
+
+long scope_histogram_reset_ioctl(struct scope *s)
+{
+	scope_histogram_reset(s);
+	return CG_OK;
+}
+
+long scope_calibrate_ioctl(struct scope *s, void __user * p)
+{
+	struct arg_scope_calibrate arg;
+
+	if (copy_from_user(&arg, p, sizeof(arg)) != 0)
+		return CG_PERM;
+
+	return scope_calibrate_baseline(s, arg.samples, arg.delay,
+					arg.percentile);
+}
+
+void get_arg_cache_level(struct arg_cache_level *l,
+			 struct cache_shape *s)
+{
+	l->num_sets = s->num_sets;
+	l->associativity = s->associativity;
+	l->line_size = s->line_size;
+}
+
+long cache_geometry_ioctl(void __user * p)
+{
+	struct arg_cache_geometry arg;
+	struct cache_geometry g;
+	enum CGState ret;
+
+	if (copy_from_user(&arg, p, sizeof(arg)) != 0)
+		return CG_PERM;
+
+	ret = cache_geometry_read(arg.cpu, &g);
+	if (ret != CG_OK)
+		return ret;
+	get_arg_cache_level(&arg.l1d, &g.l1d);
+	get_arg_cache_level(&arg.l1i, &g.l1i);
+	get_arg_cache_level(&arg.l2, &g.l2);
+
+	if (copy_to_user(p, &arg, sizeof(arg)) != 0)
+		return CG_PERM;
+	return CG_OK;
+}
+
+long scope_select_ioctl(struct cachegrab_file *f, unsigned long p)
+{
+	struct scope *s = scope_get((unsigned int)p);
+	struct scope *cur = f->scope;
+	long ret = CG_OK;
+
+	if (s == NULL)
+		return CG_BAD_ARG;
+
+	mutex_lock(&cur->lock);
+	if (atomic_read(&f->mappings) > 0 || atomic_read(&f->readers) > 0) {
+		INFO("Scope is mapped or read through this file.");
+		ret = CG_BAD_ARG;
+	} else {
+		f->scope = s;
+	}
+	mutex_unlock(&cur->lock);
+	return ret;
+}
+
+/**
+ * Run an ioctl on scope S, with the scope lock held.
+ */
+static long cachegrab_scope_ioctl(struct scope *s, unsigned int cmd,
+				  unsigned long arg)
 {
 	switch (cmd) {
 	case CG_PROBE_ATTACH:
-		return probe_attach_ioctl((void __user *)arg);
+		return probe_attach_ioctl(s, (void __user *)arg);
 	case CG_PROBE_DETACH:
-		return probe_detach_ioctl((void __user *)arg);
+		return probe_detach_ioctl(s, (void __user *)arg);
 	case CG_PROBE_GET_CONFIG:
-		return probe_get_config_ioctl((void __user *)arg);
+		return probe_get_config_ioctl(s, (void __user *)arg);
 	case CG_PROBE_CONFIGURE:
-		return probe_configure_ioctl((void __user *)arg);
+		return probe_configure_ioctl(s, (void __user *)arg);
+	case CG_PROBE_CALIBRATE:
+		return probe_calibrate_ioctl(s, (void __user *)arg);
 
 	case CG_SCOPE_GET_CONFIG:
-		return scope_config_ioctl((void __user *)arg);
+		return scope_config_ioctl(s, (void __user *)arg);
 	case CG_SCOPE_CREATE:
-		return scope_create_ioctl((void __user *)arg);
+		return scope_create_ioctl(s, (void __user *)arg);
 	case CG_SCOPE_DESTROY:
-		return scope_destroy_ioctl();
-	case CG_SCOPE_ACTIVATE:
-		return scope_activate_ioctl();
-	case CG_SCOPE_DEACTIVATE:
-		return scope_deactivate_ioctl();
+		return scope_destroy_ioctl(s);
 	case CG_SCOPE_PREPARE:
-		return scope_prepare_ioctl(arg);
+		return scope_prepare_ioctl(s, arg);
 	case CG_SCOPE_COLLECT:
-		return scope_collect_ioctl((void __user *)arg);
+		return scope_collect_ioctl(s, (void __user *)arg);
 	case CG_SCOPE_FLUSH:
-		return scope_flush_ioctl();
+		return scope_flush_ioctl(s);
 	case CG_SCOPE_RETRIEVE:
-		return scope_retrieve_ioctl((void __user *)arg);
+		return scope_retrieve_ioctl(s, (void __user *)arg);
 	case CG_SCOPE_SAMPLE_DESC:
-		return scope_sample_desc_ioctl((void __user *)arg);
+		return scope_sample_desc_ioctl(s, (void __user *)arg);
 	case CG_SCOPE_SAMPLE_COUNT:
-		return scope_sample_count_ioctl();
+		return scope_sample_count_ioctl(s);
+	case CG_SCOPE_RING_DESC:
+		return scope_ring_desc_ioctl(s, (void __user *)arg);
+	case CG_SCOPE_RELEASE:
+		return scope_release_ioctl(s, arg);
+	case CG_SCOPE_CONFIGURE:
+		return scope_configure_ioctl(s, (void __user *)arg);
+	case CG_SCOPE_HISTOGRAM:
+		return scope_histogram_ioctl(s, (void __user *)arg);
+	case CG_SCOPE_HISTOGRAM_RESET:
+		return scope_histogram_reset_ioctl(s);
+	case CG_SCOPE_CALIBRATE:
+		return scope_calibrate_ioctl(s, (void __user *)arg);
 	default:
 		return CG_BAD_CMD;
 	}
 }
+
+long cachegrab_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct cachegrab_file *f = (struct cachegrab_file *)file->private_data;
+	struct scope *s = f->scope;
+	long ret;
+
+	switch (cmd) {
+	// The triggers come from the target while a collection holds the
+	// scope lock, so they only take the trigger lock.
+	case CG_SCOPE_ACTIVATE:
+		return scope_activate_ioctl(s);
+	case CG_SCOPE_DEACTIVATE:
+		return scope_deactivate_ioctl(s);
+
+	case CG_SCOPE_SELECT:
+		return scope_select_ioctl(f, arg);
+	case CG_CACHE_GEOMETRY:
+		return cache_geometry_ioctl((void __user *)arg);
+	default:
+		break;
+	}
+
+	mutex_lock(&s->lock);
+	ret = cachegrab_scope_ioctl(s, cmd, arg);
+	mutex_unlock(&s->lock);
+	return ret;
+}
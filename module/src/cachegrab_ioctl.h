@@ -32,6 +32,7 @@ enum arg_probe_type {
 	ARG_PROBE_TYPE_L1D,
 	ARG_PROBE_TYPE_L1I,
 	ARG_PROBE_TYPE_BTB,
+	ARG_PROBE_TYPE_L2,
 };
 
 struct arg_probe_attach {
@@ -39,12 +40,22 @@ struct arg_probe_attach {
 	unsigned int num_sets;
 	unsigned int associativity;
 	unsigned int line_size;
+	unsigned int event;
 };
 
 struct arg_probe_detach {
 	enum arg_probe_type type;
 };
 
+enum arg_probe_output {
+	ARG_PROBE_OUTPUT_COUNT,
+	ARG_PROBE_OUTPUT_WAYS,
+	ARG_PROBE_OUTPUT_BITMASK,
+};
+
+// Largest set mask, one bit per set
+#define ARG_PROBE_MAX_SETS 4096
+
 struct arg_probe_get_config {
 	enum arg_probe_type type;
 	bool attached;
@@ -53,12 +64,35 @@ struct arg_probe_get_config {
 	unsigned int line_size;
 	unsigned int set_start;
 	unsigned int set_end;
+	enum arg_probe_output output;
+	unsigned int event;
+	unsigned int refills;
+	bool masked;
+	// If non-NULL, receives SET_MASK_LEN bytes of the mask of probed sets
+	unsigned char *set_mask;
+	size_t set_mask_len;
+	unsigned int group_size;
+	bool calibrated;	// counts are above a calibrated baseline
 };
 
 struct arg_probe_configure {
 	enum arg_probe_type type;
 	unsigned int set_start;
 	unsigned int set_end;
+	enum arg_probe_output output;
+	unsigned int refills;	// 0 for the default
+	// If set, only the sets of the range set in the SET_MASK_LEN bytes
+	// of SET_MASK are probed
+	bool masked;
+	const unsigned char *set_mask;
+	size_t set_mask_len;
+	// If non-zero, sets are probed coarse to fine in groups of this size
+	unsigned int group_size;
+};
+
+struct arg_probe_calibrate {
+	enum arg_probe_type type;
+	unsigned int refills;
 };
 
 struct arg_scope_config {
@@ -67,15 +101,34 @@ struct arg_scope_config {
 	bool l1d_attached;
 	bool l1i_attached;
 	bool btb_attached;
+	bool l2_attached;
 };
 
 struct arg_scope_create {
 	int target_cpu;
 };
 
+struct arg_scope_configure {
+	bool deferred;
+	bool packed;
+	// Retrieve and read samples as sparse records, see arg_scope_sample_desc
+	bool sparse;
+};
+
+// Collect in the background and read samples from the device file
+#define ARG_COLLECT_STREAM 0x01
+// Sample from a pinned hrtimer on the target core instead of IPIs
+#define ARG_COLLECT_TIMER 0x02
+// Add the samples to the scope histogram instead of keeping them. Not
+// allowed with pre-trigger samples.
+#define ARG_COLLECT_ACCUMULATE 0x04
+
 struct arg_scope_collect {
 	unsigned int delay;
 	unsigned int timeout;
+	unsigned int flags;
+	unsigned int pretrigger;
+	unsigned int batch;	// samples per interrupt, 0 for 1
 };
 
 struct arg_scope_retrieve {
@@ -86,13 +139,68 @@ struct arg_scope_retrieve {
 struct arg_scope_sample_desc_field {
 	size_t offs;
 	size_t size;
+	enum arg_probe_output output;
+	size_t set_size;
+	unsigned int nsets;
+	unsigned int bits;
+	unsigned int group_bytes;
 };
 
 struct arg_scope_sample_desc {
 	size_t total_size;
+	// Samples start with a u64 timestamp, then u32 sequence number and
+	// u32 count of missed sampling slots
+	size_t header_size;
+	unsigned int timer_freq;	// Ticks per second of the timestamps
+	// If SPARSE is set, samples are copied out as records of a u32 count
+	// of idle samples and a u32 count of entries. An idle record stands
+	// for that many samples with no set values or missed slots. Otherwise
+	// the sample header and the u32 entries follow, each holding the
+	// offset of a non-zero byte of the sample in the upper 24 bits and
+	// its value in the lower 8. No record is larger than RECORD_SIZE.
+	bool sparse;
+	size_t record_size;
 	struct arg_scope_sample_desc_field l1d;
 	struct arg_scope_sample_desc_field l1i;
 	struct arg_scope_sample_desc_field btb;
+	struct arg_scope_sample_desc_field l2;
+};
+
+struct arg_scope_ring_desc {
+	size_t size;
+	size_t stride;
+	unsigned int capacity;
+	unsigned int head;
+	unsigned int count;
+	unsigned int generation;
+	unsigned int trigger;
+};
+
+struct arg_scope_calibrate {
+	unsigned int samples;	// 0 clears the baselines
+	unsigned int delay;
+	unsigned int percentile;	// 0 for the default
+};
+
+struct arg_cache_level {
+	unsigned int num_sets;	// 0 if the core doesn't report the cache
+	unsigned int associativity;
+	unsigned int line_size;
+};
+
+struct arg_cache_geometry {
+	int cpu;
+	struct arg_cache_level l1d;
+	struct arg_cache_level l1i;
+	struct arg_cache_level l2;
+};
+
+struct arg_scope_histogram {
+	void *buf;
+	size_t len;
+	unsigned int rows;
+	unsigned int width;
+	unsigned int captures;
 };
 
 #define CG_MAGIC 47
@@ -100,6 +208,7 @@ struct arg_scope_sample_desc {
 #define CG_PROBE_DETACH _IOW(CG_MAGIC, 0x01, struct arg_probe_detach)
 #define CG_PROBE_GET_CONFIG _IOR(CG_MAGIC, 0x02, struct arg_probe_get_config)
 #define CG_PROBE_CONFIGURE _IOW(CG_MAGIC, 0x03, struct arg_probe_configure)
+#define CG_PROBE_CALIBRATE _IOWR(CG_MAGIC, 0x04, struct arg_probe_calibrate)
 
 #define CG_SCOPE_GET_CONFIG _IOR(CG_MAGIC, 0x10, struct arg_scope_config)
 #define CG_SCOPE_CREATE _IOW(CG_MAGIC, 0x11, struct arg_scope_create)
@@ -112,6 +221,30 @@ struct arg_scope_sample_desc {
 #define CG_SCOPE_RETRIEVE _IOR(CG_MAGIC, 0x18, struct arg_scope_retrieve)
 #define CG_SCOPE_SAMPLE_DESC _IOR(CG_MAGIC, 0x19, struct arg_scope_sample_desc)
 #define CG_SCOPE_SAMPLE_COUNT _IO(CG_MAGIC, 0x1A)
+#define CG_SCOPE_RING_DESC _IOR(CG_MAGIC, 0x1B, struct arg_scope_ring_desc)
+#define CG_SCOPE_RELEASE _IO(CG_MAGIC, 0x1C)
+#define CG_SCOPE_CONFIGURE _IOW(CG_MAGIC, 0x1D, struct arg_scope_configure)
+#define CG_SCOPE_SELECT _IO(CG_MAGIC, 0x1E)
+#define CG_SCOPE_HISTOGRAM _IOWR(CG_MAGIC, 0x1F, struct arg_scope_histogram)
+#define CG_SCOPE_HISTOGRAM_RESET _IO(CG_MAGIC, 0x20)
+#define CG_SCOPE_CALIBRATE _IOW(CG_MAGIC, 0x21, struct arg_scope_calibrate)
+
+#define CG_CACHE_GEOMETRY _IOWR(CG_MAGIC, 0x30, struct arg_cache_geometry)
+
+struct scope;
+
+/**
+ * State of an open device file.
+ *
+ * SCOPE is the scope the file works on. MAPPINGS counts the live mappings
+ * of its ring made through the file, and READERS the reads in progress.
+ * Another scope can't be selected while either is non-zero.
+ */
+struct cachegrab_file {
+	struct scope *scope;
+	atomic_t mappings;
+	atomic_t readers;
+};
 
 long cachegrab_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
 
@@ -37,7 +37,7 @@ void probe_btb_init(struct probe_btb *p)
 }
 
 enum CGState probe_btb_attach(struct probe_btb *p, int cpu,
-			      struct cache_shape *s)
+			      struct cache_shape *s, unsigned int event)
 {
 	enum CGState err;
 	struct probe_params params;
@@ -77,7 +77,7 @@ enum CGState probe_btb_attach(struct probe_btb *p, int cpu,
 
 	params.target_cpu = cpu;
 	params.type = PERF_TYPE_RAW;
-	params.conf = EVENT_BRANCH_MISPRED;
+	params.conf = event ? event : EVENT_BRANCH_MISPRED;
 	params.cache_shape = s;
 	err = probe_generic_attach((struct probe *)p, &params);
 	if (err != CG_OK)
@@ -102,10 +102,11 @@ int probe_btb_configure(struct probe_btb *p, struct probe_config *cfg)
 {
 	int ret;
 	unsigned int way, nways, set, nsets, line_size;
-	unsigned int start, end, ext, numext;
-	unsigned int s_count;
+	unsigned int start, ext, numext;
+	unsigned int sel, s_count, gadget;
 	uint32_t *func;
 	unsigned int ind, offset;
+	bool fused;
 
 	ret = probe_generic_configure((struct probe *)p, cfg);
 	if (ret < 0)
@@ -115,9 +116,13 @@ int probe_btb_configure(struct probe_btb *p, struct probe_config *cfg)
 	nsets = p->base.cache_shape.num_sets;
 	line_size = p->base.cache_shape.line_size;
 	start = p->base.cfg.set_start;
-	end = p->base.cfg.set_end;
-	numext = (line_size / INS_SIZE) - 4;
-	s_count = set_count(start, end, nsets);
+	s_count = p->base.set_cnt;
+	// Counts are reduced inline when the counting gadget fits in a line
+	fused = p->base.cfg.output == PROBE_OUTPUT_COUNT &&
+	    line_size >= (2 + COUNT_INS) * INS_SIZE &&
+	    s_count <= COUNT_MAX_SETS;
+	gadget = fused ? 2 + COUNT_INS : 4;
+	numext = (line_size / INS_SIZE) - gadget;
 
 	offset = (start - p->base.set_offset + nsets) % nsets;
 	offset *= line_size;
@@ -125,17 +130,27 @@ int probe_btb_configure(struct probe_btb *p, struct probe_config *cfg)
 
 	ind = 0;
 	for (way = 0; way < nways; way++) {
+		sel = 0;
 		for (set = 0; set < nsets; set++) {
-			if (set < s_count) {
+			// Sets not probed are stepped over with NOPs, as extra
+			// branches would take BTB entries of their own
+			if (sel < s_count && p->base.set_pos[sel] == set) {
 				func[ind++] = CMP_TRUE;
 				func[ind++] = BEQ_4;
-				func[ind++] = READ_EVCNTR;
-				func[ind++] = STORE_VALUE;
+				if (fused) {
+					ind += probe_generic_emit_count(&p->base,
+									&func[ind],
+									way, sel);
+				} else {
+					func[ind++] =
+					    probe_generic_read_counter(&p->base,
+								       1);
+					func[ind++] = STORE_VALUE;
+				}
+				sel++;
 			} else {
-				func[ind++] = NOP;
-				func[ind++] = NOP;
-				func[ind++] = NOP;
-				func[ind++] = NOP;
+				for (ext = 0; ext < gadget; ext++)
+					func[ind++] = NOP;
 			}
 			if (set < nsets - 1 || way < nways - 1) {
 				for (ext = 0; ext < numext; ext++) {
@@ -148,6 +163,7 @@ int probe_btb_configure(struct probe_btb *p, struct probe_config *cfg)
 
 	p->base.measure = (probe_func) func;
 	p->base.refill = (probe_func) func;
+	p->base.fused = fused;
 
 	flush_cache_all();
 	return 0;
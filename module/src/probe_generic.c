@@ -26,6 +26,7 @@
 
 #include <linux/slab.h>
 
+#include "arm64_defs.h"
 #include "cachegrab.h"
 
 void probe_generic_init(struct probe *p)
@@ -60,6 +61,12 @@ enum CGState probe_generic_attach(struct probe *p, struct probe_params *params)
 	memset(p->raw_buf, 0, meas_cnt * sizeof(u64));
 
 	// Handle PMU related steps
+	if (params->conf > EVENT_MAX) {
+		INFO("PMU event %llu out of range.", params->conf);
+		err = CG_BAD_ARG;
+		goto fail;
+	}
+	p->event = (unsigned int)params->conf;
 	memset(&pattr, 0, sizeof(struct perf_event_attr));
 	pattr.type = params->type;
 	pattr.size = sizeof(struct perf_event_attr);
@@ -76,7 +83,18 @@ enum CGState probe_generic_attach(struct probe *p, struct probe_params *params)
 		goto fail;
 	}
 
+	// The probe code reads the counter directly, so it is generated for
+	// the counter perf gives the pinned event while it is scheduled.
+	p->pmu_idx = p->pevent->hw.idx;
 	perf_event_disable(p->pevent);
+	if (p->pmu_idx < 0) {
+		WARNING("Performance counter was not scheduled.");
+		perf_event_release_kernel(p->pevent);
+		p->pevent = NULL;
+		err = CG_INTERNAL_ERR;
+		goto fail;
+	}
+	DEBUG("counter index is %d", p->pmu_idx);
 
 	// Finish
 	p->attached = true;
@@ -102,12 +120,53 @@ void probe_generic_detach(struct probe *p)
 	if (p->raw_buf) {
 		kfree(p->raw_buf);
 	}
+	if (p->set_pos) {
+		kfree(p->set_pos);
+		p->set_pos = NULL;
+		p->set_cnt = 0;
+	}
+	if (p->line_offs) {
+		kfree(p->line_offs);
+		p->line_offs = NULL;
+	}
+	if (p->baseline) {
+		kfree(p->baseline);
+		p->baseline = NULL;
+	}
 	p->attached = false;
 }
 
+/**
+ * Determine if configuration CFG, probing the CNT sets of SET_POS, reports
+ * the same values for the same sets as the current one of probe P.
+ */
+static bool probe_generic_same_sets(struct probe *p, struct probe_config *cfg,
+				    const unsigned int *set_pos,
+				    unsigned int cnt)
+{
+	struct probe_config *a = &p->cfg;
+
+	if (a->set_start != cfg->set_start || a->set_end != cfg->set_end ||
+	    a->output != cfg->output || a->group_size != cfg->group_size)
+		return false;
+	return p->set_cnt == cnt &&
+	    memcmp(p->set_pos, set_pos, cnt * sizeof(unsigned int)) == 0;
+}
+
+/**
+ * Test whether SET is selected by the mask of configuration CFG.
+ */
+static bool probe_generic_mask_test(struct probe_config *cfg, unsigned int set)
+{
+	return set / 8 < cfg->set_mask_len &&
+	    (cfg->set_mask[set / 8] & (1 << (set % 8)));
+}
+
 int probe_generic_configure(struct probe *p, struct probe_config *cfg)
 {
-	unsigned int start, end, max;
+	unsigned int start, end, max, n, k, cnt;
+	unsigned int *set_pos;
+	u32 *line_offs = NULL;
 	struct probe_config default_config;
 
 	if (!p->attached) {
@@ -118,6 +177,12 @@ int probe_generic_configure(struct probe *p, struct probe_config *cfg)
 		INFO("Setting to default configuration.");
 		default_config.set_start = 0;
 		default_config.set_end = p->cache_shape.num_sets;
+		default_config.output = PROBE_OUTPUT_COUNT;
+		default_config.refills = PROBE_DEFAULT_REFILLS;
+		default_config.masked = false;
+		default_config.set_mask = NULL;
+		default_config.set_mask_len = 0;
+		default_config.group_size = 0;
 		cfg = &default_config;
 	} else {
 		start = cfg->set_start;
@@ -127,9 +192,83 @@ int probe_generic_configure(struct probe *p, struct probe_config *cfg)
 			INFO("Invalid probe configuration.");
 			return -1;
 		}
+		if (cfg->output > PROBE_OUTPUT_BITMASK) {
+			INFO("Invalid probe output.");
+			return -1;
+		}
+		if (cfg->refills > PROBE_MAX_REFILLS) {
+			INFO("Invalid probe refill count.");
+			return -1;
+		}
+		if (cfg->masked && cfg->set_mask == NULL) {
+			INFO("Masked configuration without a set mask.");
+			return -1;
+		}
+		if (cfg->masked && max > PROBE_MAX_SETS) {
+			INFO("Set masks support up to %u sets.", PROBE_MAX_SETS);
+			return -1;
+		}
+		if (cfg->group_size > 0 &&
+		    (p->line_base == NULL || cfg->output != PROBE_OUTPUT_COUNT ||
+		     p->cache_shape.associativity < 2)) {
+			INFO("Probe can't be probed by groups.");
+			return -1;
+		}
+	}
+
+	// List the sets to probe
+	max = p->cache_shape.num_sets;
+	n = set_count(cfg->set_start, cfg->set_end, max);
+	set_pos = kmalloc(n * sizeof(unsigned int), GFP_KERNEL);
+	if (set_pos == NULL)
+		return -1;
+	cnt = 0;
+	for (k = 0; k < n; k++) {
+		if (!cfg->masked ||
+		    probe_generic_mask_test(cfg, (cfg->set_start + k) % max))
+			set_pos[cnt++] = k;
+	}
+	if (cnt == 0) {
+		INFO("No sets selected.");
+		kfree(set_pos);
+		return -1;
 	}
 
+	// Locate the lines of each probed set
+	if (cfg->group_size > 0) {
+		line_offs = kmalloc(cnt * sizeof(u32), GFP_KERNEL);
+		if (line_offs == NULL) {
+			kfree(set_pos);
+			return -1;
+		}
+		for (k = 0; k < cnt; k++) {
+			line_offs[k] = (cfg->set_start + set_pos[k] -
+					p->set_offset + max) % max;
+			line_offs[k] *= p->cache_shape.line_size;
+		}
+	}
+
+	// The baseline is kept across reconfigurations which probe the same
+	// sets.
+	if (p->baseline && !probe_generic_same_sets(p, cfg, set_pos, cnt)) {
+		kfree(p->baseline);
+		p->baseline = NULL;
+	}
+
+	if (p->set_pos)
+		kfree(p->set_pos);
+	p->set_pos = set_pos;
+	p->set_cnt = cnt;
+	if (p->line_offs)
+		kfree(p->line_offs);
+	p->line_offs = line_offs;
+
 	memcpy(&p->cfg, cfg, sizeof(struct probe_config));
+	p->cfg.set_mask = NULL;
+	p->cfg.set_mask_len = 0;
+	if (p->cfg.refills == 0)
+		p->cfg.refills = PROBE_DEFAULT_REFILLS;
+	p->fused = false;
 	return 0;
 }
 
@@ -151,8 +290,12 @@ int is_probe_activated(struct probe *p)
 int probe_generic_activate(struct probe *p)
 {
 	perf_event_enable(p->pevent);
-	DEBUG("counter index is %d", p->pevent->hw.idx);
-	p->pmu_idx = p->pevent->hw.idx;
+	if (p->pevent->hw.idx != p->pmu_idx) {
+		WARNING("Counter moved from %d to %d, reattach the probe.",
+			p->pmu_idx, p->pevent->hw.idx);
+		perf_event_disable(p->pevent);
+		return -1;
+	}
 	p->activated = true;
 	return 0;
 }
@@ -172,11 +315,76 @@ void probe_generic_deactivate(struct probe *p)
 	p->activated = false;
 }
 
+size_t probe_generic_set_size(struct probe * p)
+{
+	switch (p->cfg.output) {
+	case PROBE_OUTPUT_WAYS:
+		return p->cache_shape.associativity;
+	case PROBE_OUTPUT_BITMASK:
+		return DIV_ROUND_UP(p->cache_shape.associativity, 8);
+	default:
+		return 1;
+	}
+}
+
 size_t probe_generic_sample_size(struct probe * p)
 {
 	if (is_probe_attached(p))
-		return set_count(p->cfg.set_start,
-				 p->cfg.set_end, p->cache_shape.num_sets);
+		return probe_generic_group_bytes(p) +
+		    p->set_cnt * probe_generic_set_size(p);
 	else
 		return 0;
 }
+
+uint32_t probe_generic_read_counter(struct probe *p, unsigned int rt)
+{
+	if (p->pmu_idx == ARMV8_IDX_CYCLE_COUNTER)
+		return READ_CCNTR | rt;
+	return READ_EVCNTR_N(ARMV8_IDX_TO_COUNTER(p->pmu_idx)) | rt;
+}
+
+unsigned int probe_generic_emit_count(struct probe *p, uint32_t * func,
+				      unsigned int way, unsigned int set)
+{
+	func[0] = probe_generic_read_counter(p, 2);
+	func[1] = CMP_X2_X1;
+	func[2] = MOV_X1_X2;
+	if (way == 0) {
+		func[3] = NOP;
+		func[4] = CSET_HI;
+	} else {
+		func[3] = COUNT_OFFS(LOAD_COUNT, set);
+		func[4] = CINC_HI;
+	}
+	func[5] = COUNT_OFFS(STORE_COUNT, set);
+	return COUNT_INS;
+}
+
+size_t probe_generic_group_bytes(struct probe *p)
+{
+	if (p->cfg.group_size == 0)
+		return 0;
+	return DIV_ROUND_UP(DIV_ROUND_UP(p->set_cnt, p->cfg.group_size), 8);
+}
+
+unsigned int probe_generic_packed_bits(struct probe *p)
+{
+	unsigned int bits = 1;
+
+	if (p->cfg.output != PROBE_OUTPUT_COUNT)
+		return 8;
+	while (bits < 8 && (1U << bits) <= p->cache_shape.associativity)
+		bits *= 2;
+	return bits;
+}
+
+size_t probe_generic_packed_size(struct probe *p)
+{
+	if (!is_probe_attached(p))
+		return 0;
+	if (p->cfg.output != PROBE_OUTPUT_COUNT)
+		return probe_generic_sample_size(p);
+
+	return probe_generic_group_bytes(p) +
+	    DIV_ROUND_UP(p->set_cnt * probe_generic_packed_bits(p), 8);
+}
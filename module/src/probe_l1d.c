@@ -24,6 +24,7 @@
 
 #include "probe_types.h"
 
+#include <asm/cacheflush.h>
 #include <linux/delay.h>
 #include <linux/kallsyms.h>
 
@@ -35,16 +36,44 @@ void probe_l1d_init(struct probe_l1d *p)
 	probe_generic_init((struct probe *)p);
 }
 
+/**
+ * Upper bound on the number of instructions needed to touch every line of a
+ * cache with shape S.
+ *
+ * Each way starts by loading its base address, and the base is reloaded
+ * whenever the next line is out of reach of the load's immediate offset.
+ */
+static size_t probe_l1d_max_ins(struct cache_shape *s)
+{
+	size_t lines, bases;
+
+	lines = (size_t)s->num_sets * s->associativity;
+	bases = s->associativity *
+	    (1 + (size_t)s->num_sets * s->line_size / LOAD_LINE_MAX_OFFS);
+
+	// Measure: load, dsb, isb, mrs, str per line. Refill: load per line.
+	return 6 * lines + 2 * 4 * bases + 2;
+}
+
 enum CGState probe_l1d_attach(struct probe_l1d *p, int cpu,
-			      struct cache_shape *s)
+			      struct cache_shape *s, unsigned int event)
 {
 	enum CGState err;
 	struct probe_params params;
+	size_t mem_needed;
 	u64 offs;
 
 	if (p->base.attached)
 		return CG_PROBE_ALREADY_CONNECTED;
-
+	if (s == NULL) {
+		INFO("Cache shape should not be null.");
+		return CG_BAD_ARG;
+	}
+	if (s->num_sets == 0 || s->associativity == 0 ||
+	    s->line_size == 0 || s->line_size % 8 != 0) {
+		INFO("L1D line size must be a multiple of 8.");
+		return CG_BAD_ARG;
+	}
 	// We use _text as a reference since it is likely to be the
 	// beginning of a large number of physically contiguous pages
 	p->kernel_code_base = (u8 *) kallsyms_lookup_name("_text");
@@ -54,81 +83,119 @@ enum CGState probe_l1d_attach(struct probe_l1d *p, int cpu,
 	}
 	// Compute which set our first measurement comes from
 	offs = (u64) virt_to_phys(p->kernel_code_base);
-	offs /= p->base.cache_shape.line_size;
-	offs %= p->base.cache_shape.num_sets;
+	offs /= s->line_size;
+	offs %= s->num_sets;
 	p->base.set_offset = (unsigned int)offs;
+	p->base.line_base = p->kernel_code_base;
+	p->base.way_stride = (size_t)s->num_sets * s->line_size;
+
+	mem_needed = probe_l1d_max_ins(s) * INS_SIZE;
+	if (cgmem_init(&p->exec_mem, mem_needed, MEM_FLAG_EXECUTABLE) == NULL) {
+		err = CG_NO_MEM;
+		goto fail_execmem;
+	}
 
 	params.target_cpu = cpu;
 	params.type = PERF_TYPE_RAW;
-	params.conf = EVENT_L1_DCACHE_REFILL;
+	params.conf = event ? event : EVENT_L1_DCACHE_REFILL;
 
 	params.cache_shape = s;
 	err = probe_generic_attach((struct probe *)p, &params);
 	if (err != CG_OK)
-		return err;
+		goto fail_generic;
 
 	p->base.measure = (probe_func) probe_l1d_measure;
 	p->base.refill = (probe_func) probe_l1d_refill;
 	return CG_OK;
+ fail_generic:
+	cgmem_deinit(&p->exec_mem);
+ fail_execmem:
+	return err;
 }
 
 void probe_l1d_detach(struct probe_l1d *p)
 {
 	probe_generic_detach((struct probe *)p);
+	cgmem_deinit(&p->exec_mem);
 }
 
-int probe_l1d_configure(struct probe_l1d *p, struct probe_config *cfg)
-{
-	return probe_generic_configure((struct probe *)p, cfg);
-}
-
-void probe_l1d_measure(u64 * buf, struct probe_l1d *p)
+/**
+ * Emit code touching every line of the configured sets into FUNC, in the
+ * same (way, set) order the samples are laid out in. If MEASURE is set, the
+ * counter is read and stored to the buffer in x0 after each line.
+ *
+ * Returns the number of instructions written, including the final return.
+ */
+static unsigned int probe_l1d_emit(struct probe_l1d *p, uint32_t * func,
+				   bool measure)
 {
 	unsigned int way, nways = p->base.cache_shape.associativity;
 	unsigned int set, nsets = p->base.cache_shape.num_sets;
 	unsigned int line_size = p->base.cache_shape.line_size;
 	unsigned int start = p->base.cfg.set_start;
-	unsigned int s_count;
-	unsigned int offset_from_base;
-	volatile u8 *addr;
-	volatile u8 *addr_base;
-	u64 val = 0;
-	s_count = set_count(start, p->base.cfg.set_end, nsets);
-
-	offset_from_base = (start - p->base.set_offset + nsets) % nsets;
-	addr_base = p->kernel_code_base + line_size * offset_from_base;
+	unsigned int ind, hw;
+	u64 first, addr, base;
+
+	first = (u64) p->kernel_code_base;
+	first += line_size * ((start - p->base.set_offset + nsets) % nsets);
+
+	ind = 0;
 	for (way = 0; way < nways; way++) {
-		addr = addr_base + line_size * way * nsets;
-		for (set = 0; set < s_count; set++) {
-			*addr;
-			dsb(sy);
-			isb();
-			asm volatile ("mrs %0, pmxevcntr_el0":"=r" (val));
-			*buf++ = val;
-			addr += line_size;
+		base = first;
+		for (set = 0; set < p->base.set_cnt; set++) {
+			// Only the selected sets of the range are touched
+			addr = first + line_size *
+			    ((u64) way * nsets + p->base.set_pos[set]);
+			if (set == 0 || addr - base > LOAD_LINE_MAX_OFFS) {
+				base = addr;
+				func[ind++] = LOAD_BASE_HW(LOAD_BASE, base, 0);
+				for (hw = 1; hw < 4; hw++)
+					func[ind++] =
+					    LOAD_BASE_HW(LOAD_BASE_K, base, hw);
+			}
+			func[ind++] = LOAD_LINE_OFFS(addr - base);
+			if (measure) {
+				func[ind++] = DSB_SY;
+				func[ind++] = ISB;
+				func[ind++] =
+				    probe_generic_read_counter(&p->base, 1);
+				func[ind++] = STORE_VALUE;
+			}
 		}
 	}
+	func[ind++] = RET;
+	return ind;
 }
 
-void probe_l1d_refill(u64 * buf, struct probe_l1d *p)
+/**
+ * Generate straight-line measure and refill functions for the configured
+ * sets, so no loop bookkeeping runs between the measured loads.
+ */
+int probe_l1d_configure(struct probe_l1d *p, struct probe_config *cfg)
 {
-	unsigned int way, nways = p->base.cache_shape.associativity;
-	unsigned int set, nsets = p->base.cache_shape.num_sets;
-	unsigned int line_size = p->base.cache_shape.line_size;
-	unsigned int start, s_count;
-	volatile u8 *addr, *addr_base;
-	unsigned int offset_from_base;
+	int ret;
+	uint32_t *func;
+	unsigned int ind;
 
-	start = p->base.cfg.set_start;
-	s_count = set_count(start, p->base.cfg.set_end, nsets);
+	ret = probe_generic_configure((struct probe *)p, cfg);
+	if (ret < 0)
+		return ret;
 
-	offset_from_base = (start - p->base.set_offset + nsets) % nsets;
-	addr_base = p->kernel_code_base + line_size * offset_from_base;
-	for (way = 0; way < nways; way++) {
-		addr = addr_base + line_size * way * nsets;
-		for (set = 0; set < s_count; set++) {
-			*addr;
-			addr += line_size;
-		}
-	}
+	func = (uint32_t *) p->exec_mem.mapped_addr;
+	ind = probe_l1d_emit(p, func, true);
+	probe_l1d_emit(p, &func[ind], false);
+
+	p->base.measure = (probe_func) func;
+	p->base.refill = (probe_func) & func[ind];
+
+	flush_cache_all();
+	return 0;
+}
+
+void probe_l1d_measure(u64 * buf, struct probe_l1d *p)
+{
+}
+
+void probe_l1d_refill(u64 * buf, struct probe_l1d *p)
+{
 }
@@ -37,7 +37,7 @@ void probe_l1i_init(struct probe_l1i *p)
 }
 
 enum CGState probe_l1i_attach(struct probe_l1i *p, int cpu,
-			      struct cache_shape *s)
+			      struct cache_shape *s, unsigned int event)
 {
 	enum CGState err;
 	struct probe_params params;
@@ -77,7 +77,7 @@ enum CGState probe_l1i_attach(struct probe_l1i *p, int cpu,
 
 	params.target_cpu = cpu;
 	params.type = PERF_TYPE_RAW;
-	params.conf = EVENT_L1_ICACHE_REFILL;
+	params.conf = event ? event : EVENT_L1_ICACHE_REFILL;
 
 	params.cache_shape = s;
 	err = probe_generic_attach((struct probe *)p, &params);
@@ -99,14 +99,32 @@ void probe_l1i_detach(struct probe_l1i *p)
 	cgmem_deinit(&p->exec_mem);
 }
 
+/**
+ * Get the index of the first instruction of the line probed after set SEL of
+ * way WAY, or RET_IND after the last one.
+ */
+static unsigned int probe_l1i_next(struct probe_l1i *p, unsigned int way,
+				   unsigned int sel, unsigned int ret_ind)
+{
+	unsigned int nsets = p->base.cache_shape.num_sets;
+	unsigned int lines = p->base.cache_shape.line_size / INS_SIZE;
+
+	if (sel < p->base.set_cnt)
+		return (way * nsets + p->base.set_pos[sel]) * lines;
+	if (way < p->base.cache_shape.associativity - 1)
+		return ((way + 1) * nsets + p->base.set_pos[0]) * lines;
+	return ret_ind;
+}
+
 int probe_l1i_configure(struct probe_l1i *p, struct probe_config *cfg)
 {
 	int ret;
 	unsigned int way, nways, set, nsets, line_size;
-	unsigned int start, end, ext, numext;
-	unsigned int s_count;
+	unsigned int start, ext, numext, lines;
+	unsigned int sel, s_count, gadget;
 	uint32_t *func;
-	unsigned int ind, offset;
+	unsigned int ind, line, next, ret_ind, offset;
+	bool fused;
 
 	ret = probe_generic_configure((struct probe *)p, cfg);
 	if (ret < 0)
@@ -116,9 +134,14 @@ int probe_l1i_configure(struct probe_l1i *p, struct probe_config *cfg)
 	nsets = p->base.cache_shape.num_sets;
 	line_size = p->base.cache_shape.line_size;
 	start = p->base.cfg.set_start;
-	end = p->base.cfg.set_end;
-	numext = (line_size / INS_SIZE) - 2;
-	s_count = set_count(start, end, nsets);
+	s_count = p->base.set_cnt;
+	// Counts are reduced inline when the counting gadget fits in a line
+	fused = p->base.cfg.output == PROBE_OUTPUT_COUNT &&
+	    line_size >= COUNT_INS * INS_SIZE && s_count <= COUNT_MAX_SETS;
+	gadget = fused ? COUNT_INS : 2;
+	lines = line_size / INS_SIZE;
+	numext = lines - gadget;
+	ret_ind = (nways * nsets - 1) * lines + gadget;
 
 	offset = (start - p->base.set_offset + nsets) % nsets;
 	offset *= line_size;
@@ -126,25 +149,46 @@ int probe_l1i_configure(struct probe_l1i *p, struct probe_config *cfg)
 
 	ind = 0;
 	for (way = 0; way < nways; way++) {
+		sel = 0;
 		for (set = 0; set < nsets; set++) {
-			if (set < s_count) {
-				func[ind++] = READ_EVCNTR;
-				func[ind++] = STORE_VALUE;
+			line = ind;
+			if (sel < s_count && p->base.set_pos[sel] == set) {
+				if (fused) {
+					ind += probe_generic_emit_count(&p->base,
+									&func[ind],
+									way, sel);
+				} else {
+					func[ind++] =
+					    probe_generic_read_counter(&p->base,
+								       1);
+					func[ind++] = STORE_VALUE;
+				}
+				sel++;
+
+				// Jump over the lines of sets not probed
+				next = probe_l1i_next(p, way, sel, ret_ind);
+				if (numext > 0 && next > line + lines) {
+					func[ind] = BRANCH_INS(next - ind);
+					ind++;
+				}
 			} else {
-				func[ind++] = NOP;
-				func[ind++] = NOP;
+				for (ext = 0; ext < gadget; ext++)
+					func[ind++] = NOP;
 			}
 			if (set < nsets - 1 || way < nways - 1) {
-				for (ext = 0; ext < numext; ext++) {
+				while (ind < line + lines)
 					func[ind++] = NOP;
-				}
 			}
 		}
 	}
 	func[ind] = RET;
 
+	// Enter at the first probed set, so the lines of the sets before it
+	// are neither fetched nor run.
+	func += p->base.set_pos[0] * lines;
 	p->base.measure = (probe_func) func;
 	p->base.refill = (probe_func) func;
+	p->base.fused = fused;
 
 	flush_cache_all();
 	return 0;
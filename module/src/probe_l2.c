@@ -0,0 +1,251 @@
+/**
+ * This file is part of the Cachegrab kernel module.
+ *
+ * Copyright (C) 2017 NCC Group
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Cachegrab.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ Version 1.0
+ Keegan Ryan, NCC Group
+*/
+
+#include "probe_types.h"
+
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/mmzone.h>
+#include <linux/random.h>
+#include <linux/slab.h>
+
+#include "arm64_defs.h"
+#include "cachegrab.h"
+#include "probes.h"
+
+void probe_l2_init(struct probe_l2 *p)
+{
+	probe_generic_init((struct probe *)p);
+	p->sweep = NULL;
+}
+
+enum CGState probe_l2_attach(struct probe_l2 *p, int cpu,
+			     struct cache_shape *s, unsigned int event)
+{
+	enum CGState err;
+	struct probe_params params;
+	size_t mem_needed;
+	u64 offs;
+
+	if (p->base.attached) {
+		INFO("Probe already attached.");
+		return CG_PROBE_ALREADY_CONNECTED;
+	}
+	if (s == NULL) {
+		INFO("Cache shape should not be null.");
+		return CG_BAD_ARG;
+	}
+	if (s->num_sets == 0 || s->associativity == 0 || s->line_size == 0) {
+		INFO("Invalid cache shape.");
+		return CG_BAD_ARG;
+	}
+	// The L2 is physically indexed, so each way of the eviction buffer
+	// must be physically contiguous for consecutive lines to fall into
+	// consecutive sets.
+	mem_needed = (size_t)s->num_sets * s->associativity * s->line_size;
+	if (order_base_2(DIV_ROUND_UP(mem_needed, PAGE_SIZE)) >= MAX_ORDER) {
+		INFO("L2 eviction buffer of %zu bytes is too large.",
+		     mem_needed);
+		return CG_NO_MEM;
+	}
+	if (cgmem_init(&p->evict_mem, mem_needed, 0) == NULL) {
+		err = CG_NO_MEM;
+		goto fail_evictmem;
+	}
+	// Compute which set our first line falls into
+	offs = (u64) page_to_phys(p->evict_mem.raw_pages);
+	offs /= s->line_size;
+	offs %= s->num_sets;
+	p->base.set_offset = (unsigned int)offs;
+	p->base.line_base = (u8 *) p->evict_mem.mapped_addr;
+	p->base.way_stride = (size_t)s->num_sets * s->line_size;
+
+	params.target_cpu = cpu;
+	params.type = PERF_TYPE_RAW;
+	params.conf = event ? event : EVENT_L2_DCACHE_REFILL;
+
+	params.cache_shape = s;
+	err = probe_generic_attach((struct probe *)p, &params);
+	if (err != CG_OK)
+		goto fail_generic;
+
+	p->base.measure = (probe_func) probe_l2_measure;
+	p->base.refill = (probe_func) probe_l2_refill;
+	return CG_OK;
+ fail_generic:
+	cgmem_deinit(&p->evict_mem);
+ fail_evictmem:
+	return err;
+}
+
+void probe_l2_detach(struct probe_l2 *p)
+{
+	probe_generic_detach((struct probe *)p);
+	cgmem_deinit(&p->evict_mem);
+	if (p->sweep) {
+		kfree(p->sweep);
+		p->sweep = NULL;
+	}
+}
+
+/**
+ * Build the eviction sets for the configured range of sets.
+ *
+ * Walking the sets in address order lets the hardware prefetchers pull in
+ * the next lines of the buffer, which hides misses from the counter. The
+ * sets are swept in a random order instead, and within a set the ways are
+ * a whole way of the buffer apart.
+ */
+int probe_l2_configure(struct probe_l2 *p, struct probe_config *cfg)
+{
+	int ret;
+	unsigned int i, j, nsets, line_size, start, s_count, set;
+	unsigned int *set_pos;
+	struct probe_l2_set *sweep, tmp;
+
+	ret = probe_generic_configure((struct probe *)p, cfg);
+	if (ret < 0)
+		return ret;
+
+	// The sets of the old configuration must not be swept any more,
+	// even if the new sweep can't be built.
+	if (p->sweep)
+		kfree(p->sweep);
+	p->sweep = NULL;
+	p->sweep_len = 0;
+
+	set_pos = p->base.set_pos;
+	nsets = p->base.cache_shape.num_sets;
+	line_size = p->base.cache_shape.line_size;
+	start = p->base.cfg.set_start;
+	s_count = p->base.set_cnt;
+
+	sweep = kmalloc(s_count * sizeof(struct probe_l2_set), GFP_KERNEL);
+	if (sweep == NULL)
+		return -1;
+
+	for (i = 0; i < s_count; i++) {
+		set = (start + set_pos[i]) % nsets;
+		sweep[i].offs = ((set - p->base.set_offset + nsets) % nsets) *
+		    line_size;
+		sweep[i].idx = i;
+	}
+	for (i = s_count - 1; i > 0; i--) {
+		j = prandom_u32() % (i + 1);
+		tmp = sweep[i];
+		sweep[i] = sweep[j];
+		sweep[j] = tmp;
+	}
+
+	p->sweep = sweep;
+	p->sweep_len = s_count;
+
+	// Counts only need one counter read per set
+	p->base.fused = p->base.cfg.output == PROBE_OUTPUT_COUNT;
+	p->base.measure = p->base.fused ? (probe_func) probe_l2_count :
+	    (probe_func) probe_l2_measure;
+	return 0;
+}
+
+void probe_l2_measure(u64 * buf, struct probe_l2 *p)
+{
+	unsigned int way, nways = p->base.cache_shape.associativity;
+	unsigned int i, s_count = p->sweep_len;
+	size_t stride = p->base.way_stride;
+	u8 *base = (u8 *) p->evict_mem.mapped_addr;
+	struct probe_l2_set *e;
+	volatile u8 *addr;
+	int idx = p->base.pmu_idx;
+	u64 val, prev;
+
+	// The counter value before the first line was stored just ahead of
+	// BUF by probes_measure_generic.
+	prev = buf[-1];
+	for (i = 0; i < s_count; i++) {
+		e = &p->sweep[i];
+		// Probe the ways in the opposite order they were primed, so an
+		// LRU policy doesn't evict the lines still to be probed.
+		addr = base + e->offs + (nways - 1) * stride;
+		for (way = nways; way-- > 0;) {
+			*addr;
+			dsb(sy);
+			isb();
+			val = probes_read_counter(idx);
+			buf[way * s_count + e->idx] = val - prev;
+			prev = val;
+			addr -= stride;
+		}
+	}
+
+	// Turn the per-line deltas into the running counter values that
+	// probes_reduce expects, in (way, set) order.
+	val = buf[-1];
+	for (i = 0; i < nways * s_count; i++) {
+		val += buf[i];
+		buf[i] = val;
+	}
+}
+
+void probe_l2_count(u8 * counts, u64 prev, struct probe_l2 *p)
+{
+	unsigned int way, nways = p->base.cache_shape.associativity;
+	unsigned int i, s_count = p->sweep_len;
+	size_t stride = p->base.way_stride;
+	u8 *base = (u8 *) p->evict_mem.mapped_addr;
+	int idx = p->base.pmu_idx;
+	struct probe_l2_set *e;
+	volatile u8 *addr;
+	u64 val;
+
+	for (i = 0; i < s_count; i++) {
+		e = &p->sweep[i];
+		addr = base + e->offs + (nways - 1) * stride;
+		for (way = nways; way-- > 0;) {
+			*addr;
+			addr -= stride;
+		}
+		dsb(sy);
+		isb();
+		val = probes_read_counter(idx);
+		counts[e->idx] = (u8) min_t(u64, val - prev, nways);
+		prev = val;
+	}
+}
+
+void probe_l2_refill(u64 * buf, struct probe_l2 *p)
+{
+	unsigned int way, nways = p->base.cache_shape.associativity;
+	unsigned int i, s_count = p->sweep_len;
+	size_t stride = p->base.way_stride;
+	u8 *base = (u8 *) p->evict_mem.mapped_addr;
+	volatile u8 *addr;
+
+	for (i = 0; i < s_count; i++) {
+		addr = base + p->sweep[i].offs;
+		for (way = 0; way < nways; way++) {
+			*addr;
+			addr += stride;
+		}
+	}
+}
@@ -49,28 +49,61 @@
 
 struct probe;
 typedef void (*probe_func) (u64 *, struct probe *);
+typedef void (*probe_count_func) (u8 *, u64, struct probe *);
 
 enum probe_type {
 	PROBE_TYPE_UNKNOWN,
 	PROBE_TYPE_L1D,
 	PROBE_TYPE_L1I,
 	PROBE_TYPE_BTB,
+	PROBE_TYPE_L2,
 };
 
+/**
+ * What a probe reports for each set in a sample.
+ */
+enum probe_output {
+	PROBE_OUTPUT_COUNT,	// Number of ways which missed, one byte
+	PROBE_OUTPUT_WAYS,	// Counter delta of each way, one byte per way
+	PROBE_OUTPUT_BITMASK,	// Bitmask of the ways which missed
+};
+
+// Refill passes per sample, up from the minimum needed with LRU-like caches
+#define PROBE_DEFAULT_REFILLS 7
+#define PROBE_MAX_REFILLS 16
+
+// Largest cache a set mask can describe
+#define PROBE_MAX_SETS 4096
+
 /**
  * Configuration of a probe.
  *
- * The configuration may be changed while the probe is attached.
+ * The configuration may be changed while the probe is attached. REFILLS is
+ * the number of refill passes run after each sample, 0 selecting
+ * PROBE_DEFAULT_REFILLS. If MASKED is set, only the sets of the range
+ * which are set in SET_MASK are probed, and the sample only holds those.
+ * SET_MASK holds SET_MASK_LEN bytes, one bit per set from the low bits of
+ * each byte. It is only read while configuring and isn't kept; the probe
+ * keeps its list of probed sets instead.
+ *
+ * A non-zero GROUP_SIZE probes the sets coarse to fine, in groups of that
+ * many probed sets, see probes_measure_groups.
  */
 struct probe_config {
 	unsigned int set_start;
 	unsigned int set_end;
+	enum probe_output output;
+	unsigned int refills;
+	bool masked;
+	const u8 *set_mask;
+	size_t set_mask_len;
+	unsigned int group_size;
 };
 
 /**
  * Structure to describe the shape of an arbitrary cache.
  *
- * This may be the BTB, L1D, or L1I.
+ * This may be the BTB, L1D, L1I, or L2.
  */
 struct cache_shape {
 	unsigned int num_sets;
@@ -93,20 +126,43 @@ struct probe {
 	struct probe_config cfg;
 	u64 *raw_buf;
 
+	// Position of each probed set from SET_START, in sample order
+	unsigned int *set_pos;
+	unsigned int set_cnt;
+
+	// Lines of data probes, which can be probed by groups of sets. Way W
+	// of probed set I is at LINE_BASE + W * WAY_STRIDE + LINE_OFFS[I].
+	// LINE_BASE is NULL for probes which can't.
+	u8 *line_base;
+	size_t way_stride;
+	u32 *line_offs;
+
+	// Per-set miss count calibrated with the target idle, subtracted from
+	// the counts of every sample. NULL if the probe isn't calibrated.
+	u8 *baseline;
+
 	probe_func measure;
 	probe_func refill;
+	// MEASURE is a probe_count_func writing the per-set miss counts
+	bool fused;
 
 	unsigned int set_offset;
+	unsigned int event;
 	struct perf_event *pevent;
 	enum probe_type type;
 };
 
 /**
  * Structure representing the L1D probe.
+ *
+ * The lines of KERNEL_CODE_BASE are touched by code generated into EXEC_MEM,
+ * so the probe itself adds no data accesses besides the stores to the
+ * sample buffer.
  */
 struct probe_l1d {
 	struct probe base;
 	u8 *kernel_code_base;
+	struct cgmem exec_mem;
 };
 
 /**
@@ -125,6 +181,31 @@ struct probe_btb {
 	struct cgmem exec_mem;
 };
 
+/**
+ * Eviction set of a single L2 set.
+ *
+ * OFFS is the offset of the first way of the set in the eviction buffer, and
+ * IDX the position of the set within the configured range.
+ */
+struct probe_l2_set {
+	u32 offs;
+	u32 idx;
+};
+
+/**
+ * Structure representing the L2 probe.
+ *
+ * EVICT_MEM is physically contiguous, so lines BASE.WAY_STRIDE bytes apart
+ * map to the same set. SWEEP holds the SWEEP_LEN configured sets in the
+ * order they are probed.
+ */
+struct probe_l2 {
+	struct probe base;
+	struct cgmem evict_mem;
+	struct probe_l2_set *sweep;
+	unsigned int sweep_len;
+};
+
 /**
  * Structure to describe parameters needed to attach a probe.
  */
@@ -142,6 +223,7 @@ void probe_generic_init(struct probe *p);
 void probe_l1d_init(struct probe_l1d *p);
 void probe_l1i_init(struct probe_l1i *p);
 void probe_btb_init(struct probe_btb *p);
+void probe_l2_init(struct probe_l2 *p);
 
 /**
  * Check if the probe is attached.
@@ -157,17 +239,24 @@ int is_probe_attached(struct probe *p);
  * This does not use the existing interfaces to the PMU because the
  * probe functions are hardcoded to expect.
  *
+ * The counter normally counts the refill or misprediction event matching
+ * the probe, but EVENT selects any other PMU event for the same Prime+Probe
+ * engine, e.g. L2 or TLB refills. An EVENT of 0 keeps the default.
+ *
  * @param p The probe structure to enable.
  * @param target_cpu The target core to monitor.
+ * @param event The PMU event number to count, or 0 for the default.
  * @return CG_OK if successful, error otherwise.
  */
 enum CGState probe_generic_attach(struct probe *p, struct probe_params *params);
 enum CGState probe_l1d_attach(struct probe_l1d *p, int cpu,
-			      struct cache_shape *s);
+			      struct cache_shape *s, unsigned int event);
 enum CGState probe_l1i_attach(struct probe_l1i *p, int cpu,
-			      struct cache_shape *s);
+			      struct cache_shape *s, unsigned int event);
 enum CGState probe_btb_attach(struct probe_btb *p, int cpu,
-			      struct cache_shape *s);
+			      struct cache_shape *s, unsigned int event);
+enum CGState probe_l2_attach(struct probe_l2 *p, int cpu,
+			     struct cache_shape *s, unsigned int event);
 
 /**
  * Disable the probing capability on the target core.
@@ -180,6 +269,7 @@ void probe_generic_detach(struct probe *p);
 void probe_l1d_detach(struct probe_l1d *p);
 void probe_l1i_detach(struct probe_l1i *p);
 void probe_btb_detach(struct probe_btb *p);
+void probe_l2_detach(struct probe_l2 *p);
 
 /**
  * Configure the specified probe to only collect between the specified sets.
@@ -194,6 +284,7 @@ int probe_generic_configure(struct probe *p, struct probe_config *cfg);
 int probe_l1d_configure(struct probe_l1d *p, struct probe_config *cfg);
 int probe_l1i_configure(struct probe_l1i *p, struct probe_config *cfg);
 int probe_btb_configure(struct probe_btb *p, struct probe_config *cfg);
+int probe_l2_configure(struct probe_l2 *p, struct probe_config *cfg);
 
 /**
  * Get the cache shape of a probe.
@@ -235,6 +326,14 @@ int probe_generic_activate(struct probe *p);
  */
 void probe_generic_deactivate(struct probe *p);
 
+/**
+ * Return the number of bytes a probe reports for each set in a sample.
+ *
+ * @param p The probe object.
+ * @return The size, in bytes, of the output for a single set.
+ */
+size_t probe_generic_set_size(struct probe *p);
+
 /**
  * Return the size of a sample from a given probe.
  *
@@ -243,6 +342,54 @@ void probe_generic_deactivate(struct probe *p);
  */
 size_t probe_generic_sample_size(struct probe *p);
 
+/**
+ * Get the instruction reading the counter of the probe into register RT.
+ *
+ * The counter is read directly rather than through pmselr_el0, so it does
+ * not depend on which counter another probe last selected. PMU_IDX is
+ * resolved when the probe is attached, and activation fails rather than
+ * rebuild the code if perf later moves the event to another counter.
+ */
+uint32_t probe_generic_read_counter(struct probe *p, unsigned int rt);
+
+/**
+ * Emit the counting gadget for SET of way WAY into FUNC.
+ *
+ * The gadget compares the counter to the previous reading in x1 and adds a
+ * miss to byte SET of the buffer in x0. Way 0 initializes the byte.
+ *
+ * @return The number of instructions written, COUNT_INS.
+ */
+unsigned int probe_generic_emit_count(struct probe *p, uint32_t * func,
+				      unsigned int way, unsigned int set);
+
+/**
+ * Get the number of bytes of the refined group mask at the start of the
+ * samples of a probe probed by groups.
+ *
+ * @return The size of the mask, 0 if the probe isn't probed by groups.
+ */
+size_t probe_generic_group_bytes(struct probe *p);
+
+/**
+ * Return the number of bits needed for each set in a packed sample.
+ *
+ * Only per-set counts are packed, using the smallest power of two number of
+ * bits that holds the associativity. Other outputs use whole bytes.
+ *
+ * @param p The probe object.
+ * @return The number of bits per set, 8 if the output is not packed.
+ */
+unsigned int probe_generic_packed_bits(struct probe *p);
+
+/**
+ * Return the size of a packed sample from a given probe.
+ *
+ * @param p The probe object.
+ * @return The size, in bytes, required by a packed sample from the probe.
+ */
+size_t probe_generic_packed_size(struct probe *p);
+
 /**
  * Measure the desired property.
  *
@@ -255,6 +402,20 @@ size_t probe_generic_sample_size(struct probe *p);
 void probe_l1d_measure(u64 * buf, struct probe_l1d *p);
 void probe_l1i_measure(u64 * buf, struct probe_l1i *p);
 void probe_btb_measure(u64 * buf, struct probe_btb *p);
+void probe_l2_measure(u64 * buf, struct probe_l2 *p);
+
+/**
+ * Measure the per-set miss counts of the L2 probe.
+ *
+ * This is the fused MEASURE of the L2 probe when it outputs counts. The
+ * ways of a set are loaded back to back and the counter is read once per
+ * set.
+ *
+ * @param counts Buffer receiving the miss count of each probed set.
+ * @param prev The counter value before the first set is probed.
+ * @param p The L2 probe.
+ */
+void probe_l2_count(u8 * counts, u64 prev, struct probe_l2 *p);
 
 /**
  * Refill the desired property.
@@ -269,5 +430,6 @@ void probe_btb_measure(u64 * buf, struct probe_btb *p);
 void probe_l1d_refill(u64 * buf, struct probe_l1d *p);
 void probe_l1i_refill(u64 * buf, struct probe_l1i *p);
 void probe_btb_refill(u64 * buf, struct probe_btb *p);
+void probe_l2_refill(u64 * buf, struct probe_l2 *p);
 
 #endif
@@ -24,6 +24,9 @@
 
 #include "probes.h"
 
+#include <asm/arch_timer.h>
+#include <asm/cacheflush.h>
+
 #include "arm64_defs.h"
 #include "cachegrab.h"
 #include "probe_types.h"
@@ -45,92 +48,338 @@ void probes_term()
 	return;
 }
 
-inline void probes_collect_generic(struct probe *p)
+/*
+ * Measure a probe coarse to fine. The sets are split in groups of
+ * GROUP_SIZE probed sets, and the coarse pass touches way 0 of every set of
+ * a group before reading the counter once. Way 0 was primed first, so it is
+ * the line an LRU cache evicts first when the victim touches the set, and
+ * the group only shows misses if the victim was active in it.
+ *
+ * Only the groups which missed are refined, by touching the other ways line
+ * by line from the last one down. The coarse reload of an evicted way 0
+ * pushes out way 1, so a set which misses in the fine pass is counted one
+ * more miss for way 0. The sets of the other groups are left at 0.
+ *
+ * OUT receives the bitmap of refined groups, then the count of each set.
+ */
+static void probes_measure_groups(struct probe *p, u8 * out, u64 prev)
 {
+	unsigned int first, i, g, end, way, cnt;
+	unsigned int nsets = p->set_cnt, nways = p->cache_shape.associativity;
+	size_t mbytes = probe_generic_group_bytes(p);
+	u8 *counts = out + mbytes;
+	volatile u8 *addr;
 	u64 val;
-	u64 ctr = ARMV8_IDX_TO_COUNTER(p->pmu_idx);
-	asm volatile ("msr pmselr_el0, %0"::"r" (ctr));
-	isb();
-	asm volatile ("mrs %0, pmxevcntr_el0":"=r" (val));
-	p->raw_buf[0] = val;
-	p->measure(&p->raw_buf[1], p);
+
+	memset(out, 0, mbytes + nsets);
+	for (first = 0, g = 0; first < nsets; first = end, g++) {
+		end = min(first + p->cfg.group_size, nsets);
+		for (i = first; i < end; i++) {
+			addr = p->line_base + p->line_offs[i];
+			*addr;
+		}
+		dsb(sy);
+		isb();
+		val = probes_read_counter(p->pmu_idx);
+		if (val == prev)
+			continue;
+		prev = val;
+
+		out[g / 8] |= 1 << (g % 8);
+		for (i = first; i < end; i++) {
+			cnt = 0;
+			addr = p->line_base + p->line_offs[i] +
+			    (nways - 1) * p->way_stride;
+			for (way = nways - 1; way > 0; way--) {
+				*addr;
+				dsb(sy);
+				isb();
+				val = probes_read_counter(p->pmu_idx);
+				if (val > prev)
+					cnt++;
+				prev = val;
+				addr -= p->way_stride;
+			}
+			counts[i] = cnt ? cnt + 1 : 0;
+		}
+	}
 }
 
-inline void probes_process_generic(struct probe *p, struct scope_sample *s)
+inline void probes_measure_generic(struct probe *p, u64 * raw)
+{
+	u64 val;
+
+	val = probes_read_counter(p->pmu_idx);
+	if (p->line_offs) {
+		probes_measure_groups(p, (u8 *) raw, val);
+		return;
+	}
+	if (p->fused) {
+		// The counts are accumulated as the probe runs
+		((probe_count_func) p->measure) ((u8 *) raw, val, p);
+		return;
+	}
+	raw[0] = val;
+	p->measure(&raw[1], p);
+}
+
+inline void probes_collect_generic(struct probe *p)
+{
+	probes_measure_generic(p, p->raw_buf);
+}
+
+/*
+ * Snapshot the counter values straight into the sample slot, leaving the
+ * reduction to probes_reduce.
+ */
+inline void probes_snapshot_generic(struct probe *p, struct scope_sample *s)
+{
+	probes_measure_generic(p, (u64 *) & s->data[s->data_offs]);
+	s->data_offs += probes_raw_size(p);
+}
+
+/*
+ * Get the part of the miss count CNT of probed set I above its baseline.
+ */
+static inline u8 probes_above_baseline(struct probe *p, unsigned int i, u8 cnt)
+{
+	u8 base = p->baseline ? p->baseline[i] : 0;
+
+	return (cnt > base) ? cnt - base : 0;
+}
+
+/*
+ * Copy out per-set miss counts above the baseline. Packed counts take
+ * NBYTES bytes.
+ */
+static inline unsigned int probes_copy_counts(struct probe *p,
+					      const u8 * counts, u8 * out,
+					      unsigned int nbytes, bool packed)
+{
+	unsigned int i, nsets, bits;
+
+	nsets = p->set_cnt;
+	if (!packed) {
+		for (i = 0; i < nsets; i++)
+			out[i] = probes_above_baseline(p, i, counts[i]);
+		return nsets;
+	}
+
+	bits = probe_generic_packed_bits(p);
+	memset(out, 0, nbytes);
+	for (i = 0; i < nsets; i++)
+		out[(i * bits) / 8] |=
+		    probes_above_baseline(p, i, counts[i]) << ((i * bits) % 8);
+	return nbytes;
+}
+
+/*
+ * Copy out the per-set counts measured by a fused probe.
+ */
+inline unsigned int probes_reduce_fused(struct probe *p, const u8 * counts,
+					u8 * out, bool packed)
+{
+	return probes_copy_counts(p, counts, out,
+				  probe_generic_packed_size(p), packed);
+}
+
+/*
+ * Copy out the refined group bitmap and the per-set counts of a probe
+ * measured by groups.
+ */
+inline unsigned int probes_reduce_groups(struct probe *p, const u8 * raw,
+					 u8 * out, bool packed)
+{
+	size_t mbytes = probe_generic_group_bytes(p);
+
+	memcpy(out, raw, mbytes);
+	return mbytes + probes_copy_counts(p, raw + mbytes, out + mbytes,
+					   probe_generic_packed_size(p) -
+					   mbytes, packed);
+}
+
+inline unsigned int probes_reduce_generic(struct probe *p, const u64 * raw,
+					  u8 * out, bool packed)
 {
 	u64 val, prev;
-	unsigned int i, j, nsets, nways;
-	size_t offs = s->data_offs;
+	unsigned int i, j, nsets, nways, nbytes, bits;
+
+	if (p->line_offs)
+		return probes_reduce_groups(p, (const u8 *)raw, out, packed);
+	if (p->fused)
+		return probes_reduce_fused(p, (const u8 *)raw, out, packed);
 
-	nsets = set_count(p->cfg.set_start,
-			  p->cfg.set_end, p->cache_shape.num_sets);
+	nsets = p->set_cnt;
 
 	nways = p->cache_shape.associativity;
+	switch (p->cfg.output) {
+	case PROBE_OUTPUT_WAYS:
+		// Keep the delta of every way, saturating at 255
+		for (i = 0; i < nsets; i++) {
+			for (j = 0; j < nways; j++) {
+				val = raw[j * nsets + i + 1];
+				prev = raw[j * nsets + i];
+				val = (val > prev) ? val - prev : 0;
+				out[i * nways + j] = (u8) min_t(u64, val, 0xFF);
+			}
+		}
+		return nsets * nways;
+	case PROBE_OUTPUT_BITMASK:
+		// Set bit J of the set if way J missed
+		nbytes = DIV_ROUND_UP(nways, 8);
+		for (i = 0; i < nsets; i++) {
+			u8 *mask = &out[i * nbytes];
+			memset(mask, 0, nbytes);
+			for (j = 0; j < nways; j++) {
+				val = raw[j * nsets + i + 1];
+				prev = raw[j * nsets + i];
+				if (val > prev)
+					mask[j / 8] |= 1 << (j % 8);
+			}
+		}
+		return nsets * nbytes;
+	default:
+		break;
+	}
+
+	if (packed) {
+		// Counts are packed starting from the low bits of each byte
+		nbytes = probe_generic_packed_size(p);
+		bits = probe_generic_packed_bits(p);
+		memset(out, 0, nbytes);
+		for (i = 0; i < nsets; i++) {
+			u8 cnt = 0;
+			for (j = 0; j < nways; j++) {
+				val = raw[j * nsets + i + 1];
+				prev = raw[j * nsets + i];
+				if (val > prev)
+					cnt += 1;
+			}
+			cnt = probes_above_baseline(p, i, cnt);
+			out[(i * bits) / 8] |= cnt << ((i * bits) % 8);
+		}
+		return nbytes;
+	}
+
 	for (i = 0; i < nsets; i++) {
 		u8 cnt = 0;
 		for (j = 0; j < nways; j++) {
-			val = p->raw_buf[j * nsets + i + 1];
-			prev = p->raw_buf[j * nsets + i];
+			val = raw[j * nsets + i + 1];
+			prev = raw[j * nsets + i];
 			if (val > prev)
 				cnt += 1;
 		}
-		s->data[offs + i] = cnt;
+		out[i] = probes_above_baseline(p, i, cnt);
 	}
-	s->data_offs += nsets;
+	return nsets;
+}
+
+inline void probes_process_generic(struct probe *p, struct scope_sample *s)
+{
+	s->data_offs += probes_reduce_generic(p, p->raw_buf,
+					      &s->data[s->data_offs],
+					      s->scope->packed);
 }
 
 inline void probes_refill_generic(struct probe *p)
 {
-	p->refill(p->raw_buf, p);
-	p->refill(p->raw_buf, p);
-	p->refill(p->raw_buf, p);
-	p->refill(p->raw_buf, p);
-	p->refill(p->raw_buf, p);
-	p->refill(p->raw_buf, p);
-	p->refill(p->raw_buf, p);
+	unsigned int i;
+
+	for (i = 0; i < p->cfg.refills; i++)
+		p->refill(p->raw_buf, p);
 }
 
-void probes_collect(void *p)
+/*
+ * Collect the sample at S->DATA, then refill the probes for the next one.
+ */
+static inline void probes_collect_one(struct scope_sample *s)
 {
-	unsigned long interrupt_flags;
-	struct scope_sample *s = (struct scope_sample *)p;
+	struct scope_sample_header *hdr;
 	struct probe_l1d *p_l1d;
 	struct probe_l1i *p_l1i;
 	struct probe_btb *p_btb;
-	u8 l1d, l1i, btb;
+	struct probe_l2 *p_l2;
+	u8 l1d, l1i, btb, l2;
 
-	local_irq_save(interrupt_flags);
+	p_l1d = &s->scope->l1d_probe;
+	p_l1i = &s->scope->l1i_probe;
+	p_btb = &s->scope->btb_probe;
+	p_l2 = &s->scope->l2_probe;
+	l1d = p_l1d->base.activated;
+	l1i = p_l1i->base.activated;
+	btb = p_btb->base.activated;
+	l2 = p_l2->base.activated;
 
-	if (s->scope->activated) {
-		p_l1d = &s->scope->l1d_probe;
-		p_l1i = &s->scope->l1i_probe;
-		p_btb = &s->scope->btb_probe;
-		l1d = p_l1d->base.activated;
-		l1i = p_l1i->base.activated;
-		btb = p_btb->base.activated;
+	hdr = (struct scope_sample_header *)s->data;
+	hdr->timestamp = arch_counter_get_cntvct();
+	hdr->seq = s->scope->sample_seq++;
+	hdr->missed = s->scope->missed;
+	s->scope->missed = 0;
 
+	s->data_offs = sizeof(struct scope_sample_header);
+	if (s->scope->deferred) {
+		if (l1d)
+			probes_snapshot_generic(&p_l1d->base, s);
+		if (l1i)
+			probes_snapshot_generic(&p_l1i->base, s);
+		if (btb)
+			probes_snapshot_generic(&p_btb->base, s);
+		if (l2)
+			probes_snapshot_generic(&p_l2->base, s);
+	} else {
 		if (l1d)
 			probes_collect_generic(&p_l1d->base);
 		if (l1i)
 			probes_collect_generic(&p_l1i->base);
 		if (btb)
 			probes_collect_generic(&p_btb->base);
+		if (l2)
+			probes_collect_generic(&p_l2->base);
 
-		s->data_offs = 0;
 		if (l1d)
 			probes_process_generic(&p_l1d->base, s);
 		if (l1i)
 			probes_process_generic(&p_l1i->base, s);
 		if (btb)
 			probes_process_generic(&p_btb->base, s);
+		if (l2)
+			probes_process_generic(&p_l2->base, s);
+	}
 
-		if (btb)
-			probes_refill_generic(&p_btb->base);
-		if (l1i)
-			probes_refill_generic(&p_l1i->base);
-		if (l1d)
-			probes_refill_generic(&p_l1d->base);
+	// The L2 is primed first, so priming the smaller caches
+	// afterwards doesn't leave them with L2 eviction lines.
+	if (l2)
+		probes_refill_generic(&p_l2->base);
+	if (btb)
+		probes_refill_generic(&p_btb->base);
+	if (l1i)
+		probes_refill_generic(&p_l1i->base);
+	if (l1d)
+		probes_refill_generic(&p_l1d->base);
+}
 
+void probes_collect(void *p)
+{
+	unsigned long interrupt_flags;
+	struct scope_sample *s = (struct scope_sample *)p;
+	u8 *first = s->data;
+	unsigned int i;
+	u64 start;
+
+	local_irq_save(interrupt_flags);
+
+	if (s->scope->activated || s->scope->pretrigger) {
+		s->triggered = s->scope->activated;
+		start = arch_counter_get_cntvct();
+		for (i = 0; i < s->batch; i++) {
+			// Start every sample of the batch on its own tick, so
+			// the spacing doesn't depend on how long probing took.
+			while (arch_counter_get_cntvct() - start < i * s->spin)
+				cpu_relax();
+			s->data = first + i * s->stride;
+			probes_collect_one(s);
+		}
+		s->data = first;
 		s->collected = true;
 	} else {
 		s->collected = false;
@@ -139,3 +388,145 @@ void probes_collect(void *p)
 	local_irq_restore(interrupt_flags);
 	return;
 }
+
+size_t probes_raw_size(struct probe *p)
+{
+	unsigned int nsets;
+
+	nsets = p->set_cnt;
+	if (p->line_offs)
+		return ALIGN(probe_generic_group_bytes(p) + nsets, sizeof(u64));
+	if (p->fused)
+		return ALIGN(nsets, sizeof(u64));
+	return (nsets * p->cache_shape.associativity + 1) * sizeof(u64);
+}
+
+void probes_reduce(struct scope_sample *s, u8 * tmp)
+{
+	struct probe *probes[4];
+	size_t raw_offs, offs = 0;
+	unsigned int i;
+
+	probes[0] = &s->scope->l1d_probe.base;
+	probes[1] = &s->scope->l1i_probe.base;
+	probes[2] = &s->scope->btb_probe.base;
+	probes[3] = &s->scope->l2_probe.base;
+
+	// The sample header is left in place
+	raw_offs = sizeof(struct scope_sample_header);
+	for (i = 0; i < ARRAY_SIZE(probes); i++) {
+		if (!is_probe_attached(probes[i]))
+			continue;
+		offs += probes_reduce_generic(probes[i],
+					      (u64 *) & s->data[raw_offs],
+					      &tmp[offs], s->scope->packed);
+		raw_offs += probes_raw_size(probes[i]);
+	}
+	memcpy(&s->data[sizeof(struct scope_sample_header)], tmp, offs);
+}
+
+/*
+ * Count the misses of probed set I in the measurement just taken into the
+ * raw buffer.
+ */
+static unsigned int probes_raw_set_misses(struct probe *p, unsigned int i)
+{
+	unsigned int j, nsets, misses = 0;
+	const u64 *raw = p->raw_buf;
+
+	if (p->line_offs || p->fused)
+		return ((const u8 *)raw + probe_generic_group_bytes(p))[i];
+
+	nsets = p->set_cnt;
+	for (j = 0; j < p->cache_shape.associativity; j++) {
+		if (raw[j * nsets + i + 1] > raw[j * nsets + i])
+			misses++;
+	}
+	return misses;
+}
+
+/*
+ * Count the misses in the measurement just taken into the raw buffer.
+ */
+static unsigned int probes_raw_misses(struct probe *p)
+{
+	unsigned int i, misses = 0;
+
+	for (i = 0; i < p->set_cnt; i++)
+		misses += probes_raw_set_misses(p, i);
+	return misses;
+}
+
+/*
+ * Get the largest number of misses seen by a measurement taken right after
+ * REFILLS refill passes from a cold cache.
+ */
+static unsigned int probes_primed_misses(struct probe *p,
+					 unsigned int refills)
+{
+	unsigned int t, misses, worst = 0;
+
+	p->cfg.refills = refills;
+	for (t = 0; t < PROBE_CALIBRATE_TRIALS; t++) {
+		flush_cache_all();
+		probes_refill_generic(p);
+		probes_collect_generic(p);
+		misses = probes_raw_misses(p);
+		worst = max(worst, misses);
+	}
+	return worst;
+}
+
+void probes_calibrate(void *info)
+{
+	unsigned long interrupt_flags;
+	struct probe_calibration *c = (struct probe_calibration *)info;
+	struct probe *p = c->probe;
+	unsigned int refills, target;
+
+	local_irq_save(interrupt_flags);
+
+	// Whatever the deepest refill reaches is taken as the primed state
+	target = probes_primed_misses(p, PROBE_MAX_REFILLS);
+	for (refills = 1; refills < PROBE_MAX_REFILLS; refills++) {
+		if (probes_primed_misses(p, refills) <= target)
+			break;
+	}
+	p->cfg.refills = refills;
+	c->refills = refills;
+
+	local_irq_restore(interrupt_flags);
+}
+
+void probes_baseline_sample(void *info)
+{
+	unsigned long interrupt_flags;
+	struct probe_baseline *b = (struct probe_baseline *)info;
+	unsigned int i, k, cnt, width;
+	struct probe *p;
+
+	local_irq_save(interrupt_flags);
+
+	for (k = 0; k < ARRAY_SIZE(b->probes); k++) {
+		p = b->probes[k];
+		if (p == NULL)
+			continue;
+		probes_collect_generic(p);
+		if (!b->primed || b->bins[k] == NULL)
+			continue;
+		width = b->width[k];
+		for (i = 0; i < p->set_cnt; i++) {
+			cnt = min(probes_raw_set_misses(p, i), width - 1);
+			b->bins[k][i * width + cnt]++;
+		}
+	}
+
+	// Refill in the same order as probes_collect_one
+	for (k = ARRAY_SIZE(b->probes); k-- > 0;) {
+		if (b->probes[k])
+			probes_refill_generic(b->probes[k]);
+	}
+	b->primed = true;
+
+	local_irq_restore(interrupt_flags);
+}
@@ -25,6 +25,10 @@
 #ifndef PROBES_H__
 #define PROBES_H__
 
+#include <linux/types.h>
+
+#include "arm64_defs.h"
+
 /**
  * Initialize all structures needed for the probes.
  *
@@ -37,9 +41,110 @@ int probes_init(void);
  */
 void probes_term(void);
 
+struct probe;
+struct scope_sample;
+
+#define READ_EVCNTR_CASE(n) \
+	case (n) + 1: \
+		asm volatile ("mrs %0, pmevcntr" #n "_el0":"=r" (val)); \
+		break
+
+/*
+ * Read the counter with perf index IDX without going through pmselr_el0.
+ */
+static inline u64 probes_read_counter(int idx)
+{
+	u64 val = 0;
+
+	switch (idx) {
+	case ARMV8_IDX_CYCLE_COUNTER:
+		asm volatile ("mrs %0, pmccntr_el0":"=r" (val));
+		break;
+	READ_EVCNTR_CASE(0); READ_EVCNTR_CASE(1); READ_EVCNTR_CASE(2);
+	READ_EVCNTR_CASE(3); READ_EVCNTR_CASE(4); READ_EVCNTR_CASE(5);
+	READ_EVCNTR_CASE(6); READ_EVCNTR_CASE(7); READ_EVCNTR_CASE(8);
+	READ_EVCNTR_CASE(9); READ_EVCNTR_CASE(10); READ_EVCNTR_CASE(11);
+	READ_EVCNTR_CASE(12); READ_EVCNTR_CASE(13); READ_EVCNTR_CASE(14);
+	READ_EVCNTR_CASE(15); READ_EVCNTR_CASE(16); READ_EVCNTR_CASE(17);
+	READ_EVCNTR_CASE(18); READ_EVCNTR_CASE(19); READ_EVCNTR_CASE(20);
+	READ_EVCNTR_CASE(21); READ_EVCNTR_CASE(22); READ_EVCNTR_CASE(23);
+	READ_EVCNTR_CASE(24); READ_EVCNTR_CASE(25); READ_EVCNTR_CASE(26);
+	READ_EVCNTR_CASE(27); READ_EVCNTR_CASE(28); READ_EVCNTR_CASE(29);
+	READ_EVCNTR_CASE(30);
+	default:
+		break;
+	}
+	return val;
+}
+
+// Measurements taken for each candidate refill count
+#define PROBE_CALIBRATE_TRIALS 8
+
+/**
+ * Argument of probes_calibrate.
+ */
+struct probe_calibration {
+	struct probe *probe;
+	unsigned int refills;
+};
+
+/**
+ * Argument of probes_baseline_sample.
+ *
+ * PROBES holds the activated L1D, L1I, BTB and L2 probes, NULL for the
+ * others. If BINS[K] is set, it holds WIDTH[K] bins for each probed set of
+ * PROBES[K], counting the samples by number of misses.
+ */
+struct probe_baseline {
+	struct probe *probes[4];
+	u32 *bins[4];
+	unsigned int width[4];
+	bool primed;
+};
+
 /**
  * Function run on the target core.
  */
 void probes_collect(void *p);
 
+/**
+ * Find the fewest refill passes which prime the probe as well as
+ * PROBE_MAX_REFILLS do, and store it in the probe configuration.
+ *
+ * Run on the target core with the probe activated.
+ *
+ * @param info The struct probe_calibration, whose REFILLS is set to the
+ *             count found.
+ */
+void probes_calibrate(void *info);
+
+/**
+ * Take one sample of the idle target core into the baseline bins.
+ *
+ * Run on the target core with the probes activated. The first call only
+ * primes the probes and adds nothing to the bins.
+ *
+ * @param info The struct probe_baseline.
+ */
+void probes_baseline_sample(void *info);
+
+/**
+ * Number of bytes of raw counter values a probe stores per sample when
+ * processing is deferred. Fused probes store their per-set counts instead,
+ * and probes measured by groups their refined group bitmap and counts.
+ */
+size_t probes_raw_size(struct probe *p);
+
+/**
+ * Reduce a sample of raw counter values to per-set miss counts.
+ *
+ * This is the deferred half of probes_collect, and is run outside of the
+ * interrupts-disabled window. The reduced sample replaces the raw values at
+ * the start of the slot, after the sample header.
+ *
+ * @param s Sample whose DATA holds the raw values.
+ * @param tmp Scratch buffer large enough for the reduced sample.
+ */
+void probes_reduce(struct scope_sample *s, u8 * tmp);
+
 #endif
@@ -24,169 +24,561 @@
 
 #include "scope.h"
 
+#include <asm/arch_timer.h>
+#include <asm/uaccess.h>
+#include <linux/cache.h>
 #include <linux/delay.h>
-#include <linux/list.h>
+#include <linux/kthread.h>
+#include <linux/log2.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 
+#include "cache_geometry.h"
 #include "probes.h"
 
-static struct scope s;
-static struct list_head prepared_samples;
-static struct list_head collected_samples;
-static unsigned int collected_count;
+// Number of streamed samples between wake ups of the readers
+#define STREAM_WAKE_INTERVAL 64
 
-int scope_init()
+// Shortest period in ns the timer engine will sample at
+#define SCOPE_TIMER_MIN_PERIOD 1000
+
+// Percentile of the idle miss counts taken as the baseline by default
+#define SCOPE_BASELINE_PERCENTILE 99
+
+static struct scope scopes[CG_MAX_SCOPES];
+static DEFINE_MUTEX(scopes_lock);
+
+/**
+ * Get the slot of the IDX-th sample after the head of the ring.
+ */
+static inline u8 *scope_ring_slot(struct scope_ring *r, unsigned int idx)
 {
-	// Initialize all probes
-	probe_generic_init((struct probe *)&s.l1d_probe);
-	probe_generic_init((struct probe *)&s.l1i_probe);
-	probe_generic_init((struct probe *)&s.btb_probe);
+	return r->buf + ((r->head + idx) % r->capacity) * r->stride;
+}
+
+/**
+ * Get the first free slot of the ring.
+ *
+ * @return A pointer to the slot, or NULL if the ring is full.
+ */
+static u8 *scope_ring_tail(struct scope_ring *r)
+{
+	unsigned long flags;
+	u8 *ret = NULL;
 
-	s.created = false;
-	s.activated = false;
+	spin_lock_irqsave(&r->lock, flags);
+	if (r->buf != NULL && r->count + r->pending < r->capacity)
+		ret = scope_ring_slot(r, r->count + r->pending);
+	spin_unlock_irqrestore(&r->lock, flags);
+	return ret;
+}
 
-	INIT_LIST_HEAD(&prepared_samples);
-	INIT_LIST_HEAD(&collected_samples);
-	collected_count = 0;
+/**
+ * Get the first free slot of the ring for a batch of up to MAX samples.
+ *
+ * @param n Receives the number of free slots from the returned one to the
+ *          end of the buffer, at most MAX.
+ * @return A pointer to the slot, or NULL if the ring is full.
+ */
+static u8 *scope_ring_tail_batch(struct scope_ring *r, unsigned int max,
+				 unsigned int *n)
+{
+	unsigned long flags;
+	unsigned int idx, used;
+	u8 *ret = NULL;
+
+	*n = 0;
+	spin_lock_irqsave(&r->lock, flags);
+	used = r->count + r->pending;
+	if (r->buf != NULL && used < r->capacity) {
+		idx = (r->head + used) % r->capacity;
+		*n = min3(max, r->capacity - used, r->capacity - idx);
+		ret = r->buf + idx * r->stride;
+	}
+	spin_unlock_irqrestore(&r->lock, flags);
+	return ret;
+}
+
+/**
+ * Mark the N slots from the one returned by scope_ring_tail as collected.
+ *
+ * A PENDING slot still holds raw values and is only handed to readers by
+ * scope_reduce_pending.
+ */
+static void scope_ring_push(struct scope_ring *r, unsigned int n,
+			    bool pending)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&r->lock, flags);
+	if (pending)
+		r->pending += n;
+	else
+		r->count += n;
+	spin_unlock_irqrestore(&r->lock, flags);
+}
+
+/**
+ * Check whether collecting N more samples to make CNT passed a multiple of
+ * STREAM_WAKE_INTERVAL, so readers of a stream should be woken.
+ */
+static inline bool scope_stream_wake_due(unsigned int cnt, unsigned int n)
+{
+	return cnt / STREAM_WAKE_INTERVAL != (cnt - n) / STREAM_WAKE_INTERVAL;
+}
+
+/**
+ * Convert a delay in ns to ticks of the generic timer.
+ */
+static u64 scope_delay_ticks(unsigned int delay)
+{
+	return div_u64((u64) delay * arch_timer_get_cntfrq(), NSEC_PER_SEC);
+}
+
+/**
+ * Add a collected sample to the ring in pre-trigger mode.
+ *
+ * Samples from before the trigger are kept as a history of at most
+ * PRETRIGGER_LEN samples, dropping the oldest one as new ones arrive.
+ */
+static void scope_ring_push_history(struct scope *s, bool triggered)
+{
+	struct scope_ring *r = &s->ring;
+	unsigned long flags;
+
+	spin_lock_irqsave(&r->lock, flags);
+	r->count++;
+	if (!triggered) {
+		if (r->count > s->pretrigger_len) {
+			r->head = (r->head + 1) % r->capacity;
+			r->count--;
+		}
+		s->trigger_index = r->count;
+	}
+	spin_unlock_irqrestore(&r->lock, flags);
+}
+
+/**
+ * Reduce the pending raw samples of the ring and make them readable.
+ */
+static void scope_reduce_pending(struct scope *s)
+{
+	struct scope_ring *r = &s->ring;
+	struct scope_sample samp;
+	unsigned long flags;
+	unsigned int i, n, first;
+
+	// Releasing samples moves HEAD and COUNT together, so the index of
+	// the first pending slot stays valid while reducing.
+	spin_lock_irqsave(&r->lock, flags);
+	n = r->pending;
+	first = (r->head + r->count) % r->capacity;
+	spin_unlock_irqrestore(&r->lock, flags);
+	if (n == 0)
+		return;
 
+	samp.scope = s;
+	for (i = 0; i < n; i++) {
+		samp.data = r->buf + ((first + i) % r->capacity) * r->stride;
+		probes_reduce(&samp, s->reduce_buf);
+	}
+
+	spin_lock_irqsave(&r->lock, flags);
+	r->pending -= n;
+	r->count += n;
+	spin_unlock_irqrestore(&r->lock, flags);
+	wake_up_interruptible(&r->wq);
+}
+
+static enum hrtimer_restart scope_timer_func(struct hrtimer *timer)
+{
+	struct scope_timer *t = container_of(timer, struct scope_timer, timer);
+	struct scope *s = container_of(t, struct scope, timer);
+	struct scope_ring *r = &s->ring;
+	unsigned int i, n;
+	u64 overruns;
+
+	// Priming only needs a single sample
+	t->samp.data = scope_ring_tail_batch(r, t->primed ? t->batch : 1, &n);
+	t->samp.batch = n;
+	if (t->samp.data == NULL) {
+		// A full stream drops samples until readers catch up, so make
+		// sure they are awake to do so.
+		if (t->stream && t->primed) {
+			s->missed += t->batch;
+			wake_up_interruptible(&r->wq);
+			goto restart;
+		}
+		goto done;
+	}
+
+	probes_collect(&t->samp);
+	if (!t->samp.collected) {
+		goto done;
+	} else if (!t->primed) {
+		// The first collected sample only primes the caches, so the
+		// slot it was written to is reused for the first real sample.
+		t->primed = true;
+		s->sample_seq = 0;
+	} else if (s->pretrigger_len > 0) {
+		for (i = 0; i < n; i++)
+			scope_ring_push_history(s, t->samp.triggered);
+		if (t->samp.triggered)
+			t->count += n;
+		else if (t->timeout < n)
+			goto done;
+		else
+			t->timeout -= n;
+	} else {
+		scope_ring_push(r, n, s->deferred);
+		t->count += n;
+		if (t->stream && scope_stream_wake_due(t->count, n))
+			wake_up_interruptible(&r->wq);
+	}
+
+ restart:
+	// Periods which passed while sampling were never sampled
+	overruns = hrtimer_forward_now(timer, t->period);
+	if (t->primed && overruns > 1)
+		s->missed += (overruns - 1) * t->batch;
+	return HRTIMER_RESTART;
+ done:
+	complete(&t->done);
+	return HRTIMER_NORESTART;
+}
+
+static void scope_timer_arm(void *info)
+{
+	struct scope_timer *t = (struct scope_timer *)info;
+	hrtimer_start(&t->timer, t->period, HRTIMER_MODE_REL_PINNED);
+}
+
+/**
+ * Collect samples from an hrtimer on the target core.
+ *
+ * The timer fires once per batch of BATCH samples, so it runs BATCH times
+ * slower than the sample PERIOD.
+ *
+ * @return The number of samples collected.
+ */
+static unsigned int scope_timer_collect(struct scope *s, unsigned int period,
+					unsigned int timeout, bool stream,
+					unsigned int batch)
+{
+	struct scope_timer *t = &s->timer;
+
+	if (scope_ring_tail(&s->ring) == NULL)
+		return 0;
+
+	t->samp.scope = s;
+	t->samp.collected = false;
+	t->samp.stride = s->ring.stride;
+	t->samp.spin = scope_delay_ticks(period);
+	t->batch = batch;
+	t->period = ns_to_ktime(max_t(u64, (u64) period * batch,
+				      SCOPE_TIMER_MIN_PERIOD));
+	t->count = 0;
+	t->timeout = timeout;
+	t->primed = false;
+	t->stream = stream;
+	reinit_completion(&t->done);
+
+	// The timer is pinned to the core it is started from.
+	smp_call_function_single(s->target_cpu, scope_timer_arm, t, true);
+
+	if (s->deferred) {
+		// Reduce samples in batches while the timer collects them
+		while (!wait_for_completion_timeout(&t->done, 1)) {
+			scope_reduce_pending(s);
+			if (stream && kthread_should_stop())
+				break;
+			if (!stream && signal_pending(current))
+				break;
+		}
+	} else if (stream) {
+		while (!wait_for_completion_timeout(&t->done, HZ / 10)) {
+			if (kthread_should_stop())
+				break;
+		}
+	} else {
+		wait_for_completion_interruptible(&t->done);
+	}
+	hrtimer_cancel(&t->timer);
+	scope_reduce_pending(s);
+	return t->count;
+}
+
+static void scope_init_one(struct scope *s)
+{
+	// Initialize all probes
+	probe_generic_init((struct probe *)&s->l1d_probe);
+	probe_generic_init((struct probe *)&s->l1i_probe);
+	probe_generic_init((struct probe *)&s->btb_probe);
+	probe_l2_init(&s->l2_probe);
+
+	s->created = false;
+	s->activated = false;
+	s->pretrigger = false;
+	s->pretrigger_len = 0;
+	s->trigger_index = 0;
+	init_waitqueue_head(&s->activate_wq);
+	s->deferred = false;
+	s->packed = false;
+	s->sparse = false;
+	s->reduce_buf = NULL;
+	s->sparse_buf = NULL;
+
+	mutex_init(&s->lock);
+	mutex_init(&s->trigger_lock);
+	memset(&s->ring, 0, sizeof(struct scope_ring));
+	spin_lock_init(&s->ring.lock);
+	init_waitqueue_head(&s->ring.wq);
+	s->collector = NULL;
+	s->streaming = false;
+	s->stream_done = false;
+	memset(&s->hist, 0, sizeof(struct scope_histogram));
+
+	hrtimer_init(&s->timer.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED);
+	s->timer.timer.function = scope_timer_func;
+	init_completion(&s->timer.done);
+}
+
+int scope_init()
+{
+	unsigned int i;
+
+	for (i = 0; i < CG_MAX_SCOPES; i++)
+		scope_init_one(&scopes[i]);
 	return 0;
 }
 
 void scope_term()
 {
-	scope_destroy();
+	unsigned int i;
+
+	for (i = 0; i < CG_MAX_SCOPES; i++) {
+		mutex_lock(&scopes[i].lock);
+		scope_destroy(&scopes[i]);
+		mutex_unlock(&scopes[i].lock);
+	}
 	return;
 }
 
-void scope_get_config(struct scope_configuration *cfg)
+struct scope *scope_get(unsigned int id)
+{
+	if (id >= CG_MAX_SCOPES)
+		return NULL;
+	return &scopes[id];
+}
+
+void scope_get_config(struct scope *s, struct scope_configuration *cfg)
 {
 	cfg->created = false;
 
-	if (s.created) {
+	if (s->created) {
 		cfg->created = true;
-		cfg->target_cpu = s.target_cpu;
-		cfg->l1d_attached = (0 != is_probe_attached(&s.l1d_probe.base));
-		cfg->l1i_attached = (0 != is_probe_attached(&s.l1i_probe.base));
-		cfg->btb_attached = (0 != is_probe_attached(&s.btb_probe.base));
+		cfg->target_cpu = s->target_cpu;
+		cfg->l1d_attached = (0 != is_probe_attached(&s->l1d_probe.base));
+		cfg->l1i_attached = (0 != is_probe_attached(&s->l1i_probe.base));
+		cfg->btb_attached = (0 != is_probe_attached(&s->btb_probe.base));
+		cfg->l2_attached = (0 != is_probe_attached(&s->l2_probe.base));
 	} else {
 		cfg->created = false;
 		cfg->target_cpu = -1;
 		cfg->l1d_attached = false;
 		cfg->l1i_attached = false;
 		cfg->btb_attached = false;
+		cfg->l2_attached = false;
 	}
 }
 
-enum CGState scope_create(int target_cpu)
+enum CGState scope_create(struct scope *s, int target_cpu)
 {
-	if (s.created) {
+	enum CGState ret = CG_OK;
+	unsigned int i;
+
+	mutex_lock(&scopes_lock);
+	if (s->created) {
 		INFO("Scope already created.");
-		return CG_SCOPE_ALREADY_CONNECTED;
+		ret = CG_SCOPE_ALREADY_CONNECTED;
+		goto out;
 	}
 
-	s.target_cpu = target_cpu;
-	s.created = true;
+	// Scopes sharing a target core would evict each other's probes
+	for (i = 0; i < CG_MAX_SCOPES; i++) {
+		if (scopes[i].created && scopes[i].target_cpu == target_cpu) {
+			INFO("Core %d is already monitored by scope %u.",
+			     target_cpu, i);
+			ret = CG_SCOPE_ALREADY_CONNECTED;
+			goto out;
+		}
+	}
 
-	return CG_OK;
+	s->target_cpu = target_cpu;
+	s->created = true;
+ out:
+	mutex_unlock(&scopes_lock);
+	return ret;
 }
 
-void scope_destroy()
+void scope_destroy(struct scope *s)
 {
-	if (!s.created)
-		return;
+	// The target core stays claimed until the scope is torn down
+	mutex_lock(&scopes_lock);
+	if (!s->created)
+		goto out;
 
-	scope_flush();
+	scope_flush(s);
 
-	scope_deactivate();
+	scope_deactivate(s);
 
 	// Terminate any probes still attached to the scope
-	if (is_probe_attached((struct probe *)&s.l1d_probe))
-		probe_l1d_detach(&s.l1d_probe);
-
-	if (is_probe_attached((struct probe *)&s.l1i_probe))
-		probe_l1i_detach(&s.l1i_probe);
-
-	if (is_probe_attached((struct probe *)&s.btb_probe))
-		probe_btb_detach(&s.btb_probe);
+	mutex_lock(&s->trigger_lock);
+	if (is_probe_attached((struct probe *)&s->l1d_probe))
+		probe_l1d_detach(&s->l1d_probe);
+
+	if (is_probe_attached((struct probe *)&s->l1i_probe))
+		probe_l1i_detach(&s->l1i_probe);
+
+	if (is_probe_attached((struct probe *)&s->btb_probe))
+		probe_btb_detach(&s->btb_probe);
+
+	if (is_probe_attached((struct probe *)&s->l2_probe))
+		probe_l2_detach(&s->l2_probe);
+	// A trigger which came in since the deactivation finds no scope
+	s->activated = false;
+	s->pretrigger = false;
+	s->created = false;
+	mutex_unlock(&s->trigger_lock);
+
+	scope_histogram_reset(s);
+ out:
+	mutex_unlock(&scopes_lock);
+}
 
-	s.created = false;
+/**
+ * Check whether a streaming collector may still be running the probes.
+ */
+static bool scope_stream_running(struct scope *s)
+{
+	return s->streaming && !READ_ONCE(s->stream_done);
 }
 
-enum CGState scope_attach_probe(enum probe_type t, struct cache_shape *sh)
+enum CGState scope_attach_probe(struct scope *s, enum probe_type t,
+				 struct cache_shape *sh, unsigned int event)
 {
+	struct cache_geometry g;
 	int ret;
 
-	if (!s.created) {
+	if (!s->created) {
 		INFO("Scope not created.");
 		return CG_SCOPE_NOT_CONNECTED;
 	}
+	if (scope_stream_running(s)) {
+		INFO("Cannot change probes while streaming.");
+		return CG_BAD_ARG;
+	}
 
+	// Shapes are given by the user, so point out ones which can't be
+	// right for the target core.
+	if (sh != NULL && cache_geometry_read(s->target_cpu, &g) == CG_OK) {
+		if (t == PROBE_TYPE_L1D)
+			cache_geometry_check("L1D", &g.l1d, sh);
+		else if (t == PROBE_TYPE_L1I)
+			cache_geometry_check("L1I", &g.l1i, sh);
+		else if (t == PROBE_TYPE_L2)
+			cache_geometry_check("L2", &g.l2, sh);
+	}
+
+	mutex_lock(&s->trigger_lock);
 	switch (t) {
 	case PROBE_TYPE_L1D:
-		ret = probe_l1d_attach(&s.l1d_probe, s.target_cpu, sh);
+		ret = probe_l1d_attach(&s->l1d_probe, s->target_cpu, sh,
+				       event);
 		break;
 	case PROBE_TYPE_L1I:
-		ret = probe_l1i_attach(&s.l1i_probe, s.target_cpu, sh);
+		ret = probe_l1i_attach(&s->l1i_probe, s->target_cpu, sh,
+				       event);
 		break;
 	case PROBE_TYPE_BTB:
-		ret = probe_btb_attach(&s.btb_probe, s.target_cpu, sh);
+		ret = probe_btb_attach(&s->btb_probe, s->target_cpu, sh,
+				       event);
+		break;
+	case PROBE_TYPE_L2:
+		ret = probe_l2_attach(&s->l2_probe, s->target_cpu, sh, event);
 		break;
 	default:
 		DEBUG("Probe type not recognized.");
 		ret = CG_BAD_ARG;
 	}
+	mutex_unlock(&s->trigger_lock);
 
 	if (ret == CG_OK) {
 		INFO("Successfully attached probe to target core.");
-		scope_configure_probe(t, NULL);
+		scope_configure_probe(s, t, NULL);
 	} else {
 		INFO("Unsuccessfully attached probe to target core.");
 	}
 	return ret;
 }
 
-void scope_detach_probe(enum probe_type type)
+enum CGState scope_detach_probe(struct scope *s, enum probe_type type)
 {
-	if (!s.created) {
+	if (!s->created) {
 		INFO("Scope not created.");
-		return;
+		return CG_SCOPE_NOT_CONNECTED;
+	}
+	if (scope_stream_running(s)) {
+		INFO("Cannot change probes while streaming.");
+		return CG_BAD_ARG;
 	}
 
+	mutex_lock(&s->trigger_lock);
 	switch (type) {
 	case PROBE_TYPE_L1D:
-		probe_l1d_detach(&s.l1d_probe);
+		probe_l1d_detach(&s->l1d_probe);
 		break;
 	case PROBE_TYPE_L1I:
-		probe_l1i_detach(&s.l1i_probe);
+		probe_l1i_detach(&s->l1i_probe);
 		break;
 	case PROBE_TYPE_BTB:
-		probe_btb_detach(&s.btb_probe);
+		probe_btb_detach(&s->btb_probe);
+		break;
+	case PROBE_TYPE_L2:
+		probe_l2_detach(&s->l2_probe);
 		break;
 	default:
 		DEBUG("Probe type not recognized.");
 		break;
 	}
+	mutex_unlock(&s->trigger_lock);
 	INFO("Detached");
+	return CG_OK;
 }
 
-struct probe *scope_get_probe(enum probe_type type)
+struct probe *scope_get_probe(struct scope *s, enum probe_type type)
 {
 	struct probe *ret = NULL;
 
-	if (!s.created) {
+	if (!s->created) {
 		INFO("Scope not created.");
 		return NULL;
 	}
 
 	switch (type) {
 	case PROBE_TYPE_L1D:
-		ret = (struct probe *)&s.l1d_probe;
+		ret = (struct probe *)&s->l1d_probe;
 		break;
 	case PROBE_TYPE_L1I:
-		ret = (struct probe *)&s.l1i_probe;
+		ret = (struct probe *)&s->l1i_probe;
 		break;
 	case PROBE_TYPE_BTB:
-		ret = (struct probe *)&s.btb_probe;
+		ret = (struct probe *)&s->btb_probe;
+		break;
+	case PROBE_TYPE_L2:
+		ret = (struct probe *)&s->l2_probe;
 		break;
 	default:
 		DEBUG("Probe type not recognized.");
@@ -196,24 +588,32 @@ struct probe *scope_get_probe(enum probe_type type)
 	return is_probe_attached(ret) ? ret : NULL;
 }
 
-int scope_configure_probe(enum probe_type type, struct probe_config *cfg)
+int scope_configure_probe(struct scope *s, enum probe_type type,
+			  struct probe_config *cfg)
 {
 	int ret;
 
-	if (!s.created) {
+	if (!s->created) {
 		INFO("Scope not created.");
 		return -1;
 	}
+	if (scope_stream_running(s)) {
+		INFO("Cannot change probes while streaming.");
+		return -1;
+	}
 
 	switch (type) {
 	case PROBE_TYPE_L1D:
-		ret = probe_l1d_configure(&s.l1d_probe, cfg);
+		ret = probe_l1d_configure(&s->l1d_probe, cfg);
 		break;
 	case PROBE_TYPE_L1I:
-		ret = probe_l1i_configure(&s.l1i_probe, cfg);
+		ret = probe_l1i_configure(&s->l1i_probe, cfg);
 		break;
 	case PROBE_TYPE_BTB:
-		ret = probe_btb_configure(&s.btb_probe, cfg);
+		ret = probe_btb_configure(&s->btb_probe, cfg);
+		break;
+	case PROBE_TYPE_L2:
+		ret = probe_l2_configure(&s->l2_probe, cfg);
 		break;
 	default:
 		DEBUG("Probe type not recognized.");
@@ -228,148 +628,786 @@ int scope_configure_probe(enum probe_type type, struct probe_config *cfg)
 	return ret;
 }
 
-int scope_activate()
+static void scope_deactivate_probes(struct scope *s)
 {
-	if (!s.created) {
-		INFO("Scope not created.");
+	if (is_probe_attached((struct probe *)&s->l1d_probe)) {
+		probe_generic_deactivate((struct probe *)&s->l1d_probe);
+	}
+	if (is_probe_attached((struct probe *)&s->l1i_probe)) {
+		probe_generic_deactivate((struct probe *)&s->l1i_probe);
+	}
+	if (is_probe_attached((struct probe *)&s->btb_probe)) {
+		probe_generic_deactivate((struct probe *)&s->btb_probe);
+	}
+	if (is_probe_attached((struct probe *)&s->l2_probe)) {
+		probe_generic_deactivate((struct probe *)&s->l2_probe);
+	}
+}
+
+static int scope_activate_probe(struct probe *p)
+{
+	if (!is_probe_attached(p))
+		return 0;
+	return probe_generic_activate(p);
+}
+
+/**
+ * Activate the attached probes. The probe code was generated for the
+ * counters found at attach, so nothing is rebuilt here.
+ *
+ * @return 0 if all the probes were activated, -1 otherwise.
+ */
+static int scope_activate_probes(struct scope *s)
+{
+	if (scope_activate_probe(&s->l1d_probe.base) < 0 ||
+	    scope_activate_probe(&s->l1i_probe.base) < 0 ||
+	    scope_activate_probe(&s->btb_probe.base) < 0 ||
+	    scope_activate_probe(&s->l2_probe.base) < 0) {
+		scope_deactivate_probes(s);
 		return -1;
 	}
-	DEBUG("Activating scope");
+	return 0;
+}
+
+enum CGState scope_calibrate_probe(struct scope *s, enum probe_type type,
+				   unsigned int *refills)
+{
+	struct probe_calibration c;
+	struct probe *p;
+
+	p = scope_get_probe(s, type);
+	if (p == NULL)
+		return CG_PROBE_NOT_CONNECTED;
+
+	mutex_lock(&s->trigger_lock);
+	if (s->activated || s->pretrigger || scope_stream_running(s)) {
+		INFO("Cannot calibrate while collecting.");
+		mutex_unlock(&s->trigger_lock);
+		return CG_BAD_ARG;
+	}
+	if (scope_activate_probe(p) < 0) {
+		mutex_unlock(&s->trigger_lock);
+		return CG_INTERNAL_ERR;
+	}
+	c.probe = p;
+	c.refills = 0;
+	smp_call_function_single(s->target_cpu, probes_calibrate, &c, true);
+	probe_generic_deactivate(p);
+	mutex_unlock(&s->trigger_lock);
+
+	DEBUG("Calibrated probe to %u refills", c.refills);
+	*refills = c.refills;
+	return CG_OK;
+}
+
+/**
+ * Set the baseline of probe P from the bins filled by probes_baseline_sample.
+ *
+ * The baseline of a set is the smallest miss count which at least NEED of
+ * the samples stayed at or below.
+ */
+static enum CGState scope_set_baseline(struct probe *p, const u32 * bins,
+				       unsigned int width, unsigned int need)
+{
+	unsigned int i, v, cum;
+	u8 *baseline;
+
+	baseline = kmalloc(p->set_cnt, GFP_KERNEL);
+	if (baseline == NULL)
+		return CG_NO_MEM;
+
+	for (i = 0; i < p->set_cnt; i++, bins += width) {
+		cum = bins[0];
+		for (v = 0; cum < need && v + 1 < width;)
+			cum += bins[++v];
+		baseline[i] = (u8) min(v, 0xFFu);
+	}
+	p->baseline = baseline;
+	return CG_OK;
+}
 
-	if (is_probe_attached((struct probe *)&s.l1d_probe)) {
-		probe_generic_activate((struct probe *)&s.l1d_probe);
+enum CGState scope_calibrate_baseline(struct scope *s, unsigned int samples,
+				      unsigned int delay,
+				      unsigned int percentile)
+{
+	struct probe_baseline b;
+	struct probe *p;
+	enum CGState ret = CG_OK;
+	unsigned int i, k, need;
+
+	if (!s->created) {
+		INFO("Scope not created.");
+		return CG_SCOPE_NOT_CONNECTED;
+	}
+	if (percentile == 0)
+		percentile = SCOPE_BASELINE_PERCENTILE;
+	if (percentile > 100)
+		return CG_BAD_ARG;
+
+	memset(&b, 0, sizeof(b));
+	mutex_lock(&s->trigger_lock);
+	if (s->activated || s->pretrigger || scope_stream_running(s)) {
+		INFO("Cannot calibrate while collecting.");
+		ret = CG_BAD_ARG;
+		goto done;
+	}
+	b.probes[0] = &s->l1d_probe.base;
+	b.probes[1] = &s->l1i_probe.base;
+	b.probes[2] = &s->btb_probe.base;
+	b.probes[3] = &s->l2_probe.base;
+	for (k = 0; k < ARRAY_SIZE(b.probes); k++) {
+		p = b.probes[k];
+		if (!is_probe_attached(p)) {
+			b.probes[k] = NULL;
+			continue;
+		}
+		// The old baseline would be subtracted from the new one
+		kfree(p->baseline);
+		p->baseline = NULL;
+		// Only miss counts have a baseline, but the other probes
+		// still run so the noise matches a real capture.
+		if (samples == 0 || p->cfg.output != PROBE_OUTPUT_COUNT)
+			continue;
+		b.width[k] = p->cache_shape.associativity + 1;
+		b.bins[k] = vzalloc(p->set_cnt * b.width[k] * sizeof(u32));
+		if (b.bins[k] == NULL) {
+			ret = CG_NO_MEM;
+			goto done;
+		}
+	}
+	if (samples == 0)
+		goto done;
+
+	// The first sample only primes the probes
+	if (scope_activate_probes(s) < 0) {
+		ret = CG_INTERNAL_ERR;
+		goto done;
+	}
+	for (i = 0; i <= samples; i++) {
+		smp_call_function_single(s->target_cpu, probes_baseline_sample,
+					 &b, true);
+		ndelay(delay);
 	}
+	scope_deactivate_probes(s);
+
+	need = (unsigned int)div_u64((u64) samples * percentile + 99, 100);
+	for (k = 0; k < ARRAY_SIZE(b.probes); k++) {
+		if (b.bins[k] == NULL)
+			continue;
+		ret = scope_set_baseline(b.probes[k], b.bins[k], b.width[k],
+					 need);
+		if (ret != CG_OK)
+			break;
+	}
+	DEBUG("Calibrated baseline over %u samples", samples);
+ done:
+	mutex_unlock(&s->trigger_lock);
+	for (k = 0; k < ARRAY_SIZE(b.probes); k++)
+		vfree(b.bins[k]);
+	return ret;
+}
+
+/**
+ * Enable the probes ahead of activation so pre-trigger samples can be
+ * collected.
+ */
+static bool scope_arm(struct scope *s)
+{
+	bool ret = true;
+
+	DEBUG("Arming scope");
+	mutex_lock(&s->trigger_lock);
+	if (!s->activated && scope_activate_probes(s) < 0)
+		ret = false;
+	else
+		s->pretrigger = true;
+	mutex_unlock(&s->trigger_lock);
+	return ret;
+}
+
+static void scope_disarm(struct scope *s)
+{
+	mutex_lock(&s->trigger_lock);
+	s->pretrigger = false;
+	if (!s->activated)
+		scope_deactivate_probes(s);
+	mutex_unlock(&s->trigger_lock);
+}
 
-	if (is_probe_attached((struct probe *)&s.l1i_probe)) {
-		probe_generic_activate((struct probe *)&s.l1i_probe);
+int scope_activate(struct scope *s)
+{
+	mutex_lock(&s->trigger_lock);
+	if (!s->created) {
+		INFO("Scope not created.");
+		mutex_unlock(&s->trigger_lock);
+		return -1;
 	}
+	DEBUG("Activating scope");
 
-	if (is_probe_attached((struct probe *)&s.btb_probe)) {
-		probe_generic_activate((struct probe *)&s.btb_probe);
+	if (!s->pretrigger && scope_activate_probes(s) < 0) {
+		mutex_unlock(&s->trigger_lock);
+		return -1;
 	}
 
-	s.activated = true;
+	s->activated = true;
+	mutex_unlock(&s->trigger_lock);
+
+	// Start any collector waiting for the trigger
+	wake_up_interruptible(&s->activate_wq);
 
 	return 0;
 }
 
-void scope_deactivate()
+void scope_deactivate(struct scope *s)
 {
-	if (!s.created) {
+	mutex_lock(&s->trigger_lock);
+	if (!s->created) {
 		INFO("Scope not created.");
+		mutex_unlock(&s->trigger_lock);
 		return;
 	}
 
 	DEBUG("Deactivating scope.");
 
-	s.activated = false;
+	s->activated = false;
+	s->pretrigger = false;
+	scope_deactivate_probes(s);
+	mutex_unlock(&s->trigger_lock);
+}
+
+/**
+ * Get the number of bytes of raw counter values in a deferred sample.
+ */
+static size_t scope_raw_size(struct scope *s)
+{
+	size_t sz = 0;
+
+	if (is_probe_attached(&s->l1d_probe.base))
+		sz += probes_raw_size(&s->l1d_probe.base);
+	if (is_probe_attached(&s->l1i_probe.base))
+		sz += probes_raw_size(&s->l1i_probe.base);
+	if (is_probe_attached(&s->btb_probe.base))
+		sz += probes_raw_size(&s->btb_probe.base);
+	if (is_probe_attached(&s->l2_probe.base))
+		sz += probes_raw_size(&s->l2_probe.base);
+	return sz;
+}
 
-	if (is_probe_attached((struct probe *)&s.l1d_probe)) {
-		probe_generic_deactivate((struct probe *)&s.l1d_probe);
+enum CGState scope_configure(struct scope *s, bool deferred, bool packed,
+			     bool sparse)
+{
+	if (!s->created) {
+		INFO("Scope not created.");
+		return CG_SCOPE_NOT_CONNECTED;
 	}
-	if (is_probe_attached((struct probe *)&s.l1i_probe)) {
-		probe_generic_deactivate((struct probe *)&s.l1i_probe);
+	if (packed && sparse) {
+		// Sparse entries address whole bytes of the sample
+		INFO("Sparse records cannot hold packed samples.");
+		return CG_BAD_ARG;
 	}
-	if (is_probe_attached((struct probe *)&s.btb_probe)) {
-		probe_generic_deactivate((struct probe *)&s.btb_probe);
+
+	// Keep the prepared ring, and the mapping of it, if nothing changes.
+	if (s->deferred == deferred && s->packed == packed &&
+	    s->sparse == sparse)
+		return CG_OK;
+
+	// The layout of the ring depends on the mode, so start over.
+	scope_flush(s);
+	s->deferred = deferred;
+	s->packed = packed;
+	s->sparse = sparse;
+	return CG_OK;
+}
+
+/**
+ * Get the stride of a ring slot for the current sample layout.
+ */
+static size_t scope_ring_stride(struct scope *s,
+				struct scope_sample_description *d)
+{
+	size_t stride;
+
+	stride = max_t(size_t, d->total_size, 1);
+	if (s->deferred) {
+		// Slots first hold the raw counter values of every probe
+		stride = max_t(size_t, stride, sizeof(struct scope_sample_header) +
+			       scope_raw_size(s));
+		stride = ALIGN(stride, sizeof(u64));
 	}
+	// Keep every sample within as few cache lines as possible. Small
+	// samples are packed into lines at a power of two stride, larger
+	// ones start on a line of their own.
+	if (stride < L1_CACHE_BYTES)
+		stride = roundup_pow_of_two(stride);
+	else
+		stride = ALIGN(stride, L1_CACHE_BYTES);
+	return stride;
 }
 
-unsigned int scope_prepare(unsigned int max_samples)
+/**
+ * Stop anything still writing to the ring.
+ */
+static void scope_stop_collection(struct scope *s)
+{
+	scope_stream_stop(s);
+	hrtimer_cancel(&s->timer.timer);
+}
+
+unsigned int scope_prepare(struct scope *s, unsigned int max_samples)
 {
-	unsigned int cnt = 0;
-	struct scope_sample *samp;
+	unsigned int cnt = max_samples;
+	struct scope_ring *r = &s->ring;
 	struct scope_sample_description d;
-	size_t sz;
+	unsigned long flags;
+	size_t stride, sz;
+	u8 *buf = NULL;
+
+	// Get the description of the scope sample so we know how many
+	// bytes each slot of the ring needs.
+	scope_sample_desc(s, &d);
+	stride = scope_ring_stride(s, &d);
+
+	// If the layout is unchanged since the last capture, just empty the
+	// existing ring instead of reallocating it. Userland mappings of the
+	// ring stay valid as well.
+	if (r->buf != NULL && r->capacity == cnt && r->stride == stride &&
+	    r->sample_size == d.total_size &&
+	    (s->reduce_buf != NULL) == s->deferred &&
+	    (s->sparse_buf != NULL) == s->sparse) {
+		scope_stop_collection(s);
+
+		spin_lock_irqsave(&r->lock, flags);
+		r->head = 0;
+		r->count = 0;
+		r->pending = 0;
+		spin_unlock_irqrestore(&r->lock, flags);
+
+		DEBUG("Reusing %u prepared samples.", cnt);
+		return cnt;
+	}
 
 	// Remove any existing samples so we have a clean slate to work with.
-	scope_flush();
+	scope_flush(s);
 
-	// Get the description of the scope sample so we know how many
-	// bytes to allocate.
-	scope_sample_desc(&d);
-	sz = sizeof(struct scope_sample) - 1 + d.total_size;
+	if (cnt == 0)
+		return 0;
 
-	while (cnt < max_samples) {
-		samp = (struct scope_sample *)kmalloc(sz, GFP_KERNEL);
-		if (samp == NULL)
-			break;
-		// Memset so entire structure is paged in
-		memset(samp, 0, sz);
-		samp->scope = &s;
-		samp->collected = false;
-		list_add_tail(&samp->list, &prepared_samples);
-		cnt++;
+	if (s->deferred) {
+		s->reduce_buf = kmalloc(max_t(size_t, d.total_size, 1),
+				       GFP_KERNEL);
+		if (s->reduce_buf == NULL)
+			return 0;
 	}
+	if (s->sparse) {
+		s->sparse_buf = vmalloc(d.record_size);
+		if (s->sparse_buf == NULL) {
+			scope_flush(s);
+			return 0;
+		}
+	}
+
+	// Allocate the whole ring at once, so the number of samples is
+	// exactly what was asked for. vmalloc_user zeroes the buffer, so the
+	// entire ring is paged in.
+	sz = PAGE_ALIGN((size_t)cnt * stride);
+	buf = (u8 *) vmalloc_user(sz);
+	if (buf == NULL) {
+		WARNING("Unable to allocate %u samples.", cnt);
+		scope_flush(s);
+		return 0;
+	}
+
+	r->buf = buf;
+	r->size = sz;
+	r->stride = stride;
+	r->sample_size = d.total_size;
+	r->capacity = cnt;
+	r->head = 0;
+	r->count = 0;
+	r->pending = 0;
+	r->generation++;
 
 	DEBUG("Successfully prepared %u samples.", cnt);
 	return cnt;
 }
 
-unsigned int scope_collect(unsigned int delay, unsigned int timeout)
+/**
+ * Sleep until the scope is activated.
+ *
+ * TIMEOUT is the number of samples the scope would have polled the target
+ * core for, so it is converted to a time using DELAY.
+ *
+ * @return True if the scope was activated before the timeout.
+ */
+static bool scope_wait_activation(struct scope *s, unsigned int delay,
+				  unsigned int timeout, bool stream)
+{
+	u64 us;
+	unsigned long jiffies_left;
+
+	us = (u64) timeout * max_t(unsigned int, delay,
+				   SCOPE_TIMER_MIN_PERIOD) / NSEC_PER_USEC;
+	jiffies_left = usecs_to_jiffies((unsigned int)min_t(u64, us, UINT_MAX));
+
+	wait_event_interruptible_timeout(s->activate_wq, s->activated ||
+					 (stream && kthread_should_stop()),
+					 max_t(unsigned long, jiffies_left, 1));
+	if (stream && kthread_should_stop())
+		return false;
+	if (!s->activated) {
+		DEBUG("Timeout.");
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Reduce the batch of raw samples just collected into SAMP.
+ */
+static void scope_reduce_batch(struct scope *s, struct scope_sample *samp)
 {
-	struct list_head *cur, *next;
-	struct scope_sample *samp;
-	unsigned int cnt = 0;
-	int cpu = s.target_cpu;
+	u8 *first = samp->data;
+	unsigned int i;
 
-	DEBUG("Starting to collect.");
-	if (list_empty(&prepared_samples))
-		return 0;
+	for (i = 0; i < samp->batch; i++) {
+		samp->data = first + i * samp->stride;
+		probes_reduce(samp, s->reduce_buf);
+	}
+	samp->data = first;
+}
 
-	samp = list_first_entry(&prepared_samples, struct scope_sample, list);
-	while (!samp->collected) {
-		if (timeout-- == 0) {
-			DEBUG("Timeout.");
+/**
+ * Wait for the scope to be activated, then fill the ring with samples.
+ *
+ * If STREAM is set, this runs on the collector thread and a full ring waits
+ * for readers to release slots instead of ending the collection.
+ *
+ * @return The number of samples collected.
+ */
+static unsigned int scope_collect_samples(struct scope *s, unsigned int delay,
+					  unsigned int timeout, bool stream,
+					  bool timer, unsigned int batch)
+{
+	struct scope_ring *r = &s->ring;
+	struct scope_sample samp;
+	unsigned int i, cnt = 0;
+	int cpu = s->target_cpu;
+	u64 stall;
+
+	if (s->pretrigger_len > 0) {
+		if (!scope_arm(s))
 			return 0;
+	} else if (!scope_wait_activation(s, delay, timeout, stream))
+		return 0;
+
+	batch = max_t(unsigned int, batch, 1);
+	s->sample_seq = 0;
+	s->missed = 0;
+	if (timer)
+		return scope_timer_collect(s, delay, timeout, stream, batch);
+
+	samp.scope = s;
+	samp.collected = false;
+	samp.batch = 1;
+	samp.stride = r->stride;
+	samp.spin = scope_delay_ticks(delay);
+	samp.data = scope_ring_tail(r);
+	if (samp.data == NULL)
+		return 0;
+
+	// The first collected sample only primes the caches, so the slot it
+	// was written to is reused for the first real sample.
+	smp_call_function_single(cpu, probes_collect, &samp, true);
+	if (!samp.collected)
+		return 0;
+	s->sample_seq = 0;
+	ndelay(delay);
+
+	while (true) {
+		samp.data = scope_ring_tail_batch(r, batch, &samp.batch);
+		if (samp.data == NULL) {
+			if (!stream)
+				break;
+			stall = arch_counter_get_cntvct();
+			wake_up_interruptible(&r->wq);
+			wait_event_interruptible(r->wq,
+						 scope_ring_tail(r) != NULL ||
+						 kthread_should_stop());
+			if (kthread_should_stop())
+				break;
+			// Count the samples the wait kept us from taking
+			if (samp.spin > 0)
+				s->missed += div64_u64(arch_counter_get_cntvct() -
+						       stall, samp.spin);
+			continue;
 		}
-		smp_call_function_single(cpu, probes_collect, samp, true);
-		ndelay(delay);
-	}
 
-	list_for_each_safe(cur, next, &prepared_samples) {
-		samp = list_entry(cur, struct scope_sample, list);
-		smp_call_function_single(cpu, probes_collect, samp, true);
-		if (samp->collected) {
-			list_del(cur);
-			list_add_tail(cur, &collected_samples);
-			cnt++;
-			ndelay(delay);
-		} else {
+		smp_call_function_single(cpu, probes_collect, &samp, true);
+		if (!samp.collected)
 			break;
+
+		if (s->deferred)
+			scope_reduce_batch(s, &samp);
+		if (s->pretrigger_len > 0) {
+			// Sample until the trigger or the timeout
+			for (i = 0; i < samp.batch; i++)
+				scope_ring_push_history(s, samp.triggered);
+			if (!samp.triggered) {
+				if (timeout < samp.batch)
+					break;
+				timeout -= samp.batch;
+				ndelay(delay);
+				continue;
+			}
+		} else {
+			scope_ring_push(r, samp.batch, false);
+		}
+		cnt += samp.batch;
+		if (stream && scope_stream_wake_due(cnt, samp.batch)) {
+			wake_up_interruptible(&r->wq);
+			cond_resched();
 		}
+		ndelay(delay);
 	}
-	collected_count += cnt;
+	return cnt;
+}
+
+unsigned int scope_collect(struct scope *s, unsigned int delay,
+			   unsigned int timeout, bool timer, unsigned int pretrigger,
+			   unsigned int batch)
+{
+	unsigned int cnt;
+
+	DEBUG("Starting to collect.");
+	if (s->streaming) {
+		INFO("Scope is already streaming.");
+		return 0;
+	}
+	if (pretrigger > 0 && timer && s->deferred) {
+		// Pending samples cannot be dropped from the history
+		INFO("Pre-trigger is not supported with deferred timer sampling.");
+		return 0;
+	}
+
+	// Leave room for at least one sample after the trigger
+	s->pretrigger_len = min_t(unsigned int, pretrigger,
+				 s->ring.capacity ? s->ring.capacity - 1 : 0);
+	s->trigger_index = 0;
+
+	cnt = scope_collect_samples(s, delay, timeout, false, timer, batch);
+	if (s->pretrigger_len > 0) {
+		scope_disarm(s);
+		cnt += s->trigger_index;
+	}
+	s->pretrigger_len = 0;
+
 	DEBUG("Finished collecting.");
 	return cnt;
 }
 
-void scope_flush()
+static int scope_stream_func(void *data)
+{
+	struct scope *s = (struct scope *)data;
+	unsigned int cnt;
+
+	cnt = scope_collect_samples(s, s->stream_delay, s->stream_timeout, true,
+				    s->stream_timer, s->stream_batch);
+	DEBUG("Finished streaming %u samples.", cnt);
+
+	s->stream_done = true;
+	wake_up_interruptible(&s->ring.wq);
+
+	// Wait for scope_stream_stop to reap this thread.
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+enum CGState scope_stream(struct scope *s, unsigned int delay,
+			  unsigned int timeout, bool timer, unsigned int batch)
+{
+	struct task_struct *t;
+
+	if (!s->created) {
+		INFO("Scope not created.");
+		return CG_SCOPE_NOT_CONNECTED;
+	}
+	if (s->streaming) {
+		INFO("Scope is already streaming.");
+		return CG_BAD_ARG;
+	}
+	if (s->ring.buf == NULL) {
+		INFO("Scope has not been prepared.");
+		return CG_NO_MEM;
+	}
+
+	s->stream_delay = delay;
+	s->stream_timeout = timeout;
+	s->stream_timer = timer;
+	s->stream_batch = batch;
+	s->stream_done = false;
+	s->streaming = true;
+
+	t = kthread_create(scope_stream_func, s, DEVICE_NAME "_stream");
+	if (IS_ERR(t)) {
+		WARNING("Unable to create collector thread.");
+		s->streaming = false;
+		return CG_INTERNAL_ERR;
+	}
+	// Collect from the core of the caller, which is the scope core.
+	kthread_bind(t, raw_smp_processor_id());
+	s->collector = t;
+	wake_up_process(t);
+
+	DEBUG("Started streaming.");
+	return CG_OK;
+}
+
+void scope_stream_stop(struct scope *s)
 {
-	struct list_head *cur, *next;
-	struct scope_sample *samp;
+	if (s->collector == NULL)
+		return;
+
+	kthread_stop(s->collector);
+	s->collector = NULL;
+	s->streaming = false;
+	s->stream_done = true;
+	wake_up_interruptible(&s->ring.wq);
+	DEBUG("Stopped streaming.");
+}
+
+void scope_flush(struct scope *s)
+{
+	struct scope_ring *r = &s->ring;
 	DEBUG("Flushing scope samples.");
 
-	list_for_each_safe(cur, next, &prepared_samples) {
-		samp = list_entry(cur, struct scope_sample, list);
-		list_del(cur);
-		kfree(samp);
+	scope_stop_collection(s);
+
+	if (r->buf)
+		vfree(r->buf);
+	r->buf = NULL;
+	r->size = 0;
+	r->stride = 0;
+	r->sample_size = 0;
+	r->capacity = 0;
+	r->head = 0;
+	r->count = 0;
+	r->pending = 0;
+
+	if (s->reduce_buf)
+		kfree(s->reduce_buf);
+	s->reduce_buf = NULL;
+
+	if (s->sparse_buf)
+		vfree(s->sparse_buf);
+	s->sparse_buf = NULL;
+}
+
+/**
+ * Encode the sample SAMP of SIZE bytes as a sparse record into OUT.
+ *
+ * @return The size of the record, or 0 if the sample is idle.
+ */
+static size_t scope_sparse_encode(const u8 * samp, size_t size, u8 * out)
+{
+	const struct scope_sample_header *hdr =
+	    (const struct scope_sample_header *)samp;
+	struct scope_sparse_record rec = { 0, 0 };
+	size_t i = sizeof(struct scope_sample_header);
+	u32 *entries;
+
+	entries = (u32 *) (out + sizeof(rec) + sizeof(*hdr));
+	while (i < size) {
+		// Skip runs of zero sets a word at a time
+		if (IS_ALIGNED(i, sizeof(u64)) && i + sizeof(u64) <= size &&
+		    *(const u64 *)&samp[i] == 0) {
+			i += sizeof(u64);
+			continue;
+		}
+		if (samp[i])
+			entries[rec.count++] = SCOPE_SPARSE_ENTRY(i, samp[i]);
+		i++;
 	}
+	if (rec.count == 0 && hdr->missed == 0)
+		return 0;
+
+	memcpy(out, &rec, sizeof(rec));
+	memcpy(out + sizeof(rec), hdr, sizeof(*hdr));
+	return sizeof(rec) + sizeof(*hdr) + rec.count * sizeof(u32);
+}
 
-	list_for_each_safe(cur, next, &collected_samples) {
-		samp = list_entry(cur, struct scope_sample, list);
-		list_del(cur);
-		kfree(samp);
+/**
+ * Copy out the idle run IDLE, spanning SPAN, to BUF.
+ *
+ * @return The number of bytes written, or 0 on failure.
+ */
+static size_t scope_sparse_close_idle(u8 __user * buf,
+				      const struct scope_sparse_record *idle,
+				      const struct scope_sparse_span *span)
+{
+	if (copy_to_user(buf, idle, sizeof(*idle)) ||
+	    copy_to_user(buf + sizeof(*idle), span, sizeof(*span)))
+		return 0;
+	return sizeof(*idle) + sizeof(*span);
+}
+
+/**
+ * Copy out the ready samples as sparse records, see scope_retrieve.
+ */
+static void scope_retrieve_sparse(struct scope *s, u8 __user * buf,
+				  size_t * len)
+{
+	struct scope_ring *r = &s->ring;
+	struct scope_sparse_record idle = { 0, 0 };
+	struct scope_sparse_span span = { 0, 0 };
+	const struct scope_sample_header *hdr;
+	size_t rec_size, idle_size, remaining = *len;
+
+	idle_size = sizeof(idle) + sizeof(span);
+	while (r->count > 0) {
+		hdr = (const struct scope_sample_header *)scope_ring_slot(r, 0);
+		rec_size = scope_sparse_encode((const u8 *)hdr,
+					       r->sample_size, s->sparse_buf);
+		if (rec_size == 0) {
+			// Keep room to close the idle run
+			if (remaining < idle_size)
+				break;
+			if (idle.idle++ == 0)
+				span.first = hdr->timestamp;
+			span.last = hdr->timestamp;
+			scope_release(s, 1);
+			continue;
+		}
+
+		if (remaining < rec_size + (idle.idle ? idle_size : 0))
+			break;
+		if (idle.idle) {
+			if (scope_sparse_close_idle(buf, &idle, &span) == 0)
+				break;
+			buf += idle_size;
+			remaining -= idle_size;
+			idle.idle = 0;
+		}
+		if (copy_to_user(buf, s->sparse_buf, rec_size))
+			break;
+		buf += rec_size;
+		remaining -= rec_size;
+		scope_release(s, 1);
 	}
-	collected_count = 0;
+	if (idle.idle)
+		remaining -= scope_sparse_close_idle(buf, &idle, &span);
+	*len -= remaining;
 }
 
-void scope_retrieve(void *buf, size_t * len)
+void scope_retrieve(struct scope *s, void *buf, size_t * len)
 {
 	size_t samp_size, remaining, written;
 	struct scope_sample_description d;
-	struct list_head *cur, *next;
-	struct scope_sample *samp;
+	struct scope_ring *r = &s->ring;
 	u8 *cur_loc;
 
 	if (buf == NULL || len == NULL)
@@ -377,63 +1415,333 @@ void scope_retrieve(void *buf, size_t * len)
 
 	DEBUG("Attempting to write to buffer %p of length %zu\n", buf, *len);
 
-	scope_sample_desc(&d);
+	if (s->sparse && s->sparse_buf) {
+		scope_retrieve_sparse(s, (u8 __user *) buf, len);
+		return;
+	}
+
+	scope_sample_desc(s, &d);
 	samp_size = d.total_size;
 	remaining = *len;
 	written = 0;
 	cur_loc = (u8 *) buf;
 
-	list_for_each_safe(cur, next, &collected_samples) {
+	while (r->count > 0) {
 		// Only copy data if there's room
 		if (remaining < samp_size)
 			break;
 
-		// Copy data from list element
-		samp = list_entry(cur, struct scope_sample, list);
-		memcpy(cur_loc, samp->data, samp_size);
+		// Copy data from the ring
+		if (copy_to_user(cur_loc, scope_ring_slot(r, 0), samp_size))
+			break;
 		cur_loc += samp_size;
 		written += samp_size;
 		remaining -= samp_size;
 
 		// Remove sample
-		list_del(cur);
-		collected_count -= 1;
-		kfree(samp);
+		scope_release(s, 1);
 	}
 	*len = written;
 }
 
-void scope_sample_desc(struct scope_sample_description *desc)
+ssize_t scope_read(struct scope *s, char __user * buf, size_t len,
+		   bool nonblock)
+{
+	struct scope_sample_description d;
+	struct scope_ring *r = &s->ring;
+	ssize_t ret;
+	int err;
+
+	if (!access_ok(VERIFY_WRITE, buf, len))
+		return -EFAULT;
+
+	mutex_lock(&s->lock);
+	while (true) {
+		// The ring may have been flushed or reshaped while waiting
+		scope_sample_desc(s, &d);
+		if (d.total_size == 0 || len < d.total_size ||
+		    (d.sparse && len < d.record_size)) {
+			ret = -EINVAL;
+			goto out;
+		}
+		if (scope_sample_count(s) > 0)
+			break;
+		if (!s->streaming || s->stream_done) {
+			ret = 0;
+			goto out;
+		}
+		if (nonblock) {
+			ret = -EAGAIN;
+			goto out;
+		}
+
+		// Let the other users of the scope in while waiting
+		mutex_unlock(&s->lock);
+		err = wait_event_interruptible(r->wq,
+					       scope_sample_count(s) > 0 ||
+					       s->stream_done);
+		if (err)
+			return err;
+		mutex_lock(&s->lock);
+	}
+
+	scope_retrieve(s, buf, &len);
+	ret = (ssize_t) len;
+ out:
+	mutex_unlock(&s->lock);
+	return ret;
+}
+
+unsigned int scope_poll(struct scope *s, struct file *file,
+			poll_table * wait)
 {
-	size_t offs = 0;
+	unsigned int mask = 0;
+
+	poll_wait(file, &s->ring.wq, wait);
+	if (scope_sample_count(s) > 0)
+		mask |= POLLIN | POLLRDNORM;
+	else if (!s->streaming || s->stream_done)
+		mask |= POLLHUP;
+	return mask;
+}
+
+/**
+ * Describe the field of probe P in a sample, starting at OFFS.
+ *
+ * @return The size of the field.
+ */
+static size_t scope_field_desc(struct scope *s, struct field *f,
+			       struct probe *p, size_t offs)
+{
+	f->offs = offs;
+	f->output = p->cfg.output;
+	f->set_size = probe_generic_set_size(p);
+	f->nsets = p->set_cnt;
+	f->group_bytes = probe_generic_group_bytes(p);
+	if (s->packed) {
+		f->size = probe_generic_packed_size(p);
+		f->bits = probe_generic_packed_bits(p);
+	} else {
+		f->size = probe_generic_sample_size(p);
+		f->bits = 8;
+	}
+	return f->size;
+}
+
+void scope_sample_desc(struct scope *s,
+		       struct scope_sample_description *desc)
+{
+	size_t offs = sizeof(struct scope_sample_header);
 
 	if (desc == NULL)
 		return;
 
 	memset(desc, 0, sizeof(struct scope_sample_description));
 
-	if (is_probe_attached(&s.l1d_probe.base)) {
-		desc->l1d.offs = offs;
-		desc->l1d.size = probe_generic_sample_size(&s.l1d_probe.base);
-		offs += desc->l1d.size;
+	if (is_probe_attached(&s->l1d_probe.base))
+		offs += scope_field_desc(s, &desc->l1d, &s->l1d_probe.base, offs);
+
+	if (is_probe_attached(&s->l1i_probe.base))
+		offs += scope_field_desc(s, &desc->l1i, &s->l1i_probe.base, offs);
+
+	if (is_probe_attached(&s->btb_probe.base))
+		offs += scope_field_desc(s, &desc->btb, &s->btb_probe.base, offs);
+
+	if (is_probe_attached(&s->l2_probe.base))
+		offs += scope_field_desc(s, &desc->l2, &s->l2_probe.base, offs);
+
+	desc->total_size = offs;
+	desc->header_size = sizeof(struct scope_sample_header);
+	desc->timer_freq = arch_timer_get_cntfrq();
+	desc->sparse = s->sparse;
+	// Every byte after the header may need an entry
+	desc->record_size = sizeof(struct scope_sparse_record) + offs +
+	    (offs - desc->header_size) * (sizeof(u32) - 1);
+}
+
+unsigned int scope_sample_count(struct scope *s)
+{
+	return READ_ONCE(s->ring.count);
+}
+
+void scope_ring_desc(struct scope *s, struct scope_ring_description *desc)
+{
+	struct scope_ring *r = &s->ring;
+
+	if (desc == NULL)
+		return;
+
+	desc->size = r->size;
+	desc->stride = r->stride;
+	desc->capacity = r->capacity;
+	desc->head = r->head;
+	desc->count = r->count;
+	desc->generation = r->generation;
+	desc->trigger = s->trigger_index;
+}
+
+unsigned int scope_release(struct scope *s, unsigned int count)
+{
+	struct scope_ring *r = &s->ring;
+	unsigned long flags;
+
+	spin_lock_irqsave(&r->lock, flags);
+	if (count > r->count)
+		count = r->count;
+	if (count > 0) {
+		r->head = (r->head + count) % r->capacity;
+		r->count -= count;
 	}
+	spin_unlock_irqrestore(&r->lock, flags);
+
+	// Let a streaming collector know there is room again
+	if (count > 0)
+		wake_up_interruptible(&r->wq);
+	return count;
+}
+
+/**
+ * Get the number of histogram values of a field.
+ */
+static unsigned int scope_field_bins(struct field *f)
+{
+	if (f->output == PROBE_OUTPUT_BITMASK)
+		return f->nsets * f->set_size * 8;
+	return f->nsets * f->set_size;
+}
+
+/**
+ * Add the set values of field F of sample SAMP to BINS.
+ */
+static void scope_field_accumulate(u32 * bins, const u8 * samp,
+				   struct field *f)
+{
+	const u8 *src = samp + f->offs + f->group_bytes;
+	unsigned int i, n, bit;
+	u8 mask = (1 << f->bits) - 1;
+
+	n = scope_field_bins(f);
+	if (f->output == PROBE_OUTPUT_BITMASK) {
+		for (i = 0; i < n; i++)
+			bins[i] += (src[i / 8] >> (i % 8)) & 1;
+	} else if (f->bits < 8) {
+		// Packed values start from the low bits of each byte
+		for (i = 0; i < n; i++) {
+			bit = i * f->bits;
+			bins[i] += (src[bit / 8] >> (bit % 8)) & mask;
+		}
+	} else {
+		for (i = 0; i < n; i++)
+			bins[i] += src[i];
+	}
+}
 
-	if (is_probe_attached(&s.l1i_probe.base)) {
-		desc->l1i.offs = offs;
-		desc->l1i.size = probe_generic_sample_size(&s.l1i_probe.base);
-		offs += desc->l1i.size;
+unsigned int scope_accumulate(struct scope *s)
+{
+	struct scope_histogram *h = &s->hist;
+	struct scope_sample_description d;
+	struct field *fields[4];
+	unsigned int i, j, n, width, rows;
+	const u8 *samp;
+	u32 *row;
+
+	scope_sample_desc(s, &d);
+	fields[0] = &d.l1d;
+	fields[1] = &d.l1i;
+	fields[2] = &d.btb;
+	fields[3] = &d.l2;
+
+	width = 1;
+	for (j = 0; j < ARRAY_SIZE(fields); j++)
+		width += scope_field_bins(fields[j]);
+	rows = s->ring.capacity;
+	if (rows == 0)
+		return 0;
+
+	if (h->bins == NULL || h->rows != rows || h->width != width) {
+		scope_histogram_reset(s);
+		h->bins = (u32 *) vzalloc((size_t)rows * width * sizeof(u32));
+		if (h->bins == NULL) {
+			WARNING("Unable to allocate a histogram of %u rows.",
+				rows);
+			return 0;
+		}
+		h->rows = rows;
+		h->width = width;
 	}
 
-	if (is_probe_attached(&s.btb_probe.base)) {
-		desc->btb.offs = offs;
-		desc->btb.size = probe_generic_sample_size(&s.btb_probe.base);
-		offs += desc->btb.size;
+	n = scope_sample_count(s);
+	for (i = 0; i < n; i++) {
+		samp = scope_ring_slot(&s->ring, i);
+		row = &h->bins[(size_t)i * width];
+		row[0]++;
+		row++;
+		for (j = 0; j < ARRAY_SIZE(fields); j++) {
+			scope_field_accumulate(row, samp, fields[j]);
+			row += scope_field_bins(fields[j]);
+		}
 	}
+	h->captures++;
 
-	desc->total_size = offs;
+	scope_release(s, n);
+	return n;
 }
 
-unsigned int scope_sample_count()
+void scope_histogram_retrieve(struct scope *s, void *buf, size_t * len,
+			      struct scope_histogram_description *desc)
 {
-	return collected_count;
+	struct scope_histogram *h = &s->hist;
+	size_t sz;
+
+	if (len == NULL || desc == NULL)
+		return;
+
+	desc->rows = h->rows;
+	desc->width = h->width;
+	desc->captures = h->captures;
+
+	sz = (size_t)h->rows * h->width * sizeof(u32);
+	if (h->bins == NULL || buf == NULL || *len < sz ||
+	    copy_to_user(buf, h->bins, sz) != 0)
+		*len = 0;
+	else
+		*len = sz;
+}
+
+void scope_histogram_reset(struct scope *s)
+{
+	struct scope_histogram *h = &s->hist;
+
+	if (h->bins)
+		vfree(h->bins);
+	memset(h, 0, sizeof(struct scope_histogram));
+}
+
+int scope_mmap(struct scope *s, struct vm_area_struct *vma)
+{
+	struct scope_ring *r = &s->ring;
+	unsigned long len = vma->vm_end - vma->vm_start;
+	int ret;
+
+	// Samples are only written by the scope, so keep the mapping
+	// read-only.
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	// Readers fault on userland memory with the scope lock held, and
+	// this runs with the mmap lock held, so don't wait for the scope.
+	if (!mutex_trylock(&s->lock))
+		return -EAGAIN;
+	if (r->buf == NULL) {
+		INFO("Scope has not been prepared.");
+		ret = -ENXIO;
+	} else if (vma->vm_pgoff != 0 || len > r->size) {
+		INFO("Invalid ring mapping.");
+		ret = -EINVAL;
+	} else {
+		vma->vm_flags &= ~VM_MAYWRITE;
+		ret = remap_vmalloc_range(vma, r->buf, 0);
+	}
+	mutex_unlock(&s->lock);
+	return ret;
 }
@@ -25,77 +25,273 @@
 #ifndef SCOPE_H__
 #define SCOPE_H__
 
+#include <linux/completion.h>
+#include <linux/hrtimer.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+
 #include "cachegrab.h"
 #include "probe_types.h"
 
+/**
+ * Contiguous circular buffer holding the samples of a scope.
+ *
+ * The buffer is allocated once by scope_prepare and can be mapped into
+ * userspace, so collected samples can be read in place. HEAD and COUNT are
+ * protected by LOCK, since a streaming collector fills the ring while
+ * readers drain it. WQ is woken whenever samples are added or released.
+ *
+ * With deferred processing, the PENDING slots after the COUNT ready ones
+ * still hold raw counter values and are not visible to readers yet.
+ *
+ * SAMPLE_SIZE is the size of the samples the ring was laid out for, so it
+ * can be reused by later captures with the same layout.
+ */
+struct scope_ring {
+	u8 *buf;
+	size_t size;
+	size_t stride;
+	size_t sample_size;
+	unsigned int capacity;
+	unsigned int head;
+	unsigned int count;
+	unsigned int pending;
+	unsigned int generation;
+	spinlock_t lock;
+	wait_queue_head_t wq;
+};
+
+struct scope;
+
+/**
+ * Header at the start of every sample, ahead of the probe fields.
+ *
+ * SEQ numbers the samples taken since collection started, so samples
+ * dropped from a pre-trigger history show up as gaps. MISSED counts the
+ * sampling slots skipped since the previous sample, because the timer
+ * overran or a stream had no room left.
+ */
+struct scope_sample_header {
+	u64 timestamp;		// cntvct_el0 when the sample was taken
+	u32 seq;
+	u32 missed;
+};
+
+/**
+ * Descriptor handed to probes_collect for a batch of samples.
+ *
+ * DATA points into a slot of the scope ring, and the BATCH samples of one
+ * call are written to consecutive slots STRIDE bytes apart. Samples of a
+ * batch are started SPIN generic timer ticks apart. TRIGGERED is set if
+ * the scope was activated when the batch was collected.
+ */
+struct scope_sample {
+	bool collected;
+	bool triggered;
+	struct scope *scope;
+	size_t data_offs;
+	u8 *data;
+	unsigned int batch;
+	size_t stride;
+	u64 spin;
+};
+
+/**
+ * State of the timer sampling engine.
+ *
+ * Instead of interrupting the target core once per sample, a pinned hrtimer
+ * runs probes_collect on the target core every PERIOD. DONE is completed
+ * from the timer callback once collection is over.
+ */
+struct scope_timer {
+	struct hrtimer timer;
+	ktime_t period;
+	struct scope_sample samp;
+	unsigned int batch;
+	unsigned int timeout;
+	unsigned int count;
+	bool primed;
+	bool stream;
+	struct completion done;
+};
+
+/**
+ * Per-set totals accumulated over captures.
+ *
+ * BINS holds ROWS rows of WIDTH u32 values, one row per sample index of a
+ * capture. The first value of a row counts the samples added to it, and the
+ * others total the set values of the sample fields in field order. Bitmask
+ * fields get one value per way. CAPTURES counts the captures added in.
+ */
+struct scope_histogram {
+	u32 *bins;
+	unsigned int rows;
+	unsigned int width;
+	unsigned int captures;
+};
+
+/**
+ * State of one scope.
+ *
+ * A scope can be shared by several files and processes. LOCK is held by
+ * every ioctl, mmap and read of the scope, except the activation and
+ * deactivation triggers, which must get through while a collection holds
+ * LOCK. They take TRIGGER_LOCK instead, which is also held while the probes
+ * are enabled, disabled, attached or detached.
+ */
 struct scope {
+	struct mutex lock;
+	struct mutex trigger_lock;
 	bool activated;
+	bool pretrigger;
+	unsigned int pretrigger_len;
+	unsigned int trigger_index;
+	wait_queue_head_t activate_wq;
+	bool deferred;
+	bool packed;
+	bool sparse;
 	struct probe_l1d l1d_probe;
 	struct probe_l1i l1i_probe;
 	struct probe_btb btb_probe;
+	struct probe_l2 l2_probe;
 	int target_cpu;
 	bool created;
+	struct scope_ring ring;
+	u8 *reduce_buf;
+	u8 *sparse_buf;
+	struct scope_timer timer;
+	struct task_struct *collector;
+	bool streaming;
+	bool stream_done;
+	bool stream_timer;
+	unsigned int stream_delay;
+	unsigned int stream_timeout;
+	unsigned int stream_batch;
+	u32 sample_seq;
+	u32 missed;
+	struct scope_histogram hist;
 };
 
+/**
+ * Record of a sparse retrieval.
+ *
+ * A record with a non-zero IDLE stands for that many consecutive samples
+ * with no set values and no missed slots, and a struct scope_sparse_span
+ * follows it. Otherwise the sample header follows, then COUNT u32 entries
+ * built by SCOPE_SPARSE_ENTRY, one for each non-zero byte after the header.
+ */
+struct scope_sparse_record {
+	u32 idle;
+	u32 count;
+};
+
+/**
+ * Timestamps of the first and last samples of an idle run.
+ */
+struct scope_sparse_span {
+	u64 first;
+	u64 last;
+};
+
+// Offset of the byte in the sample in the upper 24 bits, value in the lower 8
+#define SCOPE_SPARSE_ENTRY(offs, value) (((u32)(offs) << 8) | (u8)(value))
+
 struct scope_configuration {
 	bool created;
 	int target_cpu;
 	bool l1d_attached;
 	bool l1i_attached;
 	bool btb_attached;
-};
-
-struct scope_sample {
-	struct list_head list;
-	bool collected;
-	struct scope *scope;
-	size_t data_offs;
-	u8 data[1];		// Variable length data
+	bool l2_attached;
 };
 
 struct field {
 	size_t offs;
 	size_t size;
+	enum probe_output output;
+	size_t set_size;
+	unsigned int nsets;
+	unsigned int bits;
+	// Bytes of refined group bitmap ahead of the sets
+	unsigned int group_bytes;
 };
 
 struct scope_sample_description {
 	size_t total_size;
+	size_t header_size;
+	unsigned int timer_freq;	// Ticks per second of the timestamps
+	bool sparse;
+	size_t record_size;	// Largest sparse record of a sample
 	struct field l1d;
 	struct field l1i;
 	struct field btb;
+	struct field l2;
+};
+
+struct scope_ring_description {
+	size_t size;
+	size_t stride;
+	unsigned int capacity;
+	unsigned int head;
+	unsigned int count;
+	unsigned int generation;
+	unsigned int trigger;
+};
+
+struct scope_histogram_description {
+	unsigned int rows;
+	unsigned int width;
+	unsigned int captures;
 };
 
 /**
- * Initialize the scope.
+ * Initialize the scopes.
  *
  * @return 0 on success, <0 otherwise.
  */
 int scope_init(void);
 
 /**
- * Clean up the scope.
+ * Clean up the scopes.
  */
 void scope_term(void);
 
+/**
+ * Look up a scope by its ID.
+ *
+ * There are CG_MAX_SCOPES independent scopes, each with its own probes,
+ * samples and target core. All other scope functions operate on the scope
+ * returned here.
+ *
+ * @param id The ID of the scope, below CG_MAX_SCOPES.
+ * @return The scope, or NULL if ID is out of range.
+ */
+struct scope *scope_get(unsigned int id);
+
 /**
  * Get the current configuration of the scope.
  */
-void scope_get_config(struct scope_configuration *cfg);
+void scope_get_config(struct scope *s, struct scope_configuration *cfg);
 
 /**
  * Create a new scope to monitor a target core.
  *
+ * Each core can only be the target of one scope at a time.
+ *
  * @param target_cpu The ID of the core to monitor.
  * @return CG_OK on success, error otherwise.
  */
-enum CGState scope_create(int target_cpu);
+enum CGState scope_create(struct scope *s, int target_cpu);
 
 /**
- * Destroy any existing scopes.
+ * Destroy the scope if it exists.
  *
  * Cleans up any resources in the process.
  */
-void scope_destroy(void);
+void scope_destroy(struct scope *s);
 
 /**
  * "Attaches" one of the probes to the scope.
@@ -105,9 +301,11 @@ void scope_destroy(void);
  *
  * @param type Which probe type to attach.
  * @param shape The shape of the cache being attached to.
+ * @param event The PMU event counted by the probe, or 0 for its default.
  * @return CG_OK if successful, error otherwise.
  */
-enum CGState scope_attach_probe(enum probe_type t, struct cache_shape *sh);
+enum CGState scope_attach_probe(struct scope *s, enum probe_type t,
+				 struct cache_shape *sh, unsigned int event);
 
 /**
  * "Detaches" one of the probes from the scope.
@@ -116,8 +314,9 @@ enum CGState scope_attach_probe(enum probe_type t, struct cache_shape *sh);
  * probe_attach.
  *
  * @param type Which probe type to attach.
+ * @return CG_OK if successful, error otherwise.
  */
-void scope_detach_probe(enum probe_type type);
+enum CGState scope_detach_probe(struct scope *s, enum probe_type type);
 
 /**
  * Gets the scope by the specified type.
@@ -125,7 +324,7 @@ void scope_detach_probe(enum probe_type type);
  * @return A pointer to the probe of the given type if one is attached,
  *         otherwise NULL.
  */
-struct probe *scope_get_probe(enum probe_type type);
+struct probe *scope_get_probe(struct scope *s, enum probe_type type);
 
 /**
  * Configures one of the probes on the scope.
@@ -134,53 +333,151 @@ struct probe *scope_get_probe(enum probe_type type);
  * @param cfg The configuration to apply.
  * @return 0 if successful, -1 otherwise.
  */
-int scope_configure_probe(enum probe_type type, struct probe_config *cfg);
+int scope_configure_probe(struct scope *s, enum probe_type type,
+			  struct probe_config *cfg);
+
+/**
+ * Find the fewest refill passes which fully prime one of the probes on the
+ * target core, and configure the probe to use them.
+ *
+ * @param type The type of probe to calibrate.
+ * @param refills Set to the refill count found.
+ * @return CG_OK if successful.
+ */
+enum CGState scope_calibrate_probe(struct scope *s, enum probe_type type,
+				   unsigned int *refills);
+
+/**
+ * Sample the idle target core to find the baseline miss count of every set,
+ * which is then subtracted from the counts of the probes.
+ *
+ * Only probes reporting miss counts are calibrated. The baselines are kept
+ * until the probes are reconfigured to probe other sets.
+ *
+ * @param samples Number of samples to take, 0 to clear the baselines.
+ * @param delay Delay in ns between samples.
+ * @param percentile Percentile of the idle counts taken as the baseline,
+ *                   0 for the default.
+ * @return CG_OK if successful.
+ */
+enum CGState scope_calibrate_baseline(struct scope *s, unsigned int samples,
+				      unsigned int delay,
+				      unsigned int percentile);
 
 /**
  * Activates all attached probes on the scope so collection begins.
  *
  * @return 0 if successful, -1 otherwise.
  */
-int scope_activate(void);
+int scope_activate(struct scope *s);
 
 /**
  * Deactivates all attached probes on the scope so collection stops.
  */
-void scope_deactivate(void);
+void scope_deactivate(struct scope *s);
+
+/**
+ * Set how the scope processes samples.
+ *
+ * With DEFERRED set, the interrupts-disabled section on the target core only
+ * snapshots raw counter values into the sample slot. They are reduced to
+ * per-set counts afterwards on the scope core, which shortens the time taken
+ * from the target. Each slot needs room for all raw values, so this takes
+ * effect at the next scope_prepare.
+ *
+ * With PACKED set, per-set counts are stored in the fewest bits that hold
+ * the associativity of the probe, as reported by scope_sample_desc.
+ *
+ * The prepared ring is only dropped if one of the modes changes.
+ *
+ * @param deferred Defer reduction of samples to the scope core.
+ * @param packed Pack per-set counts into fewer than 8 bits.
+ * @param sparse Retrieve and read samples as sparse records. Cannot be
+ *               combined with PACKED.
+ * @return CG_OK if successful, error otherwise.
+ */
+enum CGState scope_configure(struct scope *s, bool deferred, bool packed,
+			     bool sparse);
 
 /**
  * Prepare the scope for collection.
  *
- * This allocates space needed for the samples. This gives us better performance
- * than allocating on the fly, since we don't have to wait for page faults or
- * the allocator. The return value is at most MAX_SAMPLES.
+ * This allocates a single ring buffer with room for the samples. This gives
+ * us better performance than allocating on the fly, since we don't have to
+ * wait for page faults or the allocator. Slots are laid out so that no
+ * sample spans more cache lines than it needs. Either all MAX_SAMPLES are
+ * allocated or the preparation fails.
  *
- * @param max_samples The number of samples to try to allocate.
- * @return The number of empty samples successfully allocated.
+ * If the ring from a previous preparation has the same number of samples
+ * and the same layout, it is emptied and reused instead.
+ *
+ * @param max_samples The number of samples to allocate.
+ * @return MAX_SAMPLES if successful, 0 otherwise.
  */
-unsigned int scope_prepare(unsigned int max_samples);
+unsigned int scope_prepare(struct scope *s, unsigned int max_samples);
 
 /**
  * Arms the scope to begin the collection process.
  *
- * This function begins sending interrupts to the target core to execute the
- * probe function. Once the probes are activated, collection begins and
- * continues until the preallocated samples are all filled or the probes are
- * deactivated.
+ * This function sleeps until the scope is activated, without disturbing the
+ * target core. Once activated, it begins sending interrupts to the target
+ * core to execute the probe function, and collection continues until the
+ * preallocated samples are all filled or the probes are deactivated.
  *
- * @param delay The approximate delay in ns to wait between samples.
- * @param timeout The maximum number of unactivated samples before returning.
+ * If TIMER is set, a single interrupt arms an hrtimer on the target core
+ * which then collects a sample every DELAY ns without involving the scope
+ * core, and the caller sleeps until collection is over.
+ *
+ * Each interrupt collects up to BATCH samples, spinning on the generic timer
+ * so they are DELAY ns apart. This spreads the cost of the interrupt over
+ * the batch and keeps the samples evenly spaced.
+ *
+ * If PRETRIGGER is not zero, the probes are enabled right away and the
+ * scope samples continuously, keeping the last PRETRIGGER samples from
+ * before activation at the start of the ring. The number of samples kept is
+ * reported as the trigger index by scope_ring_desc.
+ *
+ * @param delay The approximate delay in ns to wait between samples, or the
+ *              sample period when using the timer.
+ * @param timeout How long to wait for activation, in multiples of DELAY.
+ * @param timer Collect from an hrtimer on the target core.
+ * @param pretrigger The number of samples to keep from before activation.
+ * @param batch The number of samples to collect per interrupt, 0 for 1.
  * @return The number of samples that were collected.
  */
-unsigned int scope_collect(unsigned int delay, unsigned int timeout);
+unsigned int scope_collect(struct scope *s, unsigned int delay,
+			   unsigned int timeout, bool timer, unsigned int pretrigger,
+			   unsigned int batch);
+
+/**
+ * Start collecting samples in the background.
+ *
+ * A kernel thread bound to the calling core runs the same collection loop as
+ * scope_collect, but a full ring makes it wait for readers instead of
+ * stopping. Samples are drained with scope_read, so the capture length is
+ * not limited by the size of the ring.
+ *
+ * @param delay The approximate delay in ns to wait between samples.
+ * @param timeout How long to wait for activation, in multiples of DELAY.
+ * @param timer Collect from an hrtimer on the target core.
+ * @param batch The number of samples to collect per interrupt, 0 for 1.
+ * @return CG_OK if the collector was started, error otherwise.
+ */
+enum CGState scope_stream(struct scope *s, unsigned int delay,
+			  unsigned int timeout, bool timer, unsigned int batch);
+
+/**
+ * Stop a background collection started by scope_stream, if any.
+ */
+void scope_stream_stop(struct scope *s);
 
 /**
  * Flush all samples from the scope.
  *
- * Deallocates all samples on the scope. Some of them may contain collected
- * information and some may be prepared for collection.
+ * Deallocates the sample ring of the scope. Some of the samples may contain
+ * collected information and some may be prepared for collection.
  */
-void scope_flush(void);
+void scope_flush(struct scope *s);
 
 /**
  * Retrieves the collected samples and fills the specified buffer.
@@ -193,7 +490,31 @@ void scope_flush(void);
  * @param buf Buffer to fill with samples.
  * @param len Pointer to length of the specified buffer.
  */
-void scope_retrieve(void *buf, size_t * len);
+void scope_retrieve(struct scope *s, void *buf, size_t * len);
+
+/**
+ * Read collected samples into a userland buffer.
+ *
+ * Samples are formatted the same way as with scope_retrieve. While a
+ * streaming collection is running, this blocks until at least one sample is
+ * available. Once the collection has finished and all samples are read,
+ * 0 is returned.
+ *
+ * @param buf Userland buffer to fill with samples.
+ * @param len Length of BUF.
+ * @param nonblock Return -EAGAIN instead of waiting for samples.
+ * @return Number of bytes read, or negative errno.
+ */
+ssize_t scope_read(struct scope *s, char __user * buf, size_t len,
+		   bool nonblock);
+
+/**
+ * Report whether samples can be read from the scope.
+ *
+ * @return Poll mask for the scope.
+ */
+unsigned int scope_poll(struct scope *s, struct file *file,
+			poll_table * wait);
 
 /**
  * Calculate information about the scope sample structure.
@@ -204,13 +525,73 @@ void scope_retrieve(void *buf, size_t * len);
  * @param desc Pointer to the sample description structure. This will be
  *             filled in with values for field offsets and sizes.
  */
-void scope_sample_desc(struct scope_sample_description *desc);
+void scope_sample_desc(struct scope *s,
+		       struct scope_sample_description *desc);
 
 /**
  * Return the number of collected samples.
  *
  * @return Number of collected samples.
  */
-unsigned int scope_sample_count(void);
+unsigned int scope_sample_count(struct scope *s);
+
+/**
+ * Describe the layout of the sample ring.
+ *
+ * Collected sample I (counting from 0) lives at byte offset
+ * ((head + I) % capacity) * stride of the mapped ring.
+ *
+ * @param desc Pointer to the ring description structure to fill in.
+ */
+void scope_ring_desc(struct scope *s, struct scope_ring_description *desc);
+
+/**
+ * Release collected samples which userspace has read from the mapped ring.
+ *
+ * @param count The number of samples to release, oldest first.
+ * @return The number of samples actually released.
+ */
+unsigned int scope_release(struct scope *s, unsigned int count);
+
+/**
+ * Add the collected samples to the histogram of the scope.
+ *
+ * Sample I of the ring is added to row I of the histogram, and the samples
+ * are then released. The histogram is started over whenever the number of
+ * samples or the sample layout changes.
+ *
+ * @return The number of samples added.
+ */
+unsigned int scope_accumulate(struct scope *s);
+
+/**
+ * Retrieve the histogram accumulated by scope_accumulate.
+ *
+ * This function assumes that BUF has already been verified to reside in user
+ * land. The whole histogram is copied, or nothing if it doesn't fit, so a
+ * NULL BUF just queries the shape.
+ *
+ * @param buf Buffer to fill with the histogram rows.
+ * @param len Pointer to length of BUF, set to the number of bytes copied.
+ * @param desc Filled in with the shape of the histogram.
+ */
+void scope_histogram_retrieve(struct scope *s, void *buf, size_t * len,
+			      struct scope_histogram_description *desc);
+
+/**
+ * Discard the accumulated histogram.
+ */
+void scope_histogram_reset(struct scope *s);
+
+/**
+ * Map the sample ring into userspace.
+ *
+ * The mapping is read-only and must start at offset 0. It fails with
+ * -EAGAIN while another user holds the scope.
+ *
+ * @param vma The area to map the ring into.
+ * @return 0 on success, negative errno otherwise.
+ */
+int scope_mmap(struct scope *s, struct vm_area_struct *vma);
 
 #endif
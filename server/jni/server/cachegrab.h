@@ -25,6 +25,9 @@
 #ifndef CACHEGRAB_H__
 #define CACHEGRAB_H__
 
+// Number of scopes which can monitor different cores at the same time
+#define CG_MAX_SCOPES 4
+
 enum CGState {
 	CG_OK = 0, //!< Operation successful
 	CG_BAD_ARG, //!< Error in arguments
@@ -35,9 +35,17 @@
 #include "capture_data.h"
 #include "scope.h"
 
-void get_capture_data (void) {
-  struct capture_data* data;
-  data = capture_data_retrieve();
+void get_capture_data (struct capture_data* data) {
+  if (data == NULL)
+    data = capture_data_retrieve();
+  if (data == NULL) {
+    scope_set_probe_data(PROBE_TYPE_L1D, NULL, 0);
+    scope_set_probe_data(PROBE_TYPE_L1I, NULL, 0);
+    scope_set_probe_data(PROBE_TYPE_BTB, NULL, 0);
+    scope_set_probe_data(PROBE_TYPE_L2, NULL, 0);
+    scope_set_timing_data(NULL, 0);
+    return;
+  }
 
   void* encoded_data;
   size_t encoded_len;
@@ -51,6 +59,12 @@ void get_capture_data (void) {
   encoded_data = capture_data_encode(&data->btb_probe, &encoded_len);
   scope_set_probe_data(PROBE_TYPE_BTB, encoded_data, encoded_len);
 
+  encoded_data = capture_data_encode(&data->l2_probe, &encoded_len);
+  scope_set_probe_data(PROBE_TYPE_L2, encoded_data, encoded_len);
+
+  encoded_data = capture_data_encode(&data->timing, &encoded_len);
+  scope_set_timing_data(encoded_data, encoded_len);
+
   capture_data_free(data);
 }
 
@@ -89,7 +103,7 @@ enum CGState capture (struct capture_config *cfg, struct capture_output *o) {
     goto fail_stall_alloc;
   }
   
-  if (!get_target_args(&target_args, cfg, target_cpu)) {
+  if (!get_target_args(&target_args, cfg, target_cpu, scope->id)) {
     ret = CG_BAD_ARG;
     goto fail_target_create;
   }
@@ -136,6 +150,11 @@ enum CGState capture (struct capture_config *cfg, struct capture_output *o) {
   pthread_join(target_thread, NULL);
 
   o->nsamples = scope_args.nsamples;
+  o->trigger_index = scope_args.trigger_index;
+  if (!successful) {
+    capture_data_free(scope_args.data);
+    scope_args.data = NULL;
+  }
   o->status = target_args.status;
   o->out_stream = target_args.out_stream;
   o->out_len = target_args.out_len;
@@ -149,8 +168,35 @@ enum CGState capture (struct capture_config *cfg, struct capture_output *o) {
  fail_stall_alloc:
  fail_get_config:
   if (successful) {
-    get_capture_data();
+    get_capture_data(scope_args.data);
     ret = get_shared_status(&shared_args);
   }
   return ret;
 }
+
+/**
+ * Run the capture CFG->accumulate times, adding every run to the histogram of
+ * the scope. Only the output of the last run is kept in O.
+ */
+enum CGState capture_accumulate (struct capture_config *cfg,
+				 struct capture_output *o) {
+  enum CGState ret = CG_OK;
+  unsigned int i;
+
+  if (cfg->stream)
+    return CG_BAD_ARG;
+
+  scope_histogram_reset();
+  for (i = 0; i < cfg->accumulate; i++) {
+    if (o->out_stream)
+      free(o->out_stream);
+    if (o->err_stream)
+      free(o->err_stream);
+    o->out_stream = o->err_stream = NULL;
+
+    ret = capture(cfg, o);
+    if (ret != CG_OK)
+      return ret;
+  }
+  return scope_retrieve_histogram();
+}
@@ -30,6 +30,8 @@
 #include <stdbool.h>
 #include <stdlib.h>
 
+struct capture_data;
+
 /* The following section is usually included in sched.h, but not in Android.
  * We'll just define it on our own. */
 #define CPU_SETSIZE 1024
@@ -51,10 +53,18 @@ struct capture_config {
   unsigned int stall_cutoff;
   unsigned int scope_time_delta;
   unsigned int scope_timeout;
+  unsigned int pretrigger;
+  unsigned int batch;
+  unsigned int accumulate;
   char* command;
   char* name;
   char* cbuf;
   bool debug;
+  bool stream;
+  bool timer;
+  bool deferred;
+  bool packed;
+  bool sparse;
 };
 
 struct shared_args {
@@ -73,11 +83,22 @@ struct scope_args {
   unsigned int time_delta;
   unsigned int timeout;
   unsigned int nsamples;
+  unsigned int pretrigger;
+  unsigned int batch;
+  unsigned int trigger_index;
+  bool stream;
+  bool accumulate;
+  bool timer;
+  bool deferred;
+  bool packed;
+  bool sparse;
+  struct capture_data *data;
   struct shared_args *shared;
 };
 
 struct target_args {
   int cpu;
+  unsigned int scope_id;
   char* command;
   char* name;
   char* cbuf;
@@ -99,6 +120,7 @@ struct stall_args {
 struct capture_output {
   int status;
   unsigned int nsamples;
+  unsigned int trigger_index;
   uint8_t* out_stream;
   size_t out_len;
   uint8_t* err_stream;
@@ -118,9 +140,12 @@ void* scope_func (void* p_arg);
 bool get_stall_args (struct stall_args *arg, struct capture_config *c, int cpu);
 void* stall_func (void* p_arg);
 
-bool get_target_args (struct target_args *arg, struct capture_config *c, int cpu);
+bool get_target_args (struct target_args *arg, struct capture_config *c, int cpu,
+		      unsigned int scope_id);
 void* target_func (void* p_arg);
 
 enum CGState capture (struct capture_config *cfg, struct capture_output *o);
+enum CGState capture_accumulate (struct capture_config *cfg,
+				 struct capture_output *o);
 
 #endif
@@ -32,99 +32,436 @@
 
 #include "scope.h"
 
+// Number of samples to read from the scope at a time when streaming
+#define STREAM_READ_SAMPLES 256
+
+/**
+ * Get the number of bytes a field takes once unpacked.
+ */
+static size_t field_width (struct field* f) {
+  return (f->bits < 8) ? f->group_bytes + f->nsets : f->size;
+}
+
+/**
+ * Copy a field out of a sample, unpacking it to one byte per set. The
+ * refined group bitmap, if any, is copied as is.
+ */
+static void field_copy (uint8_t* dst, const uint8_t* samp, struct field* f) {
+  const uint8_t* src = &samp[f->offs];
+  uint8_t mask = (1 << f->bits) - 1;
+
+  if (f->bits >= 8) {
+    memcpy(dst, src, f->size);
+    return;
+  }
+
+  memcpy(dst, src, f->group_bytes);
+  dst += f->group_bytes;
+  src += f->group_bytes;
+
+  // Packed values start from the low bits of each byte
+  for (unsigned int i = 0; i < f->nsets; i++) {
+    unsigned int bit = i * f->bits;
+    dst[i] = (src[bit / 8] >> (bit % 8)) & mask;
+  }
+}
+
+/**
+ * Split a raw sample into the per-probe arrays at index IDX.
+ */
+static void capture_data_copy (struct capture_data* d, struct scope_sample_desc* desc,
+			       const uint8_t* samp, unsigned int idx) {
+  // Copy l1d data
+  if (d->l1d_probe.collected)
+    field_copy(&d->l1d_probe.data[idx * d->l1d_probe.sample_width], samp, &desc->l1d);
+
+  // Copy l1i data
+  if (d->l1i_probe.collected)
+    field_copy(&d->l1i_probe.data[idx * d->l1i_probe.sample_width], samp, &desc->l1i);
+
+  // Copy btb data
+  if (d->btb_probe.collected)
+    field_copy(&d->btb_probe.data[idx * d->btb_probe.sample_width], samp, &desc->btb);
+
+  // Copy l2 data
+  if (d->l2_probe.collected)
+    field_copy(&d->l2_probe.data[idx * d->l2_probe.sample_width], samp, &desc->l2);
+
+  // Copy the sample header
+  if (d->timing.collected)
+    memcpy(&d->timing.data[idx * d->timing.sample_width], samp, desc->header_size);
+}
+
+/**
+ * Grow the sample array of a probe to hold COUNT samples.
+ */
+static bool capture_data_grow (struct probe_data* p, unsigned int count) {
+  uint8_t* data;
+
+  if (!p->collected)
+    return true;
+  data = (uint8_t*)realloc(p->data, count * p->sample_width);
+  if (!data)
+    return false;
+  p->data = data;
+  p->sample_count = count;
+  return true;
+}
+
+/**
+ * Grow the sample arrays of every probe to hold COUNT samples.
+ */
+static bool capture_data_grow_all (struct capture_data* d, unsigned int count) {
+  return capture_data_grow(&d->l1d_probe, count) &&
+    capture_data_grow(&d->l1i_probe, count) &&
+    capture_data_grow(&d->btb_probe, count) &&
+    capture_data_grow(&d->l2_probe, count) &&
+    capture_data_grow(&d->timing, count);
+}
+
+/**
+ * Set up empty sample arrays for the probes of DESC, to be grown as samples
+ * are read.
+ */
+static void capture_data_start (struct capture_data* d, struct scope_sample_desc* desc) {
+  d->l1d_probe.collected = desc->l1d.size > 0;
+  d->l1d_probe.sample_width = field_width(&desc->l1d);
+  d->l1i_probe.collected = desc->l1i.size > 0;
+  d->l1i_probe.sample_width = field_width(&desc->l1i);
+  d->btb_probe.collected = desc->btb.size > 0;
+  d->btb_probe.sample_width = field_width(&desc->btb);
+  d->l2_probe.collected = desc->l2.size > 0;
+  d->l2_probe.sample_width = field_width(&desc->l2);
+  d->timing.collected = desc->header_size > 0;
+  d->timing.sample_width = desc->header_size;
+}
+
+/**
+ * State kept across reads of sparse records.
+ */
+struct sparse_state {
+  // Scratch sample the records are expanded into
+  uint8_t* samp;
+  // Sequence number of the last sample, given to the idle samples after it
+  uint32_t seq;
+};
+
+/**
+ * Count the samples the sparse records in BUF stand for.
+ *
+ * @return The number of samples, or -1 if the records are malformed.
+ */
+static int sparse_count (struct scope_sample_desc* desc, const uint8_t* buf, size_t len) {
+  struct scope_sparse_record rec;
+  size_t offs = 0;
+  int cnt = 0;
+
+  while (offs + sizeof(rec) <= len) {
+    memcpy(&rec, &buf[offs], sizeof(rec));
+    offs += sizeof(rec);
+    if (rec.idle > 0) {
+      offs += sizeof(struct scope_sparse_span);
+      if (offs > len)
+	return -1;
+      cnt += rec.idle;
+      continue;
+    }
+    offs += desc->header_size + rec.count * sizeof(uint32_t);
+    if (offs > len)
+      return -1;
+    cnt++;
+  }
+  return (offs == len) ? cnt : -1;
+}
+
+/**
+ * Expand the sparse records in BUF into the samples from index TOTAL on.
+ *
+ * @return The number of samples decoded, or -1 on failure.
+ */
+static int sparse_decode (struct capture_data* d, struct scope_sample_desc* desc,
+			  const uint8_t* buf, size_t len, unsigned int total,
+			  struct sparse_state* st) {
+  struct scope_sparse_record rec;
+  struct scope_sparse_span span;
+  struct scope_sample_header hdr;
+  size_t offs = 0;
+  uint32_t entry;
+  int cnt;
+
+  cnt = sparse_count(desc, buf, len);
+  if (cnt < 0 || !capture_data_grow_all(d, total + cnt))
+    return -1;
+
+  while (offs < len) {
+    memcpy(&rec, &buf[offs], sizeof(rec));
+    offs += sizeof(rec);
+    memset(st->samp, 0, desc->total_size);
+
+    if (rec.idle > 0) {
+      // Idle samples keep their place in the sequence. Only the ends of the
+      // run have their timestamps sent, those in between are interpolated.
+      memcpy(&span, &buf[offs], sizeof(span));
+      offs += sizeof(span);
+      memset(&hdr, 0, sizeof(hdr));
+      for (uint32_t i = 0; i < rec.idle; i++) {
+	hdr.seq = ++st->seq;
+	hdr.timestamp = span.first;
+	if (rec.idle > 1)
+	  hdr.timestamp += (span.last - span.first) * i / (rec.idle - 1);
+	memcpy(st->samp, &hdr, sizeof(hdr));
+	capture_data_copy(d, desc, st->samp, total++);
+      }
+      continue;
+    }
+
+    memcpy(st->samp, &buf[offs], desc->header_size);
+    memcpy(&hdr, &buf[offs], sizeof(hdr));
+    offs += desc->header_size;
+    for (uint32_t i = 0; i < rec.count; i++) {
+      memcpy(&entry, &buf[offs], sizeof(entry));
+      offs += sizeof(entry);
+      if (SPARSE_ENTRY_OFFS(entry) < desc->total_size)
+	st->samp[SPARSE_ENTRY_OFFS(entry)] = SPARSE_ENTRY_VALUE(entry);
+    }
+    st->seq = hdr.seq;
+    capture_data_copy(d, desc, st->samp, total++);
+  }
+  return cnt;
+}
+
+/**
+ * Add the samples read from the scope into BUF to the samples from index
+ * TOTAL on. ST is only used for sparse records.
+ *
+ * @return The number of samples added, or -1 on failure.
+ */
+static int capture_data_add (struct capture_data* d, struct scope_sample_desc* desc,
+			     const uint8_t* buf, size_t len, unsigned int total,
+			     struct sparse_state* st) {
+  unsigned int cnt;
+
+  if (desc->sparse)
+    return sparse_decode(d, desc, buf, len, total, st);
+
+  cnt = len / desc->total_size;
+  if (!capture_data_grow_all(d, total + cnt))
+    return -1;
+  for (unsigned int i = 0; i < cnt; i++)
+    capture_data_copy(d, desc, &buf[i * desc->total_size], total + i);
+  return cnt;
+}
+
+/**
+ * Get the size of the buffer to read samples from the scope into.
+ */
+static size_t capture_data_read_size (struct scope_sample_desc* desc) {
+  size_t len = STREAM_READ_SAMPLES * desc->total_size;
+
+  if (desc->sparse && len < desc->record_size)
+    len = desc->record_size;
+  return len;
+}
+
+/**
+ * Copy the samples out of the scope as sparse records.
+ */
+static struct capture_data* capture_data_retrieve_sparse (struct scope_sample_desc* desc) {
+  struct capture_data* ret;
+  struct sparse_state st = { NULL, UINT32_MAX };
+  uint8_t* buf = NULL;
+  size_t buf_len, len;
+  unsigned int total = 0;
+  int cnt;
+
+  ret = (struct capture_data*)malloc(sizeof(struct capture_data));
+  if (ret == NULL)
+    return ret;
+  memset(ret, 0, sizeof(struct capture_data));
+  capture_data_start(ret, desc);
+
+  buf_len = capture_data_read_size(desc);
+  buf = (uint8_t*)malloc(buf_len);
+  st.samp = (uint8_t*)malloc(desc->total_size);
+  if (!buf || !st.samp)
+    goto fail;
+
+  while (true) {
+    len = buf_len;
+    scope_retrieve(buf, &len);
+    if (len == 0)
+      break;
+    cnt = capture_data_add(ret, desc, buf, len, total, &st);
+    if (cnt < 0)
+      goto fail;
+    total += cnt;
+  }
+
+  free(st.samp);
+  free(buf);
+  return ret;
+ fail:
+  if (st.samp)
+    free(st.samp);
+  if (buf)
+    free(buf);
+  capture_data_free(ret);
+  return NULL;
+}
+
 struct capture_data* capture_data_retrieve () {
   struct capture_data* ret;
   struct scope_sample_desc desc;
+  struct scope_ring_desc ring;
+  uint8_t* base;
   unsigned int nsamples;
 
+  // Sparse records are copied out, only whole samples are read in place
+  scope_sample_desc(&desc);
+  if (desc.sparse)
+    return capture_data_retrieve_sparse(&desc);
+
   ret = (struct capture_data*)malloc(sizeof(struct capture_data));
   if (ret == NULL)
     return ret;
   memset(ret, 0, sizeof(struct capture_data));
 
-  // Find out how much space we have to allocate
-  scope_sample_desc(&desc);
-  nsamples = scope_sample_count();
-
-  // Allocate it
-  uint8_t* tmp;
-  size_t tmp_sz = nsamples * desc.total_size;
-  tmp = (uint8_t*)malloc(tmp_sz);
-  if (!tmp)
+  // Map the kernel ring so the samples can be read in place
+  base = scope_map_ring(&ring);
+  if (!base)
     goto fail;
+  nsamples = ring.count;
 
+  // Allocate space for each probe
   if (desc.l1d.size > 0) {
-    ret->l1d_probe.data = (uint8_t*)malloc(nsamples * desc.l1d.size);
+    ret->l1d_probe.data = (uint8_t*)malloc(nsamples * field_width(&desc.l1d));
     if (!ret->l1d_probe.data)
       goto fail;
     ret->l1d_probe.collected = true;
     ret->l1d_probe.sample_count = nsamples;
-    ret->l1d_probe.sample_width = desc.l1d.size;
+    ret->l1d_probe.sample_width = field_width(&desc.l1d);
   }
 
   if (desc.l1i.size > 0) {
-    ret->l1i_probe.data = (uint8_t*)malloc(nsamples * desc.l1i.size);
+    ret->l1i_probe.data = (uint8_t*)malloc(nsamples * field_width(&desc.l1i));
     if (!ret->l1i_probe.data)
       goto fail;
     ret->l1i_probe.collected = true;
     ret->l1i_probe.sample_count = nsamples;
-    ret->l1i_probe.sample_width = desc.l1i.size;
+    ret->l1i_probe.sample_width = field_width(&desc.l1i);
   }
 
   if (desc.btb.size > 0) {
-    ret->btb_probe.data = (uint8_t*)malloc(nsamples * desc.btb.size);
+    ret->btb_probe.data = (uint8_t*)malloc(nsamples * field_width(&desc.btb));
     if (!ret->btb_probe.data)
       goto fail;
     ret->btb_probe.collected = true;
     ret->btb_probe.sample_count = nsamples;
-    ret->btb_probe.sample_width = desc.btb.size;
+    ret->btb_probe.sample_width = field_width(&desc.btb);
   }
 
-  // Copy from kernel
-  scope_retrieve(tmp, &tmp_sz);
-  nsamples = tmp_sz / desc.total_size;
+  if (desc.l2.size > 0) {
+    ret->l2_probe.data = (uint8_t*)malloc(nsamples * field_width(&desc.l2));
+    if (!ret->l2_probe.data)
+      goto fail;
+    ret->l2_probe.collected = true;
+    ret->l2_probe.sample_count = nsamples;
+    ret->l2_probe.sample_width = field_width(&desc.l2);
+  }
+
+  if (desc.header_size > 0) {
+    ret->timing.data = (uint8_t*)malloc(nsamples * desc.header_size);
+    if (!ret->timing.data)
+      goto fail;
+    ret->timing.collected = true;
+    ret->timing.sample_count = nsamples;
+    ret->timing.sample_width = desc.header_size;
+  }
 
   // Fill in capture data structure
   for (unsigned int i = 0; i < nsamples; i++) {
-    uint8_t *src, *dst;
-
-    // Copy l1d data
-    if (ret->l1d_probe.collected) {
-      src = &tmp[i * desc.total_size + desc.l1d.offs];
-      dst = &ret->l1d_probe.data[i * desc.l1d.size];
-      memcpy(dst, src, desc.l1d.size);
-    }
-
-    // Copy l1i data
-    if (ret->l1i_probe.collected) {
-      src = &tmp[i * desc.total_size + desc.l1i.offs];
-      dst = &ret->l1i_probe.data[i * desc.l1i.size];
-      memcpy(dst, src, desc.l1i.size);
-    }
-
-    // Copy btb data
-    if (ret->btb_probe.collected) {
-      src = &tmp[i * desc.total_size + desc.btb.offs];
-      dst = &ret->btb_probe.data[i * desc.btb.size];
-      memcpy(dst, src, desc.btb.size);
-    }
+    uint8_t *samp;
+    samp = &base[((ring.head + i) % ring.capacity) * ring.stride];
+    capture_data_copy(ret, &desc, samp, i);
   }
 
-  free(tmp);
+  // Hand the slots back to the kernel
+  scope_release(nsamples);
   return ret;
  fail:
-  if (tmp)
-    free(tmp);
   if (ret->l1d_probe.data)
     free(ret->l1d_probe.data);
   if (ret->l1i_probe.data)
     free(ret->l1i_probe.data);
   if (ret->btb_probe.data)
     free(ret->btb_probe.data);
+  if (ret->l2_probe.data)
+    free(ret->l2_probe.data);
+  if (ret->timing.data)
+    free(ret->timing.data);
   free(ret);
   return NULL;
 }
 
+struct capture_data* capture_data_stream (unsigned int *nsamples) {
+  struct capture_data* ret;
+  struct scope_sample_desc desc;
+  struct sparse_state st = { NULL, UINT32_MAX };
+  uint8_t* buf;
+  size_t buf_len;
+  ssize_t len;
+  unsigned int total = 0;
+  int cnt;
+
+  if (nsamples)
+    *nsamples = 0;
+
+  scope_sample_desc(&desc);
+  if (desc.total_size == 0)
+    return NULL;
+
+  ret = (struct capture_data*)malloc(sizeof(struct capture_data));
+  if (ret == NULL)
+    return ret;
+  memset(ret, 0, sizeof(struct capture_data));
+
+  buf_len = capture_data_read_size(&desc);
+  buf = (uint8_t*)malloc(buf_len);
+  if (!buf)
+    goto fail;
+  if (desc.sparse) {
+    st.samp = (uint8_t*)malloc(desc.total_size);
+    if (!st.samp)
+      goto fail;
+  }
+
+  capture_data_start(ret, &desc);
+
+  // Read until the kernel reports the end of the collection
+  while ((len = scope_stream_read(buf, buf_len)) > 0) {
+    cnt = capture_data_add(ret, &desc, buf, len, total, &st);
+    if (cnt < 0)
+      goto fail;
+    total += cnt;
+  }
+  if (len < 0)
+    goto fail;
+
+  if (st.samp)
+    free(st.samp);
+  free(buf);
+  if (nsamples)
+    *nsamples = total;
+  return ret;
+ fail:
+  if (st.samp)
+    free(st.samp);
+  if (buf)
+    free(buf);
+  capture_data_free(ret);
+  return NULL;
+}
+
 void write_to_enc_buffer (png_structp png, png_bytep data, png_size_t len) {
   struct enc_buffer *enc = png_get_io_ptr(png);
 
@@ -226,6 +563,12 @@ void capture_data_free (struct capture_data* data) {
   if (data->btb_probe.collected)
     free(data->btb_probe.data);
 
+  if (data->l2_probe.collected)
+    free(data->l2_probe.data);
+
+  if (data->timing.collected)
+    free(data->timing.data);
+
   free(data);
 }
 
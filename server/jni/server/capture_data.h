@@ -43,6 +43,9 @@ struct capture_data {
   struct probe_data l1d_probe;
   struct probe_data l1i_probe;
   struct probe_data btb_probe;
+  struct probe_data l2_probe;
+  // The raw scope_sample_header of each sample
+  struct probe_data timing;
 };
 
 /**
@@ -56,6 +59,18 @@ struct capture_data {
  */
 struct capture_data* capture_data_retrieve (void);
 
+/**
+ * Read streamed data from the kernel land scope until collection ends.
+ *
+ * The scope must have been started with scope_stream. The returned pointer
+ * must be freed by capture_data_free.
+ *
+ * @param nsamples Receives the number of samples read.
+ * @return Null in case of error, otherwise a pointer to a newly created
+ *         capture_data structure.
+ */
+struct capture_data* capture_data_stream (unsigned int *nsamples);
+
 /**
  * Encode the capture data to a PNG.
  *
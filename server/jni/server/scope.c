@@ -24,9 +24,12 @@
 
 #include "scope.h"
 
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -34,8 +37,31 @@
 
 static struct scope s;
 
-int scope_init () {
+static enum probe_output get_probe_output (enum arg_probe_output o) {
+  switch (o) {
+  case ARG_PROBE_OUTPUT_WAYS:
+    return PROBE_OUTPUT_WAYS;
+  case ARG_PROBE_OUTPUT_BITMASK:
+    return PROBE_OUTPUT_BITMASK;
+  default:
+    return PROBE_OUTPUT_COUNT;
+  }
+}
+
+static enum arg_probe_output get_arg_probe_output (enum probe_output o) {
+  switch (o) {
+  case PROBE_OUTPUT_WAYS:
+    return ARG_PROBE_OUTPUT_WAYS;
+  case PROBE_OUTPUT_BITMASK:
+    return ARG_PROBE_OUTPUT_BITMASK;
+  default:
+    return ARG_PROBE_OUTPUT_COUNT;
+  }
+}
+
+int scope_init (unsigned int id) {
   memset(&s, 0, sizeof(s));
+  s.id = id;
   s.connected = false;
   s.l1d.type = PROBE_TYPE_L1D;
   s.l1d.s = &s;
@@ -49,15 +75,33 @@ int scope_init () {
   s.btb.s = &s;
   s.btb.data.exists = false;
 
+  s.l2.type = PROBE_TYPE_L2;
+  s.l2.s = &s;
+  s.l2.data.exists = false;
+
   s.driver_fd = open(DEVFILE, O_RDWR);
   if (s.driver_fd < 0) {
     return -1;
   }
+
+  if (ioctl(s.driver_fd, CG_SCOPE_SELECT, (unsigned long)id) != CG_OK) {
+    close(s.driver_fd);
+    return -1;
+  }
   
   return 0;
 }
 
+void scope_unmap_ring (void) {
+  if (s.ring) {
+    munmap(s.ring, s.ring_len);
+    s.ring = NULL;
+    s.ring_len = 0;
+  }
+}
+
 void scope_term () {
+  scope_unmap_ring();
   close(s.driver_fd);
 }
 
@@ -79,9 +123,17 @@ enum CGState scope_get_probe_configuration (enum probe_type type, struct probe**
     cfg.type = ARG_PROBE_TYPE_BTB;
     p = &s.btb;
     break;
+  case PROBE_TYPE_L2:
+    cfg.type = ARG_PROBE_TYPE_L2;
+    p = &s.l2;
+    break;
   default:
     return CG_BAD_ARG;
   }
+  // The driver fills in the mask of probed sets
+  memset(p->cfg.set_mask, 0, sizeof(p->cfg.set_mask));
+  cfg.set_mask = p->cfg.set_mask;
+  cfg.set_mask_len = sizeof(p->cfg.set_mask);
   ret = ioctl(s.driver_fd, CG_PROBE_GET_CONFIG, &cfg);
   if (ret != CG_OK && ret != CG_PROBE_NOT_CONNECTED)
     return ret;
@@ -94,7 +146,13 @@ enum CGState scope_get_probe_configuration (enum probe_type type, struct probe**
     p->shape.line_size = cfg.line_size;
 
     p->cfg.set_start = cfg.set_start;
-    p->cfg.set_end = cfg.set_end;    
+    p->cfg.set_end = cfg.set_end;
+    p->cfg.output = get_probe_output(cfg.output);
+    p->event = cfg.event;
+    p->cfg.refills = cfg.refills;
+    p->cfg.masked = cfg.masked;
+    p->cfg.group_size = cfg.group_size;
+    p->calibrated = cfg.calibrated;
   } else {
     p->attached = false;
   }
@@ -125,6 +183,10 @@ enum CGState scope_get_configuration (struct scope** scope) {
   if (ret != CG_OK)
     return ret;
 
+  ret = scope_get_probe_configuration(PROBE_TYPE_L2, NULL);
+  if (ret != CG_OK)
+    return ret;
+
   if (scope)
     *scope = &s;
   return CG_OK;
@@ -151,13 +213,17 @@ void scope_disconnect () {
   scope_set_probe_data(PROBE_TYPE_L1D, NULL, 0);
   scope_set_probe_data(PROBE_TYPE_L1I, NULL, 0);
   scope_set_probe_data(PROBE_TYPE_BTB, NULL, 0);
+  scope_set_probe_data(PROBE_TYPE_L2, NULL, 0);
+  scope_set_timing_data(NULL, 0);
+  scope_histogram_reset();
 }
 
 bool is_scope_connected () {
   return s.connected;
 }
 
-enum CGState scope_attach_probe (enum probe_type type, struct cache_shape* shape) {
+enum CGState scope_attach_probe (enum probe_type type, struct cache_shape* shape,
+				 unsigned int event) {
   struct arg_probe_attach arg;
   enum CGState ret = CG_BAD_ARG;
 
@@ -171,6 +237,9 @@ enum CGState scope_attach_probe (enum probe_type type, struct cache_shape* shape
   case PROBE_TYPE_BTB:
     arg.type = ARG_PROBE_TYPE_BTB;
     break;
+  case PROBE_TYPE_L2:
+    arg.type = ARG_PROBE_TYPE_L2;
+    break;
   default:
     return ret;
   }
@@ -178,12 +247,13 @@ enum CGState scope_attach_probe (enum probe_type type, struct cache_shape* shape
   arg.num_sets = shape->num_sets;
   arg.associativity = shape->associativity;
   arg.line_size = shape->line_size;
+  arg.event = event;
   ret = ioctl(s.driver_fd, CG_PROBE_ATTACH, &arg);
   scope_get_configuration(NULL);
   return ret;
 }
 
-void scope_set_probe_configuration (enum probe_type t, unsigned int start, unsigned int end) {
+void scope_set_probe_configuration (enum probe_type t, const struct probe_config *cfg) {
   scope_set_probe_data(t, NULL, 0);
   
   struct arg_probe_configure arg;
@@ -197,18 +267,69 @@ void scope_set_probe_configuration (enum probe_type t, unsigned int start, unsig
   case PROBE_TYPE_BTB:
     arg.type = ARG_PROBE_TYPE_BTB;
     break;
+  case PROBE_TYPE_L2:
+    arg.type = ARG_PROBE_TYPE_L2;
+    break;
   default:
     return;
   }
   
-  arg.set_start = start;
-  arg.set_end = end;
+  arg.set_start = cfg->set_start;
+  arg.set_end = cfg->set_end;
+  arg.output = get_arg_probe_output(cfg->output);
+  arg.refills = cfg->refills;
+  arg.masked = cfg->masked;
+  arg.set_mask = cfg->set_mask;
+  arg.set_mask_len = sizeof(cfg->set_mask);
+  arg.group_size = cfg->group_size;
 
   ioctl(s.driver_fd, CG_PROBE_CONFIGURE, &arg);
 
   scope_get_configuration(NULL);
 }
 
+enum CGState scope_calibrate_probe (enum probe_type t, unsigned int *refills) {
+  struct arg_probe_calibrate arg;
+  enum CGState ret;
+
+  switch (t) {
+  case PROBE_TYPE_L1D:
+    arg.type = ARG_PROBE_TYPE_L1D;
+    break;
+  case PROBE_TYPE_L1I:
+    arg.type = ARG_PROBE_TYPE_L1I;
+    break;
+  case PROBE_TYPE_BTB:
+    arg.type = ARG_PROBE_TYPE_BTB;
+    break;
+  case PROBE_TYPE_L2:
+    arg.type = ARG_PROBE_TYPE_L2;
+    break;
+  default:
+    return CG_BAD_ARG;
+  }
+
+  ret = ioctl(s.driver_fd, CG_PROBE_CALIBRATE, &arg);
+  if (ret == CG_OK && refills)
+    *refills = arg.refills;
+  scope_get_configuration(NULL);
+  return ret;
+}
+
+enum CGState scope_calibrate_baseline (unsigned int samples, unsigned int delay,
+				       unsigned int percentile) {
+  struct arg_scope_calibrate arg = {
+    .samples = samples,
+    .delay = delay,
+    .percentile = percentile
+  };
+  enum CGState ret;
+
+  ret = ioctl(s.driver_fd, CG_SCOPE_CALIBRATE, &arg);
+  scope_get_configuration(NULL);
+  return ret;
+}
+
 enum CGState scope_set_probe_data (enum probe_type type, void* buf, size_t len) {
   struct probe* p;
 
@@ -222,6 +343,9 @@ enum CGState scope_set_probe_data (enum probe_type type, void* buf, size_t len)
   case PROBE_TYPE_BTB:
     p = &s.btb;
     break;
+  case PROBE_TYPE_L2:
+    p = &s.l2;
+    break;
   default:
     return CG_BAD_ARG;
   }
@@ -255,6 +379,9 @@ enum CGState scope_get_probe_data (enum probe_type type, void** buf, size_t *len
   case PROBE_TYPE_BTB:
     p = &s.btb;
     break;
+  case PROBE_TYPE_L2:
+    p = &s.l2;
+    break;
   default:
     return CG_BAD_ARG;
   }
@@ -270,6 +397,105 @@ enum CGState scope_get_probe_data (enum probe_type type, void** buf, size_t *len
   return CG_OK;
 }
 
+void scope_set_timing_data (void* buf, size_t len) {
+  if (s.timing.exists) {
+    free(s.timing.buf);
+  }
+  if (buf) {
+    s.timing.exists = true;
+    s.timing.buf = buf;
+    s.timing.len = len;
+  } else {
+    s.timing.exists = false;
+  }
+}
+
+void scope_get_timing_data (void** buf, size_t *len) {
+  if (s.timing.exists) {
+    *buf = s.timing.buf;
+    *len = s.timing.len;
+  } else {
+    *buf = NULL;
+    *len = 0;
+  }
+}
+
+static void get_cache_shape (struct cache_shape *s, struct arg_cache_level *l) {
+  s->num_sets = l->num_sets;
+  s->associativity = l->associativity;
+  s->line_size = l->line_size;
+}
+
+enum CGState scope_cache_geometry (int cpu, struct cache_geometry *g) {
+  struct arg_cache_geometry arg;
+  enum CGState ret;
+
+  memset(&arg, 0, sizeof(arg));
+  arg.cpu = cpu;
+  ret = ioctl(s.driver_fd, CG_CACHE_GEOMETRY, &arg);
+  if (ret != CG_OK)
+    return ret;
+  get_cache_shape(&g->l1d, &arg.l1d);
+  get_cache_shape(&g->l1i, &arg.l1i);
+  get_cache_shape(&g->l2, &arg.l2);
+  return CG_OK;
+}
+
+void scope_histogram_reset () {
+  ioctl(s.driver_fd, CG_SCOPE_HISTOGRAM_RESET, NULL);
+  if (s.histogram.exists)
+    free(s.histogram.buf);
+  s.histogram.exists = false;
+  memset(&s.histogram_desc, 0, sizeof(s.histogram_desc));
+}
+
+enum CGState scope_retrieve_histogram () {
+  struct arg_scope_histogram arg = {
+    .buf = NULL,
+    .len = 0
+  };
+  enum CGState ret;
+  void *buf;
+
+  // Query the shape first
+  ret = ioctl(s.driver_fd, CG_SCOPE_HISTOGRAM, &arg);
+  if (ret != CG_OK)
+    return ret;
+  arg.len = (size_t)arg.rows * arg.width * sizeof(uint32_t);
+  if (arg.len == 0)
+    return CG_OK;
+  buf = malloc(arg.len);
+  if (buf == NULL)
+    return CG_NO_MEM;
+  arg.buf = buf;
+  ret = ioctl(s.driver_fd, CG_SCOPE_HISTOGRAM, &arg);
+  if (ret != CG_OK || arg.len == 0) {
+    free(buf);
+    return (ret != CG_OK) ? ret : CG_INTERNAL_ERR;
+  }
+
+  if (s.histogram.exists)
+    free(s.histogram.buf);
+  s.histogram.exists = true;
+  s.histogram.buf = buf;
+  s.histogram.len = arg.len;
+  s.histogram_desc.rows = arg.rows;
+  s.histogram_desc.width = arg.width;
+  s.histogram_desc.captures = arg.captures;
+  return CG_OK;
+}
+
+void scope_get_histogram (void** buf, size_t *len, struct histogram_desc *desc) {
+  if (s.histogram.exists) {
+    *buf = s.histogram.buf;
+    *len = s.histogram.len;
+  } else {
+    *buf = NULL;
+    *len = 0;
+  }
+  if (desc)
+    *desc = s.histogram_desc;
+}
 
 void scope_detach_probe (enum probe_type type) {
   struct arg_probe_detach arg;
@@ -285,6 +511,9 @@ void scope_detach_probe (enum probe_type type) {
   case PROBE_TYPE_BTB:
     arg.type = ARG_PROBE_TYPE_BTB;
     break;
+  case PROBE_TYPE_L2:
+    arg.type = ARG_PROBE_TYPE_L2;
+    break;
   default:
     return;
   }
@@ -292,6 +521,15 @@ void scope_detach_probe (enum probe_type type) {
   scope_get_configuration(NULL);
 }
 
+enum CGState scope_configure (bool deferred, bool packed, bool sparse) {
+  struct arg_scope_configure arg = {
+    .deferred = deferred,
+    .packed = packed,
+    .sparse = sparse
+  };
+  return ioctl(s.driver_fd, CG_SCOPE_CONFIGURE, &arg);
+}
+
 unsigned int scope_prepare (unsigned int max_samples) {
   unsigned int ret;
   if (max_samples != 0) {
@@ -303,16 +541,62 @@ unsigned int scope_prepare (unsigned int max_samples) {
   return ret;
 }
 
-unsigned int scope_collect (unsigned int delay, unsigned int timeout) {
+unsigned int scope_collect (unsigned int delay, unsigned int timeout, bool timer,
+			    unsigned int pretrigger, unsigned int batch,
+			    bool accumulate, unsigned int *trigger) {
   struct arg_scope_collect arg = {
     .delay = delay,
-    .timeout = timeout
+    .timeout = timeout,
+    .flags = (timer ? ARG_COLLECT_TIMER : 0) |
+             (accumulate ? ARG_COLLECT_ACCUMULATE : 0),
+    .pretrigger = pretrigger,
+    .batch = batch
   };
+  struct arg_scope_ring_desc desc;
   unsigned int ret;
   ret = ioctl(s.driver_fd, CG_SCOPE_COLLECT, &arg);
+  if (trigger) {
+    if (ioctl(s.driver_fd, CG_SCOPE_RING_DESC, &desc) == CG_OK)
+      *trigger = desc.trigger;
+    else
+      *trigger = 0;
+  }
   return ret;
 }
 
+enum CGState scope_stream (unsigned int delay, unsigned int timeout, bool timer,
+			   unsigned int batch) {
+  struct arg_scope_collect arg = {
+    .delay = delay,
+    .timeout = timeout,
+    .flags = ARG_COLLECT_STREAM | (timer ? ARG_COLLECT_TIMER : 0),
+    .pretrigger = 0,
+    .batch = batch
+  };
+  return ioctl(s.driver_fd, CG_SCOPE_COLLECT, &arg);
+}
+
+ssize_t scope_stream_read (void *buf, size_t len) {
+  struct pollfd pfd = {
+    .fd = s.driver_fd,
+    .events = POLLIN
+  };
+  ssize_t ret;
+
+  while (true) {
+    if (poll(&pfd, 1, -1) < 0) {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+
+    ret = read(s.driver_fd, buf, len);
+    if (ret < 0 && (errno == EINTR || errno == EAGAIN))
+      continue;
+    return ret;
+  }
+}
+
 bool scope_activate () {
   int ret = ioctl(s.driver_fd, CG_SCOPE_ACTIVATE, NULL);
   return (ret == 0);
@@ -330,12 +614,38 @@ void scope_sample_desc (struct scope_sample_desc *desc) {
   ioctl(s.driver_fd, CG_SCOPE_SAMPLE_DESC, &arg_desc);
 
   desc->total_size = arg_desc.total_size;
+  desc->header_size = arg_desc.header_size;
+  desc->timer_freq = arg_desc.timer_freq;
+  desc->sparse = arg_desc.sparse;
+  desc->record_size = arg_desc.record_size;
   desc->l1d.offs   = arg_desc.l1d.offs;
   desc->l1d.size   = arg_desc.l1d.size;
+  desc->l1d.output = get_probe_output(arg_desc.l1d.output);
+  desc->l1d.set_size = arg_desc.l1d.set_size;
+  desc->l1d.nsets = arg_desc.l1d.nsets;
+  desc->l1d.bits = arg_desc.l1d.bits;
+  desc->l1d.group_bytes = arg_desc.l1d.group_bytes;
   desc->l1i.offs   = arg_desc.l1i.offs;
   desc->l1i.size   = arg_desc.l1i.size;
+  desc->l1i.output = get_probe_output(arg_desc.l1i.output);
+  desc->l1i.set_size = arg_desc.l1i.set_size;
+  desc->l1i.nsets = arg_desc.l1i.nsets;
+  desc->l1i.bits = arg_desc.l1i.bits;
+  desc->l1i.group_bytes = arg_desc.l1i.group_bytes;
   desc->btb.offs   = arg_desc.btb.offs;
   desc->btb.size   = arg_desc.btb.size;
+  desc->btb.output = get_probe_output(arg_desc.btb.output);
+  desc->btb.set_size = arg_desc.btb.set_size;
+  desc->btb.nsets = arg_desc.btb.nsets;
+  desc->btb.bits = arg_desc.btb.bits;
+  desc->btb.group_bytes = arg_desc.btb.group_bytes;
+  desc->l2.offs   = arg_desc.l2.offs;
+  desc->l2.size   = arg_desc.l2.size;
+  desc->l2.output = get_probe_output(arg_desc.l2.output);
+  desc->l2.set_size = arg_desc.l2.set_size;
+  desc->l2.nsets = arg_desc.l2.nsets;
+  desc->l2.bits = arg_desc.l2.bits;
+  desc->l2.group_bytes = arg_desc.l2.group_bytes;
 }
 
 unsigned int scope_sample_count () {
@@ -364,3 +674,45 @@ void scope_retrieve (void *buf, size_t *len) {
   else
     *len = p.len;
 }
+
+uint8_t* scope_map_ring (struct scope_ring_desc *desc) {
+  struct arg_scope_ring_desc arg;
+  void* ring;
+
+  if (desc == NULL)
+    return NULL;
+
+  if (ioctl(s.driver_fd, CG_SCOPE_RING_DESC, &arg) != CG_OK)
+    return NULL;
+
+  desc->size       = arg.size;
+  desc->stride     = arg.stride;
+  desc->capacity   = arg.capacity;
+  desc->head       = arg.head;
+  desc->count      = arg.count;
+  desc->generation = arg.generation;
+  desc->trigger    = arg.trigger;
+
+  if (desc->size == 0) {
+    scope_unmap_ring();
+    return NULL;
+  }
+
+  // Reuse the existing mapping unless the kernel reallocated the ring
+  if (s.ring && s.ring_generation == desc->generation)
+    return (uint8_t*)s.ring;
+
+  scope_unmap_ring();
+  ring = mmap(NULL, desc->size, PROT_READ, MAP_SHARED, s.driver_fd, 0);
+  if (ring == MAP_FAILED)
+    return NULL;
+
+  s.ring = ring;
+  s.ring_len = desc->size;
+  s.ring_generation = desc->generation;
+  return (uint8_t*)s.ring;
+}
+
+void scope_release (unsigned int count) {
+  ioctl(s.driver_fd, CG_SCOPE_RELEASE, (unsigned long)count);
+}
@@ -27,13 +27,15 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 #include "cachegrab.h"
 
 enum probe_type {
   PROBE_TYPE_L1D,
   PROBE_TYPE_L1I,
-  PROBE_TYPE_BTB
+  PROBE_TYPE_BTB,
+  PROBE_TYPE_L2
 };
 
 struct collected_data {
@@ -48,9 +50,32 @@ struct cache_shape {
   unsigned int line_size;
 };
 
+// Shapes of the caches of a core, zeroed for caches it doesn't report
+struct cache_geometry {
+  struct cache_shape l1d;
+  struct cache_shape l1i;
+  struct cache_shape l2;
+};
+
+enum probe_output {
+  PROBE_OUTPUT_COUNT,
+  PROBE_OUTPUT_WAYS,
+  PROBE_OUTPUT_BITMASK
+};
+
+// Largest cache a set mask can describe, as ARG_PROBE_MAX_SETS
+#define PROBE_MAX_SETS 4096
+
 struct probe_config {
   unsigned int set_start;
   unsigned int set_end;
+  enum probe_output output;
+  unsigned int refills;
+  // Only the sets of the range set in SET_MASK are probed if MASKED
+  bool masked;
+  uint8_t set_mask[PROBE_MAX_SETS / 8];
+  // Sets are probed coarse to fine in groups of GROUP_SIZE if non-zero
+  unsigned int group_size;
 };
 
 struct probe {
@@ -58,13 +83,30 @@ struct probe {
   enum probe_type type;
   struct cache_shape shape;
   struct probe_config cfg;
+  unsigned int event;
+  // Counts have the baseline found by scope_calibrate_baseline subtracted
+  bool calibrated;
   struct scope* s;
   struct collected_data data;
 };
 
+// Shape of the histogram accumulated by the scope. Each of the ROWS rows
+// holds WIDTH u32 values: the number of samples added to the row, then the
+// total of every set value.
+struct histogram_desc {
+  unsigned int rows;
+  unsigned int width;
+  unsigned int captures;
+};
+
 struct scope {
+  unsigned int id;
   int driver_fd;
 
+  void* ring;
+  size_t ring_len;
+  unsigned int ring_generation;
+
   bool connected;
   int target_cpu;
   int scope_cpu;
@@ -72,6 +114,14 @@ struct scope {
   struct probe l1d;
   struct probe l1i;
   struct probe btb;
+  struct probe l2;
+
+  // Sample headers of the last capture
+  struct collected_data timing;
+
+  // Histogram of the last accumulated captures
+  struct collected_data histogram;
+  struct histogram_desc histogram_desc;
 };
 
 // Duplicate of arg_scope_sample_desc because they're the same for now,
@@ -79,20 +129,71 @@ struct scope {
 struct field {
   size_t offs;
   size_t size;
+  enum probe_output output;
+  size_t set_size;
+  unsigned int nsets;
+  unsigned int bits;
+  // Bytes of refined group bitmap ahead of the sets
+  unsigned int group_bytes;
 };
+// Header at the start of every sample
+struct scope_sample_header {
+  uint64_t timestamp;
+  uint32_t seq;
+  uint32_t missed;
+};
+
+// Record of a sparse read. A non-zero IDLE stands for that many samples
+// with no set values, and a struct scope_sparse_span follows. Otherwise the
+// sample header and COUNT entries follow, see SPARSE_ENTRY_OFFS and
+// SPARSE_ENTRY_VALUE.
+struct scope_sparse_record {
+  uint32_t idle;
+  uint32_t count;
+};
+
+// Timestamps of the first and last samples of an idle run.
+struct scope_sparse_span {
+  uint64_t first;
+  uint64_t last;
+};
+
+#define SPARSE_ENTRY_OFFS(e) ((e) >> 8)
+#define SPARSE_ENTRY_VALUE(e) ((uint8_t)((e) & 0xFF))
+
 struct scope_sample_desc {
   size_t total_size;
+  size_t header_size;
+  unsigned int timer_freq;
+  // Samples are read as sparse records no larger than RECORD_SIZE
+  bool sparse;
+  size_t record_size;
   struct field l1d;
   struct field l1i;
   struct field btb;
+  struct field l2;
+};
+
+struct scope_ring_desc {
+  size_t size;
+  size_t stride;
+  unsigned int capacity;
+  unsigned int head;
+  unsigned int count;
+  unsigned int generation;
+  unsigned int trigger;
 };
 
 /**
  * Attempt to initialize the scope subsystem.
  *
+ * The kernel module provides CG_MAX_SCOPES independent scopes. Each server
+ * drives one of them, so several captures can run on disjoint cores at once.
+ *
+ * @param id The ID of the kernel scope to use.
  * @return 0 on success, < 0 on failure.
  */
-int scope_init (void);
+int scope_init (unsigned int id);
 
 /**
  * Terminate the scope subsystem.
@@ -108,8 +209,28 @@ enum CGState scope_get_probe_configuration (enum probe_type type, struct probe**
 
 /**
  * Sets the probe configuration.
+ *
+ * OUTPUT selects whether each set reports the number of ways that missed,
+ * the delta of every way, or a bitmask of the ways that missed. REFILLS is
+ * the number of refill passes after each sample, 0 for the default.
+ */
+void scope_set_probe_configuration (enum probe_type t, const struct probe_config *cfg);
+
+/**
+ * Finds the fewest refill passes which fully prime the probe on the target
+ * core, and configures the probe to use them.
  */
-void scope_set_probe_configuration (enum probe_type t, unsigned int start, unsigned int end);
+enum CGState scope_calibrate_probe (enum probe_type t, unsigned int *refills);
+
+/**
+ * Samples the idle target core to find the baseline miss count of each set,
+ * which the driver then subtracts from the counts of every capture.
+ *
+ * SAMPLES of 0 clears the baselines, and PERCENTILE of 0 selects the default
+ * percentile of the idle counts.
+ */
+enum CGState scope_calibrate_baseline (unsigned int samples, unsigned int delay,
+				       unsigned int percentile);
 
 /**
  * Gets the configuration of the scope.
@@ -128,6 +249,40 @@ enum CGState scope_set_probe_data (enum probe_type type, void* buf, size_t len);
  */
 enum CGState scope_get_probe_data (enum probe_type type, void** buf, size_t *len);
 
+/**
+ * Read the shapes of the caches of a core from its ID registers.
+ *
+ * @return CG_OK if successful, error otherwise.
+ */
+enum CGState scope_cache_geometry (int cpu, struct cache_geometry *g);
+
+/**
+ * Discard the histogram accumulated by the scope.
+ */
+void scope_histogram_reset (void);
+
+/**
+ * Copy the histogram accumulated by the scope and store it.
+ *
+ * @return CG_OK if successful, error otherwise.
+ */
+enum CGState scope_retrieve_histogram (void);
+
+/**
+ * Get the histogram stored by scope_retrieve_histogram.
+ */
+void scope_get_histogram (void** buf, size_t *len, struct histogram_desc *desc);
+
+/**
+ * Store the encoded sample headers of the last capture.
+ */
+void scope_set_timing_data (void* buf, size_t len);
+
+/**
+ * Retrieve the encoded sample headers of the last capture.
+ */
+void scope_get_timing_data (void** buf, size_t *len);
+
 /**
  * Connect to the scope.
  *
@@ -149,15 +304,28 @@ bool is_scope_connected (void);
 /**
  * Attach a probe to the scope.
  *
+ * @param event The PMU event counted by the probe, or 0 for its default.
  * @return CG_OK if successful, error otherwise.
  */
-enum CGState scope_attach_probe (enum probe_type type, struct cache_shape* shape);
+enum CGState scope_attach_probe (enum probe_type type, struct cache_shape* shape,
+				 unsigned int event);
 
 /**
  * Detach a probe from the scope.
  */
 void scope_detach_probe (enum probe_type type);
 
+/**
+ * Configure how the kernel processes samples.
+ *
+ * With DEFERRED set, samples are reduced on the scope core instead of while
+ * the target core has interrupts disabled. With PACKED set, per-set counts
+ * are stored in fewer than 8 bits each. With SPARSE set, samples are read
+ * as sparse records, which PACKED can't be combined with. Takes effect at
+ * the next scope_prepare.
+ */
+enum CGState scope_configure (bool deferred, bool packed, bool sparse);
+
 /**
  * Prepare the sample for collection.
  */
@@ -165,8 +333,46 @@ unsigned int scope_prepare (unsigned int max_samples);
 
 /**
  * Collect from the scope.
+ *
+ * If TIMER is set, samples are taken by a timer on the target core every
+ * DELAY ns instead of being requested one at a time by the scope core.
+ *
+ * If PRETRIGGER is non-zero, sampling starts right away and up to
+ * PRETRIGGER samples from before the trigger are kept. TIMEOUT then limits
+ * the number of samples taken while waiting for the trigger.
+ *
+ * Each interrupt of the target core takes up to BATCH samples, DELAY ns
+ * apart. 0 takes a single one.
+ *
+ * If ACCUMULATE is set, the samples are added to the histogram of the scope
+ * instead of being kept for retrieval. PRETRIGGER must then be 0.
+ *
+ * @param trigger Receives the index of the first sample after the trigger.
+ * @return Number of samples collected, including pre-trigger samples.
+ */
+unsigned int scope_collect (unsigned int delay, unsigned int timeout, bool timer,
+			    unsigned int pretrigger, unsigned int batch,
+			    bool accumulate, unsigned int *trigger);
+
+/**
+ * Start collecting from the scope in the background.
+ *
+ * Samples are not limited by the size of the kernel ring, but must be read
+ * with scope_stream_read as they arrive.
+ *
+ * @return CG_OK if collection started, error otherwise.
+ */
+enum CGState scope_stream (unsigned int delay, unsigned int timeout, bool timer,
+			   unsigned int batch);
+
+/**
+ * Wait for streamed samples and read them into the specified buffer.
+ *
+ * @param buf Buffer to receive whole samples.
+ * @param len Length of BUF, at least one sample.
+ * @return Number of bytes read, 0 once collection is over, or -1 on error.
  */
-unsigned int scope_collect (unsigned int delay, unsigned int timeout);
+ssize_t scope_stream_read (void *buf, size_t len);
 
 /**
  * Activate the scope so collection can begin.
@@ -206,4 +412,22 @@ unsigned int scope_sample_count (void);
  */
 void scope_retrieve (void *buf, size_t *len);
 
+/**
+ * Map the kernel sample ring so samples can be read in place.
+ *
+ * The mapping is kept between calls and only replaced once the kernel
+ * allocates a new ring.
+ *
+ * @param desc Receives the current layout of the ring.
+ * @return Pointer to the start of the ring, or NULL on failure.
+ */
+uint8_t* scope_map_ring (struct scope_ring_desc *desc);
+
+/**
+ * Release samples which have been read from the mapped ring.
+ *
+ * @param count Number of samples to release, oldest first.
+ */
+void scope_release (unsigned int count);
+
 #endif
@@ -26,6 +26,7 @@
 
 #include <mongoose.h>
 #include <stdio.h>
+#include <unistd.h>
 
 #include "scope.h"
 #include "server_capture.h"
@@ -108,9 +109,12 @@ static void ev_handler(struct mg_connection *nc, int ev, void *data) {
   }
 }
 
-int server_init (void) {
+int server_init (unsigned int id) {
+  char port[8];
+
+  snprintf(port, sizeof(port), "%u", BASE_PORT + id);
   mg_mgr_init(&mgr, NULL);
-  nc = mg_bind(&mgr, PORT , ev_handler);
+  nc = mg_bind(&mgr, port, ev_handler);
   if (nc == NULL) {
     fprintf(stderr, "Could not bind to port.\n");
     return -1;
@@ -119,6 +123,7 @@ int server_init (void) {
   mg_register_http_endpoint(nc, "/configuration", handle_status);
   mg_register_http_endpoint(nc, "/connect", handle_connect);
   mg_register_http_endpoint(nc, "/disconnect", handle_disconnect);
+  mg_register_http_endpoint(nc, "/calibrate", handle_calibrate);
 
   mg_register_http_endpoint(nc, "/l1d/configuration", handle_l1d_config);
   mg_register_http_endpoint(nc, "/l1d/connect", handle_l1d_connect);
@@ -134,8 +139,14 @@ int server_init (void) {
   mg_register_http_endpoint(nc, "/btb/connect", handle_btb_connect);
   mg_register_http_endpoint(nc, "/btb/disconnect", handle_btb_disconnect);
   mg_register_http_endpoint(nc, "/capture/btb.png", handle_btb_data);
+  mg_register_http_endpoint(nc, "/l2/configuration", handle_l2_config);
+  mg_register_http_endpoint(nc, "/l2/connect", handle_l2_connect);
+  mg_register_http_endpoint(nc, "/l2/disconnect", handle_l2_disconnect);
+  mg_register_http_endpoint(nc, "/capture/l2.png", handle_l2_data);
 
   mg_register_http_endpoint(nc, "/capture/start", handle_capture);
+  mg_register_http_endpoint(nc, "/capture/timing.png", handle_timing_data);
+  mg_register_http_endpoint(nc, "/capture/histogram", handle_histogram_data);
 
   mg_set_protocol_http_websocket(nc);
   return 0;
@@ -152,12 +163,29 @@ void server_run (void) {
 }
 
 int main (int argc, char** argv) {
-  if (scope_init() < 0) {
+  unsigned int id = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:")) != -1) {
+    switch (opt) {
+    case 's':
+      if (1 != sscanf(optarg, "%u", &id) || id >= CG_MAX_SCOPES) {
+	fprintf(stderr, "Scope ID must be below %d.\n", CG_MAX_SCOPES);
+	return -1;
+      }
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-s scope_id]\n", argv[0]);
+      return -1;
+    }
+  }
+
+  if (scope_init(id) < 0) {
     fprintf(stderr, "Failed to initialize the scope.\n");
     return -1;
   }
 
-  if (server_init() < 0) {
+  if (server_init(id) < 0) {
     fprintf(stderr, "Failed to initialize the server.\n");
     return -1;
   }
@@ -28,7 +28,8 @@
 #include <mongoose.h>
 #include "cachegrab.h"
 
-#define PORT "8000"
+// Port of the server driving scope 0. Scope N is served on BASE_PORT + N.
+#define BASE_PORT 8000
 
 #define POST mg_mk_str("POST")
 #define GET  mg_mk_str("GET")
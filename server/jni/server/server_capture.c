@@ -35,15 +35,26 @@ bool get_capture_config (struct capture_config *cfg, struct mg_str *ps, bool url
   char s_cut_s[10];
   char del_s[10];
   char to_s[10];
+  char pre_s[10];
+  char batch_s[10];
+  char acc_s[10];
   char command[1024];
   char name[256];
   char cbuf[1024];
   char debug[10];
+  char stream[10];
+  char timer[10];
+  char deferred[10];
+  char packed[10];
+  char sparse[10];
 
   unsigned int samples;
   unsigned int s_cut;
   unsigned int delta;
   unsigned int timeout;
+  unsigned int pretrigger;
+  unsigned int batch;
+  unsigned int accumulate;
 
   if (mg_get_http_var(ps, "max_samples", nsamp_s, sizeof(nsamp_s)) <= 0 ||
       1 != sscanf(nsamp_s, "%u", &samples) ||
@@ -62,6 +73,18 @@ bool get_capture_config (struct capture_config *cfg, struct mg_str *ps, bool url
       1 != sscanf(to_s, "%u", &timeout))
     timeout = DEFAULT_TIMEOUT;
 
+  if (mg_get_http_var(ps, "pretrigger", pre_s, sizeof(pre_s)) <= 0 ||
+      1 != sscanf(pre_s, "%u", &pretrigger))
+    pretrigger = 0;
+
+  if (mg_get_http_var(ps, "batch", batch_s, sizeof(batch_s)) <= 0 ||
+      1 != sscanf(batch_s, "%u", &batch))
+    batch = 0;
+
+  if (mg_get_http_var(ps, "accumulate", acc_s, sizeof(acc_s)) <= 0 ||
+      1 != sscanf(acc_s, "%u", &accumulate))
+    accumulate = 0;
+
   int len;
   
   if ((len = mg_get_http_var(ps, "command", command, sizeof(command))) <= 0)
@@ -94,10 +117,48 @@ bool get_capture_config (struct capture_config *cfg, struct mg_str *ps, bool url
     cfg->debug = false;
   }
 
+  if (mg_get_http_var(ps, "stream", stream, sizeof(stream)) > 0 &&
+      0 == strcmp("y", stream)) {
+    cfg->stream = true;
+  } else {
+    cfg->stream = false;
+  }
+
+  if (mg_get_http_var(ps, "timer", timer, sizeof(timer)) > 0 &&
+      0 == strcmp("y", timer)) {
+    cfg->timer = true;
+  } else {
+    cfg->timer = false;
+  }
+
+  if (mg_get_http_var(ps, "deferred", deferred, sizeof(deferred)) > 0 &&
+      0 == strcmp("y", deferred)) {
+    cfg->deferred = true;
+  } else {
+    cfg->deferred = false;
+  }
+
+  if (mg_get_http_var(ps, "packed", packed, sizeof(packed)) > 0 &&
+      0 == strcmp("y", packed)) {
+    cfg->packed = true;
+  } else {
+    cfg->packed = false;
+  }
+
+  if (mg_get_http_var(ps, "sparse", sparse, sizeof(sparse)) > 0 &&
+      0 == strcmp("y", sparse)) {
+    cfg->sparse = true;
+  } else {
+    cfg->sparse = false;
+  }
+
   cfg->max_samples = samples;
   cfg->stall_cutoff = s_cut;
   cfg->scope_time_delta = delta;
   cfg->scope_timeout = timeout;
+  cfg->pretrigger = pretrigger;
+  cfg->batch = batch;
+  cfg->accumulate = accumulate;
   return true;
  memerr:
   free_capture_config(cfg);
@@ -143,7 +204,10 @@ void handle_capture (struct mg_connection *nc, int ev, void *data) {
     
   if (!get_capture_config(&cfg, params, is_get))
     goto err;
-  err = capture(&cfg, &o);
+  if (cfg.accumulate > 0)
+    err = capture_accumulate(&cfg, &o);
+  else
+    err = capture(&cfg, &o);
   if (err != CG_OK)
     goto err;
 
@@ -161,6 +225,8 @@ void handle_capture (struct mg_connection *nc, int ev, void *data) {
       mg_printf(nc, "<td>L1I<br><img src='l1i.png'><br></td>");
     if (s->btb.attached)
       mg_printf(nc, "<td>BTB<br><img src='btb.png'><br></td>");
+    if (s->l2.attached)
+      mg_printf(nc, "<td>L2<br><img src='l2.png'><br></td>");
     mg_printf(nc, "</tr></table>");
     if (o.out_stream) {
       mg_printf(nc, "<b>STDOUT</b><br>");
@@ -173,12 +239,24 @@ void handle_capture (struct mg_connection *nc, int ev, void *data) {
     mg_printf(nc, "</body></html>");
     HTTP_DONE(nc);
   } else {
+    struct scope_sample_desc desc;
+    struct histogram_desc hist;
+    void* hbuf;
+    size_t hlen;
+    scope_sample_desc(&desc);
+    scope_get_histogram(&hbuf, &hlen, &hist);
+
     HTTP_OK(nc);
     mg_printf(nc, "{");
     print_status(nc, err);
     mg_printf(nc, ", ");
 
     mg_printf(nc, "\"num_samples\": %u, ", o.nsamples);
+    mg_printf(nc, "\"trigger_index\": %u, ", o.trigger_index);
+    mg_printf(nc, "\"timer_freq\": %u, ", desc.timer_freq);
+    if (cfg.accumulate > 0)
+      mg_printf(nc, "\"histogram\": {\"rows\": %u, \"width\": %u, "
+		"\"captures\": %u}, ", hist.rows, hist.width, hist.captures);
     mg_printf(nc, "\"return_code\": %d, ", o.status);
 
     mg_printf(nc, "\"stdout\": \"");
@@ -211,3 +289,41 @@ void handle_capture (struct mg_connection *nc, int ev, void *data) {
   respond_status(nc, err);
   free_capture_config(&cfg);
 }
+
+/**
+ * Serve the sample headers of the last capture, one row per sample.
+ */
+void handle_timing_data (struct mg_connection *nc, int ev, void *data) {
+  struct http_message *msg = data;
+  void* buf;
+  size_t len;
+
+  scope_get_timing_data(&buf, &len);
+  if (0 == mg_strcmp(GET, msg->method) && buf != NULL) {
+    HTTP_OK(nc);
+    mg_send(nc, buf, len);
+    HTTP_DONE(nc);
+  } else {
+    HTTP_NOTFOUND(nc);
+    HTTP_DONE(nc);
+  }
+}
+
+/**
+ * Serve the accumulated histogram as rows of little-endian u32 values.
+ */
+void handle_histogram_data (struct mg_connection *nc, int ev, void *data) {
+  struct http_message *msg = data;
+  void* buf;
+  size_t len;
+
+  scope_get_histogram(&buf, &len, NULL);
+  if (0 == mg_strcmp(GET, msg->method) && buf != NULL) {
+    HTTP_OK(nc);
+    mg_send(nc, buf, len);
+    HTTP_DONE(nc);
+  } else {
+    HTTP_NOTFOUND(nc);
+    HTTP_DONE(nc);
+  }
+}
@@ -32,5 +32,7 @@
 #define DEFAULT_TIMEOUT 1000
 
 void handle_capture (struct mg_connection *nc, int ev, void *data);
+void handle_timing_data (struct mg_connection *nc, int ev, void *data);
+void handle_histogram_data (struct mg_connection *nc, int ev, void *data);
 
 #endif
@@ -24,6 +24,8 @@
 
 #include "server_probe.h"
 
+#include <stdlib.h>
+
 #include "driver.h"
 #include "scope.h"
 #include "server.h"
@@ -55,16 +57,155 @@ bool get_cache_shape (struct cache_shape *s, struct mg_str *ps) {
   return true;
 }
 
+bool get_probe_event (unsigned int *event, struct mg_str *ps) {
+  char event_s[10];
+  char *end;
+
+  // Without an event the probe counts its usual refills
+  if (mg_get_http_var(ps, "event", event_s, sizeof(event_s)) <= 0) {
+    *event = 0;
+    return true;
+  }
+  // Accept both decimal and 0x prefixed event numbers
+  *event = (unsigned int)strtoul(event_s, &end, 0);
+  return end != event_s && *end == '\0';
+}
+
+static const char* output_names[] = {
+  [PROBE_OUTPUT_COUNT] = "count",
+  [PROBE_OUTPUT_WAYS] = "ways",
+  [PROBE_OUTPUT_BITMASK] = "bitmask"
+};
+
+bool get_probe_output (enum probe_output *o, struct mg_str *ps) {
+  char output_s[10];
+
+  if (mg_get_http_var(ps, "output", output_s, sizeof(output_s)) <= 0) {
+    *o = PROBE_OUTPUT_COUNT;
+    return true;
+  }
+  for (unsigned int i = 0; i < sizeof(output_names) / sizeof(output_names[0]); i++) {
+    if (0 == strcmp(output_names[i], output_s)) {
+      *o = (enum probe_output)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Parse the optional refill count. "auto" asks for calibration.
+ */
+bool get_probe_refills (unsigned int *refills, bool *calibrate, struct mg_str *ps) {
+  char refills_s[10];
+
+  *refills = 0;
+  *calibrate = false;
+  if (mg_get_http_var(ps, "refills", refills_s, sizeof(refills_s)) <= 0)
+    return true;
+  if (0 == strcmp(refills_s, "auto")) {
+    *calibrate = true;
+    return true;
+  }
+  return 1 == sscanf(refills_s, "%u", refills);
+}
+
+/**
+ * Parse the optional group size. 0 probes every set line by line.
+ */
+bool get_probe_group_size (unsigned int *group_size, struct mg_str *ps) {
+  char group_s[10];
+  char *end;
+
+  *group_size = 0;
+  if (mg_get_http_var(ps, "group_size", group_s, sizeof(group_s)) <= 0)
+    return true;
+  *group_size = (unsigned int)strtoul(group_s, &end, 10);
+  return end != group_s && *end == '\0';
+}
+
+static bool set_mask_test (const uint8_t *mask, unsigned int set) {
+  return set < PROBE_MAX_SETS && (mask[set / 8] & (1 << (set % 8)));
+}
+
+/**
+ * Parse the optional list of sets to probe, e.g. "3,17,40-43".
+ */
+bool get_probe_sets (struct probe_config *cfg, struct mg_str *ps) {
+  char sets_s[4096];
+  char *cur, *end;
+  unsigned long lo, hi;
+
+  cfg->masked = false;
+  memset(cfg->set_mask, 0, sizeof(cfg->set_mask));
+  if (mg_get_http_var(ps, "sets", sets_s, sizeof(sets_s)) <= 0)
+    return true;
+
+  cur = sets_s;
+  while (*cur != '\0') {
+    lo = strtoul(cur, &end, 10);
+    if (end == cur)
+      return false;
+    hi = lo;
+    if (*end == '-') {
+      cur = end + 1;
+      hi = strtoul(cur, &end, 10);
+      if (end == cur)
+	return false;
+    }
+    if (lo > hi || hi >= PROBE_MAX_SETS)
+      return false;
+    for (unsigned long set = lo; set <= hi; set++)
+      cfg->set_mask[set / 8] |= 1 << (set % 8);
+
+    if (*end == ',')
+      end++;
+    else if (*end != '\0')
+      return false;
+    cur = end;
+  }
+  cfg->masked = true;
+  return true;
+}
+
+/**
+ * Print the set mask as a list of sets and ranges.
+ */
+static void print_sets (struct mg_connection *nc, const struct probe_config *cfg) {
+  bool first = true;
+  unsigned int lo, hi;
+
+  mg_printf(nc, "\"sets\": \"");
+  for (lo = 0; cfg->masked && lo < PROBE_MAX_SETS; lo = hi + 1) {
+    if (!set_mask_test(cfg->set_mask, lo)) {
+      hi = lo;
+      continue;
+    }
+    for (hi = lo; set_mask_test(cfg->set_mask, hi + 1); hi++)
+      ;
+    mg_printf(nc, first ? "%u" : ",%u", lo);
+    if (hi > lo)
+      mg_printf(nc, "-%u", hi);
+    first = false;
+  }
+  mg_printf(nc, "\"");
+}
+
 void print_probe (struct mg_connection *nc, struct probe* p) {
   if (p && p->attached) {
     mg_printf(nc, "\"cache_shape\": {");
     mg_printf(nc, "\"num_sets\": %u, ", p->shape.num_sets);
     mg_printf(nc, "\"associativity\": %u, ", p->shape.associativity);
     mg_printf(nc, "\"line_size\": %u", p->shape.line_size);
-    mg_printf(nc, "}, \"config\": {");
+    mg_printf(nc, "}, \"event\": %u", p->event);
+    mg_printf(nc, ", \"config\": {");
     mg_printf(nc, "\"set_start\": %u, ", p->cfg.set_start);
-    mg_printf(nc, "\"set_end\": %u", p->cfg.set_end);
-    mg_printf(nc, "}");
+    mg_printf(nc, "\"set_end\": %u, ", p->cfg.set_end);
+    mg_printf(nc, "\"output\": \"%s\", ", output_names[p->cfg.output]);
+    mg_printf(nc, "\"refills\": %u, ", p->cfg.refills);
+    print_sets(nc, &p->cfg);
+    mg_printf(nc, ", \"group_size\": %u", p->cfg.group_size);
+    mg_printf(nc, "}, \"calibrated\": %s", p->calibrated ? "true" : "false");
   }
 }
 
@@ -90,14 +231,22 @@ void handle_probe_config (struct mg_connection *nc, void *data, enum probe_type
   } else if (0 == mg_strcmp(POST, msg->method)) {
     char start_s[10];
     char end_s[10];
-    unsigned int start, end;
+    struct probe_config cfg;
+    bool calibrate;
 
     if (mg_get_http_var(body, "set_start", start_s, sizeof(start_s)) > 0 &&
 	mg_get_http_var(body,   "set_end",   end_s, sizeof(  end_s)) > 0 &&
-	1 == sscanf(start_s, "%u", &start) &&
-	1 == sscanf(  end_s, "%u",   &end)) {
-      scope_set_probe_configuration(t, start, end);
+	1 == sscanf(start_s, "%u", &cfg.set_start) &&
+	1 == sscanf(  end_s, "%u",   &cfg.set_end) &&
+	get_probe_output(&cfg.output, body) &&
+	get_probe_refills(&cfg.refills, &calibrate, body) &&
+	get_probe_sets(&cfg, body) &&
+	get_probe_group_size(&cfg.group_size, body)) {
+      scope_set_probe_configuration(t, &cfg);
       err = CG_OK;
+      // Calibrate for the set range just configured
+      if (calibrate)
+	err = scope_calibrate_probe(t, NULL);
     }
     respond_status(nc, err);
   } else {
@@ -109,6 +258,7 @@ void handle_probe_connect (struct mg_connection *nc, void *data, enum probe_type
   struct http_message *msg = data;
   enum CGState err = CG_BAD_ARG;
   struct cache_shape s;
+  unsigned int event;
   
   if (0 != mg_strcmp(POST, msg->method))
     goto done;
@@ -116,7 +266,10 @@ void handle_probe_connect (struct mg_connection *nc, void *data, enum probe_type
   if (!get_cache_shape(&s, &msg->body))
     goto done;
 
-  err = scope_attach_probe(t, &s);
+  if (!get_probe_event(&event, &msg->body))
+    goto done;
+
+  err = scope_attach_probe(t, &s, event);
  done:
   respond_status(nc, err);
 }
@@ -190,3 +343,16 @@ void handle_btb_disconnect (struct mg_connection *nc, int ev, void *data) {
 void handle_btb_data (struct mg_connection *nc, int ev, void *data) {
   handle_probe_data(nc, data, PROBE_TYPE_BTB);
 }
+
+void handle_l2_config (struct mg_connection *nc, int ev, void *data) {
+  handle_probe_config(nc, data, PROBE_TYPE_L2);
+}
+void handle_l2_connect (struct mg_connection *nc, int ev, void *data) {
+  handle_probe_connect(nc, data, PROBE_TYPE_L2);
+}
+void handle_l2_disconnect (struct mg_connection *nc, int ev, void *data) {
+  handle_probe_disconnect(nc, data, PROBE_TYPE_L2);
+}
+void handle_l2_data (struct mg_connection *nc, int ev, void *data) {
+  handle_probe_data(nc, data, PROBE_TYPE_L2);
+}
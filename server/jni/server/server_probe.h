@@ -46,4 +46,9 @@ void handle_btb_connect (struct mg_connection *nc, int ev, void *data);
 void handle_btb_disconnect (struct mg_connection *nc, int ev, void *data);
 void handle_btb_data (struct mg_connection *nc, int ev, void *data);
 
+void handle_l2_config (struct mg_connection *nc, int ev, void *data);
+void handle_l2_connect (struct mg_connection *nc, int ev, void *data);
+void handle_l2_disconnect (struct mg_connection *nc, int ev, void *data);
+void handle_l2_data (struct mg_connection *nc, int ev, void *data);
+
 #endif
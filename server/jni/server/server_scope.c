@@ -26,10 +26,27 @@
 #include "server_scope.h"
 
 #include "scope.h"
+#include "server_capture.h"
 #include "server_probe.h"
 
+/**
+ * Print the shape of a cache, or an empty object if there is none.
+ */
+static void print_cache_shape (struct mg_connection *nc, const char *name,
+			       struct cache_shape *s) {
+  mg_printf(nc, "\"%s\": {", name);
+  if (s->num_sets > 0) {
+    mg_printf(nc, "\"num_sets\": %u, ", s->num_sets);
+    mg_printf(nc, "\"associativity\": %u, ", s->associativity);
+    mg_printf(nc, "\"line_size\": %u", s->line_size);
+  }
+  mg_printf(nc, "}");
+}
+
 void handle_system (struct mg_connection *nc, int ev, void *data) {
   struct http_message *msg = data;
+  struct cache_geometry g;
+  long num_cores = sysconf( _SC_NPROCESSORS_ONLN );
   
   if (0 != mg_strcmp(GET, msg->method)) {
     respond_status(nc, CG_BAD_CMD);
@@ -40,7 +57,24 @@ void handle_system (struct mg_connection *nc, int ev, void *data) {
   mg_printf(nc, "{");
   print_status(nc, CG_OK);
   mg_printf(nc, ", ");
-  mg_printf(nc, "\"num_cores\": %ld", sysconf( _SC_NPROCESSORS_ONLN ));
+  mg_printf(nc, "\"num_cores\": %ld", num_cores);
+
+  // The caches of each core, which differ between clusters on big.LITTLE
+  mg_printf(nc, ", \"caches\": [");
+  for (int cpu = 0; cpu < num_cores; cpu++) {
+    if (cpu > 0)
+      mg_printf(nc, ", ");
+    mg_printf(nc, "{");
+    if (scope_cache_geometry(cpu, &g) == CG_OK) {
+      print_cache_shape(nc, "l1d", &g.l1d);
+      mg_printf(nc, ", ");
+      print_cache_shape(nc, "l1i", &g.l1i);
+      mg_printf(nc, ", ");
+      print_cache_shape(nc, "l2", &g.l2);
+    }
+    mg_printf(nc, "}");
+  }
+  mg_printf(nc, "]");
   mg_printf(nc, "}");
   HTTP_DONE(nc);
 }
@@ -66,9 +100,10 @@ void handle_status (struct mg_connection *nc, int ev, void *data) {
   mg_printf(nc, "{");
   print_status(nc, CG_OK);
   mg_printf(nc, ", \"scope\": {");
-  
+  mg_printf(nc, "\"id\": %u", s->id);
+
   if (s->connected) {
-    mg_printf(nc, "\"target_cpu\": %d", s->target_cpu);
+    mg_printf(nc, ", \"target_cpu\": %d", s->target_cpu);
     mg_printf(nc, ", \"scope_cpu\": %d", s->scope_cpu);
     mg_printf(nc, ", \"probes\": {");
 
@@ -84,6 +119,10 @@ void handle_status (struct mg_connection *nc, int ev, void *data) {
     if (s->btb.attached) {
       print_probe(nc, &s->btb);
     }
+    mg_printf(nc, "}, \"l2\": {");
+    if (s->l2.attached) {
+      print_probe(nc, &s->l2);
+    }
     mg_printf(nc, "}");
     
     mg_printf(nc, "}");
@@ -134,3 +173,36 @@ void handle_disconnect (struct mg_connection *nc, int ev, void *data) {
  done:
   respond_status(nc, err);
 }
+
+/**
+ * Find the baseline of the probes with the target idle. A sample count of 0
+ * clears the baselines.
+ */
+void handle_calibrate (struct mg_connection *nc, int ev, void *data) {
+  struct http_message *msg = data;
+  struct mg_str *body = &msg->body;
+  enum CGState err = CG_BAD_ARG;
+  char samp_s[10];
+  char del_s[10];
+  char pct_s[10];
+  unsigned int samples, delta, percentile;
+
+  if (0 != mg_strcmp(POST, msg->method))
+    goto done;
+
+  if (mg_get_http_var(body, "samples", samp_s, sizeof(samp_s)) <= 0 ||
+      1 != sscanf(samp_s, "%u", &samples))
+    samples = DEFAULT_CALIBRATE_SAMPLES;
+
+  if (mg_get_http_var(body, "time_delta", del_s, sizeof(del_s)) <= 0 ||
+      1 != sscanf(del_s, "%u", &delta))
+    delta = DEFAULT_DELTA;
+
+  if (mg_get_http_var(body, "percentile", pct_s, sizeof(pct_s)) <= 0 ||
+      1 != sscanf(pct_s, "%u", &percentile))
+    percentile = 0;
+
+  err = scope_calibrate_baseline(samples, delta, percentile);
+ done:
+  respond_status(nc, err);
+}
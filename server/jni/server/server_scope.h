@@ -27,9 +27,12 @@
 
 #include <mongoose.h>
 
+#define DEFAULT_CALIBRATE_SAMPLES 1000
+
 void handle_system (struct mg_connection *nc, int ev, void *data);
 void handle_status (struct mg_connection *nc, int ev, void *data);
 void handle_connect (struct mg_connection *nc, int ev, void *data);
 void handle_disconnect (struct mg_connection *nc, int ev, void *data);
+void handle_calibrate (struct mg_connection *nc, int ev, void *data);
 
 #endif
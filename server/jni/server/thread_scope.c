@@ -24,6 +24,7 @@
 
 #include "capture.h"
 
+#include "capture_data.h"
 #include "scope.h"
 
 bool get_scope_args (struct scope_args *arg, struct capture_config *c, int cpu) {
@@ -31,6 +32,17 @@ bool get_scope_args (struct scope_args *arg, struct capture_config *c, int cpu)
   arg->max_samples = c->max_samples;
   arg->time_delta = c->scope_time_delta;
   arg->timeout = c->scope_timeout;
+  arg->nsamples = 0;
+  arg->pretrigger = c->pretrigger;
+  arg->batch = c->batch;
+  arg->trigger_index = 0;
+  arg->stream = c->stream;
+  arg->accumulate = c->accumulate > 0;
+  arg->timer = c->timer;
+  arg->deferred = c->deferred;
+  arg->packed = c->packed;
+  arg->sparse = c->sparse;
+  arg->data = NULL;
   return true;
 }
 
@@ -42,6 +54,9 @@ void* scope_func (void* p_arg) {
     set_shared_status(arg->shared, CG_CAPTURE_ERR);
   }
   // set up scope
+  if (scope_configure(arg->deferred, arg->packed, arg->sparse) != CG_OK) {
+    set_shared_status(arg->shared, CG_CAPTURE_ERR);
+  }
   if (scope_prepare(arg->max_samples) == 0) {
     set_shared_status(arg->shared, CG_NO_MEM);
   }
@@ -51,7 +66,22 @@ void* scope_func (void* p_arg) {
   if (get_shared_status(arg->shared) == CG_OK) {
     // do scope things
     unsigned int collected_samples;
-    collected_samples = scope_collect(arg->time_delta, arg->timeout);
+    if (arg->stream) {
+      // Drain the ring while the kernel collects, so the capture is not
+      // limited to max_samples.
+      if (scope_stream(arg->time_delta, arg->timeout, arg->timer,
+		       arg->batch) != CG_OK) {
+	set_shared_status(arg->shared, CG_CAPTURE_ERR);
+	return NULL;
+      }
+      arg->data = capture_data_stream(&collected_samples);
+      if (arg->data == NULL)
+	set_shared_status(arg->shared, CG_NO_MEM);
+    } else {
+      collected_samples = scope_collect(arg->time_delta, arg->timeout, arg->timer,
+					arg->pretrigger, arg->batch,
+					arg->accumulate, &arg->trigger_index);
+    }
     arg->nsamples = collected_samples;
   }
   return NULL;
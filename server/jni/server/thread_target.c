@@ -25,6 +25,7 @@
 #include "capture.h"
 
 #include <sched.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <sys/wait.h>
 
@@ -33,9 +34,12 @@
 #define ENV_NAME "CACHEGRAB_NAME"
 #define ENV_CMDBUF "CACHEGRAB_COMMAND_BUF"
 #define ENV_DEBUG "CACHEGRAB_DEBUG"
+#define ENV_SCOPE "CACHEGRAB_SCOPE"
 
-bool get_target_args (struct target_args *arg, struct capture_config *c, int cpu) {
+bool get_target_args (struct target_args *arg, struct capture_config *c, int cpu,
+		      unsigned int scope_id) {
   arg->cpu = cpu;
+  arg->scope_id = scope_id;
   arg->command = c->command;
   arg->name = c->name;
   arg->cbuf = c->cbuf;
@@ -117,6 +121,9 @@ bool run_command (struct target_args* arg) {
     setenv(ENV_NAME, arg->name, 1);
     setenv(ENV_CMDBUF, arg->cbuf, 1);
     setenv(ENV_DEBUG, arg->debug ? "y" : "n", 1);
+    char scope_id[12];
+    snprintf(scope_id, sizeof(scope_id), "%u", arg->scope_id);
+    setenv(ENV_SCOPE, scope_id, 1);
     
     char* argv[] = {"/system/bin/sh", "-c", arg->command, NULL};
     execv("/system/bin/sh", argv);
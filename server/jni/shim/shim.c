@@ -36,6 +36,7 @@
 #define ENV_NAME "CACHEGRAB_NAME"
 #define ENV_CMDBUF "CACHEGRAB_COMMAND_BUF"
 #define ENV_DEBUG "CACHEGRAB_DEBUG"
+#define ENV_SCOPE "CACHEGRAB_SCOPE"
 
 #define TAG "CACHEGRAB_SHIM: "
 
@@ -101,6 +102,14 @@ void init (void) {
     fd_valid = 1;
   }
 
+  // Trigger the scope of the server which started us
+  char* scope_id = getenv(ENV_SCOPE);
+  if (fd_valid && scope_id != NULL) {
+    unsigned long id = strtoul(scope_id, NULL, 10);
+    if (ioctl(fd, CG_SCOPE_SELECT, id) != 0)
+      fd_valid = 0;
+  }
+
   // Initialize target name
   target_name = getenv(ENV_NAME);
   if (target_name != NULL) {